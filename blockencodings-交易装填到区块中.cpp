@@ -14,7 +14,7 @@
 #include "validation.h"
 #include "util.h"
 
-#include <unordered_map>
+#include <limits>
 
 #define MIN_TRANSACTION_BASE_SIZE (::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION | SERIALIZE_TRANSACTION_NO_WITNESS))
 
@@ -49,6 +49,145 @@ uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
     return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffL;
 }
 
+#define SIPROUND_LANES do { \
+    for (int l = 0; l < SHORTTXIDS_BATCH; l++) { \
+        v0[l] += v1[l]; v1[l] = (v1[l] << 13) | (v1[l] >> 51); v1[l] ^= v0[l]; \
+        v0[l] = (v0[l] << 32) | (v0[l] >> 32); \
+        v2[l] += v3[l]; v3[l] = (v3[l] << 16) | (v3[l] >> 48); v3[l] ^= v2[l]; \
+        v0[l] += v3[l]; v3[l] = (v3[l] << 21) | (v3[l] >> 43); v3[l] ^= v0[l]; \
+        v2[l] += v1[l]; v1[l] = (v1[l] << 17) | (v1[l] >> 47); v1[l] ^= v2[l]; \
+        v2[l] = (v2[l] << 32) | (v2[l] >> 32); \
+    } \
+} while (0)
+
+void CBlockHeaderAndShortTxIDs::GetShortIDs(const uint256* const txhashes[SHORTTXIDS_BATCH], uint64_t shortids[SHORTTXIDS_BATCH]) const
+{
+    static_assert(SHORTTXIDS_LENGTH == 6, "shorttxids calculation assumes 6-byte shorttxids");
+    // SipHashUint256 with the lanes side by side, the loops over the lanes have no
+    // dependencies between them and compile to vector instructions where available
+    uint64_t v0[SHORTTXIDS_BATCH], v1[SHORTTXIDS_BATCH], v2[SHORTTXIDS_BATCH], v3[SHORTTXIDS_BATCH], d[SHORTTXIDS_BATCH];
+    for (int l = 0; l < SHORTTXIDS_BATCH; l++) {
+        v0[l] = 0x736f6d6570736575ULL ^ shorttxidk0;
+        v1[l] = 0x646f72616e646f6dULL ^ shorttxidk1;
+        v2[l] = 0x6c7967656e657261ULL ^ shorttxidk0;
+        v3[l] = 0x7465646279746573ULL ^ shorttxidk1;
+    }
+    for (int w = 0; w < 4; w++) {
+        for (int l = 0; l < SHORTTXIDS_BATCH; l++) {
+            d[l] = txhashes[l]->GetUint64(w);
+            v3[l] ^= d[l];
+        }
+        SIPROUND_LANES;
+        SIPROUND_LANES;
+        for (int l = 0; l < SHORTTXIDS_BATCH; l++)
+            v0[l] ^= d[l];
+    }
+    for (int l = 0; l < SHORTTXIDS_BATCH; l++)
+        v3[l] ^= ((uint64_t)4) << 59;
+    SIPROUND_LANES;
+    SIPROUND_LANES;
+    for (int l = 0; l < SHORTTXIDS_BATCH; l++) {
+        v0[l] ^= ((uint64_t)4) << 59;
+        v2[l] ^= 0xFF;
+    }
+    SIPROUND_LANES;
+    SIPROUND_LANES;
+    SIPROUND_LANES;
+    SIPROUND_LANES;
+    for (int l = 0; l < SHORTTXIDS_BATCH; l++)
+        shortids[l] = (v0[l] ^ v1[l] ^ v2[l] ^ v3[l]) & 0xffffffffffffL;
+}
+
+#undef SIPROUND_LANES
+
+namespace {
+
+/**
+ * Open addressing table from short IDs to block positions, replacing a node based
+ * std::unordered_map on the path that probes it for every mempool transaction.
+ * Short IDs are 48 bits, so an all ones key marks a free slot and bit 48 marks a
+ * short ID shared by several block transactions. Peers choose the short IDs, so
+ * slots are picked from the ID mixed with a random salt and a run longer than
+ * MAX_PROBE is treated like the overfull bucket check it replaces.
+ */
+class ShortTxIDTable
+{
+private:
+    static const uint64_t EMPTY = std::numeric_limits<uint64_t>::max();
+    static const uint64_t COLLIDED = uint64_t(1) << 48;
+    static const size_t MAX_PROBE = 64;
+
+    std::vector<uint64_t> keys;
+    std::vector<uint16_t> values;
+    size_t mask;
+    int shift;
+    uint64_t salt;
+    size_t count;
+
+    size_t Slot(uint64_t shortid) const
+    {
+        return ((shortid ^ salt) * 0x9e3779b97f4a7c15ULL) >> shift;
+    }
+
+public:
+    explicit ShortTxIDTable(size_t nElements) : count(0)
+    {
+        // At most half full
+        size_t nSlots = 16;
+        shift = 60;
+        while (nSlots < nElements * 2) {
+            nSlots <<= 1;
+            shift--;
+        }
+        keys.assign(nSlots, std::numeric_limits<uint64_t>::max());
+        values.resize(nSlots);
+        mask = nSlots - 1;
+        salt = GetRand(std::numeric_limits<uint64_t>::max());
+    }
+
+    // Number of short IDs that belong to a single block transaction
+    size_t size() const { return count; }
+
+    // Adds a short ID, a second one marks it collided. Returns false if its probe run is too long
+    bool Insert(uint64_t shortid, uint16_t index)
+    {
+        size_t slot = Slot(shortid);
+        for (size_t i = 0; i < MAX_PROBE; i++, slot = (slot + 1) & mask) {
+            if (keys[slot] == EMPTY) {
+                keys[slot] = shortid;
+                values[slot] = index;
+                count++;
+                return true;
+            }
+            if ((keys[slot] & ~COLLIDED) == shortid) {
+                if (!(keys[slot] & COLLIDED)) {
+                    keys[slot] |= COLLIDED;
+                    count--;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Finds the position of a short ID, collided ones are left to the peer to send
+    bool Find(uint64_t shortid, uint16_t& index) const
+    {
+        size_t slot = Slot(shortid);
+        for (size_t i = 0; i < MAX_PROBE; i++, slot = (slot + 1) & mask) {
+            if (keys[slot] == shortid) {
+                index = values[slot];
+                return true;
+            }
+            if (keys[slot] == EMPTY || keys[slot] == (shortid | COLLIDED))
+                return false;
+        }
+        return false;
+    }
+};
+
+} // namespace
+
 
 
 ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock, const std::vector<std::pair<uint256, CTransactionRef>>& extra_txn)
@@ -84,48 +223,59 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
     // Because well-formed cmpctblock messages will have a (relatively) uniform distribution
     // of short IDs, any highly-uneven distribution of elements can be safely treated as a
     // READ_STATUS_FAILED.
-    std::unordered_map<uint64_t, uint16_t> shorttxids(cmpctblock.shorttxids.size());
+    ShortTxIDTable shorttxids(cmpctblock.shorttxids.size());
     uint16_t index_offset = 0;
     for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
         while (txn_available[i + index_offset])
             index_offset++;
-        shorttxids[cmpctblock.shorttxids[i]] = i + index_offset;
-        // To determine the chance that the number of entries in a bucket exceeds N,
-        // we use the fact that the number of elements in a single bucket is
-        // binomially distributed (with n = the number of shorttxids S, and p =
-        // 1 / the number of buckets), that in the worst case the number of buckets is
-        // equal to S (due to std::unordered_map having a default load factor of 1.0),
-        // and that the chance for any bucket to exceed N elements is at most
-        // buckets * (the chance that any given bucket is above N elements).
-        // Thus: P(max_elements_per_bucket > N) <= S * (1 - cdf(binomial(n=S,p=1/S), N)).
-        // If we assume blocks of up to 16000, allowing 12 elements per bucket should
-        // only fail once per ~1 million block transfers (per peer and connection).
-        if (shorttxids.bucket_size(shorttxids.bucket(cmpctblock.shorttxids[i])) > 12)
+        // With the table at most half full, a run of 64 occupied slots after a salted
+        // slot should not happen in honest blocks of up to 16000 transactions.
+        if (!shorttxids.Insert(cmpctblock.shorttxids[i], i + index_offset))
             return READ_STATUS_FAILED;
     }
-    // TODO: in the shortid-collision case, we should instead request both transactions
-    // which collided. Falling back to full-block-request here is overkill.
-    if (shorttxids.size() != cmpctblock.shorttxids.size())
-        return READ_STATUS_FAILED; // Short ID collision
+    // Short IDs shared by several block transactions are never matched, so all of
+    // them stay missing and only those are requested with the rest we don't have.
+    size_t collided_count = cmpctblock.shorttxids.size() - shorttxids.size();
 
     std::vector<bool> have_txn(txn_available.size());
     {
         LOCK(pool->cs);
         const std::vector<std::pair<uint256, CTxMemPool::txiter> >& vTxHashes = pool->vTxHashes;
+        // Short IDs already computed for this selector, e.g. when the same block is
+        // announced again, are reused
+        std::vector<uint64_t>& vShortIDs = pool->GetShortTxIDCache(cmpctblock.shorttxidk0, cmpctblock.shorttxidk1).shortids;
+        assert(vShortIDs.size() == vTxHashes.size());
+        const int nBatch = CBlockHeaderAndShortTxIDs::SHORTTXIDS_BATCH;
+        const uint256* txhashes[nBatch];
+        uint64_t shortids[nBatch];
         for (size_t i = 0; i < vTxHashes.size(); i++) {
-            uint64_t shortid = cmpctblock.GetShortID(vTxHashes[i].first);
-            std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-            if (idit != shorttxids.end()) {
-                if (!have_txn[idit->second]) {
-                    txn_available[idit->second] = vTxHashes[i].second->GetSharedTx();
-                    have_txn[idit->second]  = true;
+            // Hash the next batch of mempool txids together, the tail one at a time
+            size_t lane = i % nBatch;
+            if (lane == 0 && i + nBatch <= vTxHashes.size()) {
+                bool fUnknown = false;
+                for (int l = 0; l < nBatch; l++)
+                    fUnknown |= vShortIDs[i + l] == CTxMemPool::SHORTTXID_UNKNOWN;
+                if (fUnknown) {
+                    for (int l = 0; l < nBatch; l++)
+                        txhashes[l] = &vTxHashes[i + l].first;
+                    cmpctblock.GetShortIDs(txhashes, shortids);
+                    std::copy(shortids, shortids + nBatch, vShortIDs.begin() + i);
+                }
+            } else if (i + nBatch - lane > vTxHashes.size() && vShortIDs[i] == CTxMemPool::SHORTTXID_UNKNOWN) {
+                vShortIDs[i] = cmpctblock.GetShortID(vTxHashes[i].first);
+            }
+            uint16_t index;
+            if (shorttxids.Find(vShortIDs[i], index)) {
+                if (!have_txn[index]) {
+                    txn_available[index] = vTxHashes[i].second->GetSharedTx();
+                    have_txn[index]  = true;
                     mempool_count++;
                 } else {
                     // If we find two mempool txn that match the short id, just request it.
                     // This should be rare enough that the extra bandwidth doesn't matter,
                     // but eating a round-trip due to FillBlock failure would be annoying
-                    if (txn_available[idit->second]) {
-                        txn_available[idit->second].reset();
+                    if (txn_available[index]) {
+                        txn_available[index].reset();
                         mempool_count--;
                     }
                 }
@@ -140,11 +290,11 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
 
     for (size_t i = 0; i < extra_txn.size(); i++) {
         uint64_t shortid = cmpctblock.GetShortID(extra_txn[i].first);
-        std::unordered_map<uint64_t, uint16_t>::iterator idit = shorttxids.find(shortid);
-        if (idit != shorttxids.end()) {
-            if (!have_txn[idit->second]) {
-                txn_available[idit->second] = extra_txn[i].second;
-                have_txn[idit->second]  = true;
+        uint16_t index;
+        if (shorttxids.Find(shortid, index)) {
+            if (!have_txn[index]) {
+                txn_available[index] = extra_txn[i].second;
+                have_txn[index]  = true;
                 mempool_count++;
                 extra_count++;
             } else {
@@ -154,9 +304,9 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
                 // but eating a round-trip due to FillBlock failure would be annoying
                 // Note that we dont want duplication between extra_txn and mempool to
                 // trigger this case, so we compare witness hashes first
-                if (txn_available[idit->second] &&
-                        txn_available[idit->second]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
-                    txn_available[idit->second].reset();
+                if (txn_available[index] &&
+                        txn_available[index]->GetWitnessHash() != extra_txn[i].second->GetWitnessHash()) {
+                    txn_available[index].reset();
                     mempool_count--;
                     extra_count--;
                 }
@@ -169,7 +319,7 @@ ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& c
             break;
     }
 
-    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu with %lu colliding short IDs\n", cmpctblock.header.GetHash().ToString(), GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION), collided_count);
 
     return READ_STATUS_OK;
 }
@@ -205,16 +355,12 @@ ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<
     if (vtx_missing.size() != tx_missing_offset)
         return READ_STATUS_INVALID;
 
-    CValidationState state;
-    if (!CheckBlock(block, state, Params().GetConsensus())) {
-        // TODO: We really want to just check merkle tree manually here,
-        // but that is expensive, and CheckBlock caches a block's
-        // "checked-status" (in the CBlock?). CBlock should be able to
-        // check its own merkle root and cache that check.
-        if (state.CorruptionPossible())
-            return READ_STATUS_FAILED; // Possible Short ID collision
-        return READ_STATUS_CHECKBLOCK_FAILED;
-    }
+    // A wrong mempool match for a short ID shows up as a merkle root mismatch. The
+    // rest of CheckBlock runs when the block is processed, where an invalid block
+    // is punished as usual.
+    bool mutated;
+    if (block.BuildMerkleTree(&mutated) != block.hashMerkleRoot || mutated)
+        return READ_STATUS_FAILED; // Possible Short ID collision
 
     LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled, %lu txn from mempool (incl at least %lu from extra pool) and %lu txn requested\n", hash.ToString(), prefilled_count, mempool_count, extra_count, vtx_missing.size());
     if (vtx_missing.size() < 5) {
@@ -159,6 +159,12 @@ public:
 
     uint64_t GetShortID(const uint256& txhash) const;
 
+    static const int SHORTTXIDS_BATCH = 4;
+
+    // Same as GetShortID for SHORTTXIDS_BATCH hashes at once, interleaved so the
+    // SipHash rounds of all lanes can run in vector registers
+    void GetShortIDs(const uint256* const txhashes[SHORTTXIDS_BATCH], uint64_t shortids[SHORTTXIDS_BATCH]) const;
+
     size_t BlockTxCount() const
     {
         return shorttxids.size() + prefilledtxn.size();
@@ -13,6 +13,8 @@
 #include "uint256.h"
 
 #include <stdint.h>
+#include <deque>
+#include <limits>
 
 #include <boost/thread.hpp>
 
@@ -39,6 +41,9 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 static const char DB_ANONYMOUS_BLOCK = 'x';
+static const char DB_INDEX_BEST_BLOCK = 'I';
+static const char DB_ADDRESSUTXOHEIGHT = 'U';
+static const char DB_INDEX_SNAPSHOT = 'N';
 
 void static BatchWriteHashBestChain(CDBBatch& batch, const uint256& hash)
 {
@@ -308,9 +313,21 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     for (std::vector<const CBlockIndex*>::const_iterator it = blockinfo.begin(); it != blockinfo.end(); it++) {
         batch.Write(make_pair(DB_BLOCK_INDEX, (*it)->GetBlockHash()), CDiskBlockIndex(*it));
     }
+    // Any block index snapshot no longer matches the database.
+    batch.Erase(DB_INDEX_SNAPSHOT);
     return WriteBatch(batch, true);
 }
 
+bool CBlockTreeDB::ReadIndexSnapshotId(uint256& id)
+{
+    return Read(DB_INDEX_SNAPSHOT, id);
+}
+
+bool CBlockTreeDB::WriteIndexSnapshotId(const uint256& id)
+{
+    return Write(DB_INDEX_SNAPSHOT, id, true);
+}
+
 bool CBlockTreeDB::ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
 {
     return Read(make_pair(DB_TXINDEX, txid), pos);
@@ -384,6 +401,217 @@ bool CBlockTreeDB::ReadAddressUnspentIndex(uint160 addressHash, int type,
 
 
 
+//! Heights read at once when walking the address index backwards, doubled on every step
+static const int ADDRESS_INDEX_REVERSE_WINDOW = 1000;
+
+//! Order of two values ser_writedata32 stores little endian, as the database compares their bytes
+static int CompareLE32(uint32_t a, uint32_t b)
+{
+    uint32_t leA = htole32(a);
+    uint32_t leB = htole32(b);
+    return memcmp(&leA, &leB, sizeof(uint32_t));
+}
+
+bool CompareAddressIndexKey::operator()(const CAddressIndexKey& a, const CAddressIndexKey& b) const
+{
+    if ((uint8_t)a.type != (uint8_t)b.type)
+        return (uint8_t)a.type < (uint8_t)b.type;
+    if (a.hashBytes != b.hashBytes)
+        return a.hashBytes < b.hashBytes;
+    // Heights and transaction positions are stored big endian
+    if (a.blockHeight != b.blockHeight)
+        return (uint32_t)a.blockHeight < (uint32_t)b.blockHeight;
+    if (a.txindex != b.txindex)
+        return (uint32_t)a.txindex < (uint32_t)b.txindex;
+    if (a.txhash != b.txhash)
+        return a.txhash < b.txhash;
+    if ((uint32_t)a.index != (uint32_t)b.index)
+        return CompareLE32(a.index, b.index) < 0;
+    return !a.spending && b.spending;
+}
+
+bool CompareAddressUnspentKey::operator()(const CAddressUnspentKey& a, const CAddressUnspentKey& b) const
+{
+    if ((uint8_t)a.type != (uint8_t)b.type)
+        return (uint8_t)a.type < (uint8_t)b.type;
+    if (a.hashBytes != b.hashBytes)
+        return a.hashBytes < b.hashBytes;
+    if (a.txhash != b.txhash)
+        return a.txhash < b.txhash;
+    return CompareLE32(a.index, b.index) < 0;
+}
+
+//! Entries a reverse walk still has to collect: the page, its offset and one more to see if there are more
+static size_t ReverseKeep(const CAddressIndexQuery& query, size_t nFound)
+{
+    if (!query.nLimit)
+        return std::numeric_limits<size_t>::max();
+    size_t nWant = query.nOffset + query.nLimit + 1;
+    return nFound < nWant ? nWant - nFound : 0;
+}
+
+//! Cut the page out of the entries a reverse walk collected, newest first
+template <typename Key, typename Value>
+static void TakeReversePage(std::vector<std::pair<Key, Value> >& vFound, const CAddressIndexQuery& query, CAddressIndexPage<Key, Value>& page)
+{
+    size_t nBegin = std::min(query.nOffset, vFound.size());
+    size_t nEnd = vFound.size();
+    if (query.nLimit && nBegin + query.nLimit < nEnd) {
+        nEnd = nBegin + query.nLimit;
+        page.fMore = true;
+    }
+    page.vEntries.assign(vFound.begin() + nBegin, vFound.begin() + nEnd);
+    if (!page.vEntries.empty())
+        page.keyLast = page.vEntries.back().first;
+}
+
+bool CBlockTreeDB::ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                        const CAddressIndexKey* pkeyAfter, CAddressIndexPageResult& page)
+{
+    if (query.fReverse) {
+        int nBottomLimit = std::max(query.nStart, 0);
+        int nTop = query.nEnd > 0 ? query.nEnd : std::max(chainActive.Height(), 0);
+        if (pkeyAfter)
+            nTop = std::min(nTop, (int)pkeyAfter->blockHeight);
+
+        std::vector<std::pair<CAddressIndexKey, CAmount> > vFound;
+        int nWindow = ADDRESS_INDEX_REVERSE_WINDOW;
+        while (nTop >= nBottomLimit) {
+            size_t nKeep = ReverseKeep(query, vFound.size());
+            if (nKeep == 0 && !query.fSum)
+                break;
+            int nBottom = std::max(nBottomLimit, nTop - nWindow + 1);
+
+            std::deque<std::pair<CAddressIndexKey, CAmount> > window;
+            boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+            for (pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, nBottom))); pcursor->Valid(); pcursor->Next()) {
+                boost::this_thread::interruption_point();
+                std::pair<char, CAddressIndexKey> key;
+                if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX || key.second.hashBytes != addressHash || (int)key.second.type != type)
+                    break;
+                if ((int)key.second.blockHeight > nTop || (pkeyAfter && !CompareAddressIndexKey()(key.second, *pkeyAfter)))
+                    break;
+                CAmount nValue;
+                if (!pcursor->GetValue(nValue))
+                    return error("failed to get address index value");
+                if (query.fSum) {
+                    page.nSum += nValue;
+                    page.nCount++;
+                }
+                if (nKeep == 0)
+                    continue;
+                window.push_back(make_pair(key.second, nValue));
+                if (window.size() > nKeep)
+                    window.pop_front();
+            }
+            vFound.insert(vFound.end(), window.rbegin(), window.rend());
+
+            nTop = nBottom - 1;
+            if (nWindow < (1 << 20))
+                nWindow *= 2;
+        }
+        TakeReversePage(vFound, query, page);
+        return true;
+    }
+
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    if (pkeyAfter) {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, *pkeyAfter));
+    } else if (query.nStart > 0) {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorHeightKey(type, addressHash, query.nStart)));
+    } else {
+        pcursor->Seek(make_pair(DB_ADDRESSINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    }
+
+    size_t nSkip = query.nOffset;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressIndexKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSINDEX || key.second.hashBytes != addressHash || (int)key.second.type != type)
+            break;
+        if (query.nEnd > 0 && (int)key.second.blockHeight > query.nEnd)
+            break;
+        if ((pkeyAfter && !CompareAddressIndexKey()(*pkeyAfter, key.second)) || (int)key.second.blockHeight < query.nStart)
+            continue;
+        if (query.nLimit && page.vEntries.size() >= query.nLimit) {
+            page.fMore = true;
+            if (!query.fSum)
+                break;
+        }
+        CAmount nValue;
+        if (!pcursor->GetValue(nValue))
+            return error("failed to get address index value");
+        if (query.fSum) {
+            page.nSum += nValue;
+            page.nCount++;
+        }
+        if (nSkip > 0)
+            nSkip--;
+        else if (!query.nLimit || page.vEntries.size() < query.nLimit)
+            page.vEntries.push_back(make_pair(key.second, nValue));
+    }
+    if (!page.vEntries.empty())
+        page.keyLast = page.vEntries.back().first;
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                               const CAddressUnspentKey* pkeyAfter, CAddressUnspentPageResult& page)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+    if (pkeyAfter && !query.fReverse) {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, *pkeyAfter));
+    } else {
+        pcursor->Seek(make_pair(DB_ADDRESSUNSPENTINDEX, CAddressIndexIteratorKey(type, addressHash)));
+    }
+
+    // The unspent index is keyed by txid, so a reverse walk has to pass over
+    // every entry up to the continuation key; it only keeps the last ones.
+    std::deque<std::pair<CAddressUnspentKey, CAddressUnspentValue> > window;
+    size_t nSkip = query.nOffset;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressUnspentKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUNSPENTINDEX || key.second.hashBytes != addressHash || (int)key.second.type != type)
+            break;
+        if (pkeyAfter) {
+            if (query.fReverse && !CompareAddressUnspentKey()(key.second, *pkeyAfter))
+                break;
+            if (!query.fReverse && !CompareAddressUnspentKey()(*pkeyAfter, key.second))
+                continue;
+        }
+        if (!query.fReverse && query.nLimit && page.vEntries.size() >= query.nLimit) {
+            page.fMore = true;
+            if (!query.fSum)
+                break;
+        }
+        CAddressUnspentValue value;
+        if (!pcursor->GetValue(value))
+            return error("failed to get address unspent value");
+        if (query.fSum) {
+            page.nSum += value.satoshis;
+            page.nCount++;
+        }
+        if (query.fReverse) {
+            window.push_back(make_pair(key.second, value));
+            if (query.nLimit && window.size() > query.nOffset + query.nLimit + 1)
+                window.pop_front();
+        } else if (nSkip > 0) {
+            nSkip--;
+        } else if (!query.nLimit || page.vEntries.size() < query.nLimit) {
+            page.vEntries.push_back(make_pair(key.second, value));
+        }
+    }
+
+    if (query.fReverse) {
+        std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vFound(window.rbegin(), window.rend());
+        TakeReversePage(vFound, query, page);
+    } else if (!page.vEntries.empty()) {
+        page.keyLast = page.vEntries.back().first;
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteAddressIndex(const std::vector<std::pair<CAddressIndexKey, CAmount > >& vect)
 {
     CDBBatch batch(*this);
@@ -435,6 +663,34 @@ bool CBlockTreeDB::ReadAddressIndex(uint160 addressHash, int type,
     return true;
 }
 
+bool CBlockTreeDB::ReadAddressUtxoAtHeight(uint160 addressHash, int type, int nHeight, CAmount nMinValue,
+                                           std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> >& vect,
+                                           size_t nMaxResults)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
+
+    pcursor->Seek(make_pair(DB_ADDRESSUTXOHEIGHT, CAddressUtxoHeightIteratorKey(type, addressHash, 0)));
+
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        std::pair<char, CAddressUtxoHeightKey> key;
+        if (!pcursor->GetKey(key) || key.first != DB_ADDRESSUTXOHEIGHT || key.second.hashBytes != addressHash || (int)key.second.type != type)
+            break;
+        if ((int)key.second.blockHeight > nHeight)
+            break;
+        CAddressUtxoHeightValue value;
+        if (!pcursor->GetValue(value))
+            return error("failed to get address utxo index value");
+        if (value.nValue >= nMinValue && value.IsUnspentAt(key.second, nHeight)) {
+            vect.push_back(make_pair(key.second, value));
+            if (nMaxResults && vect.size() >= nMaxResults)
+                break;
+        }
+        pcursor->Next();
+    }
+
+    return true;
+}
 
 bool CBlockTreeDB::WriteFlag(const std::string& name, bool fValue)
 {
@@ -450,6 +706,69 @@ bool CBlockTreeDB::ReadFlag(const std::string& name, bool& fValue)
     return true;
 }
 
+static void AddBlockIndexUpdate(CDBBatch& batch, const CBlockIndexUpdate& update)
+{
+    for (const auto& item : update.vTxIndex)
+        batch.Write(make_pair(DB_TXINDEX, item.first), item.second);
+    for (const auto& item : update.vAddressIndex)
+        batch.Write(make_pair(DB_ADDRESSINDEX, item.first), item.second);
+    for (const auto& item : update.vAddressIndexErase)
+        batch.Erase(make_pair(DB_ADDRESSINDEX, item.first));
+    for (const auto& item : update.vAddressUnspentIndex) {
+        if (item.second.IsNull()) {
+            batch.Erase(std::make_pair(DB_ADDRESSUNSPENTINDEX, item.first));
+        } else {
+            batch.Write(std::make_pair(DB_ADDRESSUNSPENTINDEX, item.first), item.second);
+        }
+    }
+    for (const auto& item : update.vSpentIndex) {
+        if (item.second.IsNull()) {
+            batch.Erase(std::make_pair(DB_SPENTINDEX, item.first));
+        } else {
+            batch.Write(std::make_pair(DB_SPENTINDEX, item.first), item.second);
+        }
+    }
+    for (const auto& item : update.vAddressUtxoHeight)
+        batch.Write(std::make_pair(DB_ADDRESSUTXOHEIGHT, item.first), item.second);
+    for (const auto& item : update.vAddressUtxoHeightErase)
+        batch.Erase(std::make_pair(DB_ADDRESSUTXOHEIGHT, item));
+    for (const auto& item : update.vHeightIndex)
+        batch.Write(std::make_pair(DB_HEIGHTINDEX, item.first), item.second);
+    for (const auto& item : update.vAnonymousBlock)
+        batch.Write(std::make_pair(DB_ANONYMOUS_BLOCK, item.first), item.second);
+    for (const uint256& hash : update.vAnonymousBlockErase)
+        batch.Erase(std::make_pair(DB_ANONYMOUS_BLOCK, hash));
+    if (!update.hashBestBlock.IsNull())
+        batch.Write(DB_INDEX_BEST_BLOCK, update.hashBestBlock);
+}
+
+bool CBlockTreeDB::WriteBlockIndexUpdate(const CBlockIndexUpdate& update, bool fSync)
+{
+    CDBBatch batch(*this);
+    AddBlockIndexUpdate(batch, update);
+    return WriteBatch(batch, fSync);
+}
+
+bool CBlockTreeDB::WriteBlockIndexUpdates(const std::vector<CBlockIndexUpdate>& vUpdate, bool fSync)
+{
+    // A batch is applied in order, so later blocks override earlier ones
+    // exactly as if every update had been written on its own.
+    CDBBatch batch(*this);
+    for (const CBlockIndexUpdate& update : vUpdate)
+        AddBlockIndexUpdate(batch, update);
+    return WriteBatch(batch, fSync);
+}
+
+bool CBlockTreeDB::ReadIndexBestBlock(uint256& hash)
+{
+    return Read(DB_INDEX_BEST_BLOCK, hash);
+}
+
+bool CBlockTreeDB::WriteIndexBestBlock(const uint256& hash)
+{
+    return Write(DB_INDEX_BEST_BLOCK, hash);
+}
+
 /////////////////////////////////////////////////////// // qtum
 
 bool CBlockTreeDB::WriteHeightIndex(const CHeightTxIndexKey& heightIndex, const std::vector<uint256>& hash)
@@ -476,7 +795,8 @@ bool CBlockTreeDB::EraseAnonymousBlock(const uint256& blockhash)
 
 int CBlockTreeDB::ReadHeightIndex(int low, int high, int minconf,
                                   std::vector<std::vector<uint256>>& blocksOfHashes,
-                                  std::set<dev::h160> const& addresses)
+                                  std::set<dev::h160> const& addresses,
+                                  std::vector<CHeightTxIndexKey>* pkeys)
 {
 
     if ((high < low && high > -1) || (high == 0 && low == 0) || (high < -1 || low < 0)) {
@@ -525,6 +845,8 @@ int CBlockTreeDB::ReadHeightIndex(int low, int high, int minconf,
         count += hashesTx.size();
 
         blocksOfHashes.push_back(hashesTx);
+        if (pkeys)
+            pkeys->push_back(key.second);
     }
 
     return curheight;
@@ -575,7 +897,7 @@ bool CBlockTreeDB::WipeHeightIndex()
 }
 //////////////////////////////////////////////////////////////////
 
-bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&) > insertBlockIndex)
+bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&) > insertBlockIndex, std::vector<CBlockIndex*>* pvLoaded)
 {
     boost::scoped_ptr<CDBIterator> pcursor(NewIterator());
 
@@ -613,7 +935,9 @@ bool CBlockTreeDB::LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256
                 pindexNew->nClueTx = diskindex.nClueTx;
                 pindexNew->nClueLeft = diskindex.nClueLeft;
 
-                if (!CheckProofOfWork(pindexNew->GetBlockHeader().GetPoWHash(), pindexNew->nBits, Params().GetConsensus()))
+                if (pvLoaded)
+                    pvLoaded->push_back(pindexNew);
+                else if (!CheckProofOfWork(pindexNew->GetBlockHeader().GetPoWHash(), pindexNew->nBits, Params().GetConsensus()))
                     return error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindexNew->ToString());
 
                 pcursor->Next();
@@ -10,6 +10,7 @@
 #include "coins.h"
 #include "dbwrapper.h"
 #include "chain.h"
+#include "addressindex.h"
 #include "spentindex.h"
 
 #include <map>
@@ -71,6 +72,212 @@ struct CDiskTxPos : public CDiskBlockPos {
     }
 };
 
+//! Spent height of an output that is still unspent
+static const unsigned int ADDRESS_UTXO_UNSPENT = 0xffffffff;
+
+/**
+ * Output of an address in the height-versioned address UTXO index. Keys sort
+ * by address and then by the height the output was created at, so the
+ * outputs an address had at some height are a prefix of its range.
+ */
+struct CAddressUtxoHeightKey {
+    unsigned int type;
+    uint160 hashBytes;
+    unsigned int blockHeight;
+    uint256 txhash;
+    unsigned int index;
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 65;
+    }
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata8(s, type);
+        s << hashBytes;
+        ser_writedata32be(s, blockHeight);
+        s << txhash;
+        ser_writedata32be(s, index);
+    }
+    template <typename Stream>
+    void Unserialize(Stream& s)
+    {
+        type = ser_readdata8(s);
+        s >> hashBytes;
+        blockHeight = ser_readdata32be(s);
+        s >> txhash;
+        index = ser_readdata32be(s);
+    }
+
+    CAddressUtxoHeightKey(unsigned int addressType, uint160 addressHash, int height, uint256 txid, unsigned int indexValue)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        blockHeight = height;
+        txhash = txid;
+        index = indexValue;
+    }
+
+    CAddressUtxoHeightKey()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        type = 0;
+        hashBytes.SetNull();
+        blockHeight = 0;
+        txhash.SetNull();
+        index = 0;
+    }
+
+    friend bool operator<(const CAddressUtxoHeightKey& a, const CAddressUtxoHeightKey& b)
+    {
+        if (a.type != b.type)
+            return a.type < b.type;
+        if (a.hashBytes != b.hashBytes)
+            return a.hashBytes < b.hashBytes;
+        if (a.blockHeight != b.blockHeight)
+            return a.blockHeight < b.blockHeight;
+        if (a.txhash != b.txhash)
+            return a.txhash < b.txhash;
+        return a.index < b.index;
+    }
+};
+
+/** Seek key for the address UTXO index, the first output of an address created at or after blockHeight */
+struct CAddressUtxoHeightIteratorKey {
+    unsigned int type;
+    uint160 hashBytes;
+    unsigned int blockHeight;
+
+    size_t GetSerializeSize(int nType, int nVersion) const
+    {
+        return 25;
+    }
+    template <typename Stream>
+    void Serialize(Stream& s) const
+    {
+        ser_writedata8(s, type);
+        s << hashBytes;
+        ser_writedata32be(s, blockHeight);
+    }
+
+    CAddressUtxoHeightIteratorKey(unsigned int addressType, uint160 addressHash, int height)
+    {
+        type = addressType;
+        hashBytes = addressHash;
+        blockHeight = height;
+    }
+};
+
+/** Value and spent height (ADDRESS_UTXO_UNSPENT if unspent) of an output in the address UTXO index */
+struct CAddressUtxoHeightValue {
+    CAmount nValue;
+    unsigned int nSpentHeight;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(nValue);
+        READWRITE(nSpentHeight);
+    }
+
+    CAddressUtxoHeightValue(CAmount amount, unsigned int spentHeight) : nValue(amount), nSpentHeight(spentHeight)
+    {
+    }
+
+    CAddressUtxoHeightValue()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nValue = -1;
+        nSpentHeight = ADDRESS_UTXO_UNSPENT;
+    }
+
+    bool IsNull() const
+    {
+        return nValue == -1;
+    }
+
+    //! Whether the output existed and was unspent at the end of block nHeight
+    bool IsUnspentAt(const CAddressUtxoHeightKey& key, int nHeight) const
+    {
+        return (int)key.blockHeight <= nHeight && (nSpentHeight == ADDRESS_UTXO_UNSPENT || (int)nSpentHeight > nHeight);
+    }
+};
+
+/**
+ * The changes one connected or disconnected block makes to the secondary
+ * indexes of the block tree (tx, address, address unspent, spent, height
+ * and anonymous block). They are committed together as one batch, along
+ * with the block the indexes are at afterwards.
+ */
+struct CBlockIndexUpdate {
+    uint256 hashBestBlock;
+    std::vector<std::pair<uint256, CDiskTxPos> > vTxIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndex;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAddressIndexErase;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAddressUnspentIndex; //!< Null values are erased
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > vSpentIndex;                  //!< Null values are erased
+    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > vAddressUtxoHeight; //!< Written in order, before vAddressUtxoHeightErase
+    std::vector<CAddressUtxoHeightKey> vAddressUtxoHeightErase;
+    std::vector<std::pair<CHeightTxIndexKey, std::vector<uint256> > > vHeightIndex;
+    std::vector<std::pair<uint256, AnonymousBlock> > vAnonymousBlock;
+    std::vector<uint256> vAnonymousBlockErase;
+};
+
+/** Orders address index keys the way the database sorts them, comparing the fields in the order they are serialized */
+struct CompareAddressIndexKey {
+    bool operator()(const CAddressIndexKey& a, const CAddressIndexKey& b) const;
+};
+
+/** Orders address unspent index keys the way the database sorts them */
+struct CompareAddressUnspentKey {
+    bool operator()(const CAddressUnspentKey& a, const CAddressUnspentKey& b) const;
+};
+
+/** Selects one page of the entries of an address, see CBlockTreeDB::ReadAddressIndexPage */
+struct CAddressIndexQuery {
+    int nStart;     //!< lowest block height (address index only, ignored if <= 0)
+    int nEnd;       //!< highest block height (address index only, ignored if <= 0)
+    size_t nOffset; //!< entries skipped before the page
+    size_t nLimit;  //!< page size (0 = no limit)
+    bool fReverse;  //!< walk from the last key to the first
+    bool fSum;      //!< also sum up every entry scanned, not just the page
+
+    CAddressIndexQuery() : nStart(0), nEnd(0), nOffset(0), nLimit(0), fReverse(false), fSum(false)
+    {
+    }
+};
+
+/**
+ * One page of entries of an address. To resume, pass keyLast as the key to
+ * continue after with the same query and an offset of 0.
+ */
+template <typename Key, typename Value>
+struct CAddressIndexPage {
+    std::vector<std::pair<Key, Value> > vEntries;
+    bool fMore;     //!< more entries follow in scan direction
+    Key keyLast;    //!< continuation key, valid if vEntries is not empty
+    CAmount nSum;   //!< with fSum: values of all entries past the continuation key, in range
+    uint64_t nCount; //!< with fSum: number of those entries
+
+    CAddressIndexPage() : fMore(false), nSum(0), nCount(0)
+    {
+    }
+};
+
+typedef CAddressIndexPage<CAddressIndexKey, CAmount> CAddressIndexPageResult;
+typedef CAddressIndexPage<CAddressUnspentKey, CAddressUnspentValue> CAddressUnspentPageResult;
+
 /** CCoinsView backed by the LevelDB coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
@@ -127,6 +334,9 @@ private:
 public:
     bool WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo);
     bool ReadBlockFileInfo(int nFile, CBlockFileInfo& fileinfo);
+    //! Id of the block index snapshot that matches the stored block index, erased by every WriteBatchSync
+    bool ReadIndexSnapshotId(uint256& id);
+    bool WriteIndexSnapshotId(const uint256& id);
     bool ReadLastBlockFile(int& nFile);
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool& fReindex);
@@ -142,8 +352,39 @@ public:
     bool ReadAddressIndex(uint160 addressHash, int type,
                           std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex,
                           int start = 0, int end = 0);
+    /**
+     * Outputs of an address that existed and were unspent at the end of block
+     * nHeight and are worth at least nMinValue, read from the address UTXO
+     * index. Only outputs created up to nHeight are visited, and spent ones
+     * are filtered by their recorded spent height without further lookups.
+     *
+     * @param nMaxResults stop after this many outputs (0 = no limit)
+     */
+    bool ReadAddressUtxoAtHeight(uint160 addressHash, int type, int nHeight, CAmount nMinValue,
+                                 std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> >& vect,
+                                 size_t nMaxResults = 0);
+    /**
+     * Read one page of the address index of an address without loading the
+     * rest. Memory use is bounded by nOffset + nLimit entries in both
+     * directions; a reverse walk reads the heights in growing windows from
+     * the top down.
+     *
+     * @param pkeyAfter if not null, continue after (before, when reversed) this key
+     */
+    bool ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                              const CAddressIndexKey* pkeyAfter, CAddressIndexPageResult& page);
+    /** Read one page of the unspent outputs of an address, see ReadAddressIndexPage. Heights in the query are ignored. */
+    bool ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                     const CAddressUnspentKey* pkeyAfter, CAddressUnspentPageResult& page);
     bool WriteFlag(const std::string& name, bool fValue);
     bool ReadFlag(const std::string& name, bool& fValue);
+    //! Commit all index changes of a block with a single write
+    bool WriteBlockIndexUpdate(const CBlockIndexUpdate& update, bool fSync = false);
+    //! Commit the index changes of several blocks, in order, with a single write
+    bool WriteBlockIndexUpdates(const std::vector<CBlockIndexUpdate>& vUpdate, bool fSync = false);
+    //! The block the secondary indexes were last brought up to
+    bool ReadIndexBestBlock(uint256& hash);
+    bool WriteIndexBestBlock(const uint256& hash);
     ////////////////////////////////////////////////////////////////////////////// // qtum
     bool WriteHeightIndex(const CHeightTxIndexKey& heightIndex, const std::vector<uint256>& hash);
 
@@ -159,16 +400,23 @@ public:
      * @param minconf stop iterating of the block height does not have enough confirmations (ignored if <= 0)
      * @param blocksOfHashes transaction hashes in blocks iterated are collected into this vector.
      * @param addresses filter out a block unless it matches one of the addresses in this set.
+     * @param pkeys if not null, the key of every entry added to blocksOfHashes is appended here.
      *
      * @return the height of the latest block iterated. 0 if no block is iterated.
      */
     int ReadHeightIndex(int low, int high, int minconf,
                         std::vector<std::vector<uint256>>& blocksOfHashes,
-                        std::set<dev::h160> const& addresses);
+                        std::set<dev::h160> const& addresses,
+                        std::vector<CHeightTxIndexKey>* pkeys = nullptr);
     bool EraseHeightIndex(const unsigned int& height);
     bool WipeHeightIndex();
     ////////////////////////////////////////////////////
-    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex);
+    /**
+     * Load every stored block index entry. If pvLoaded is not null the loaded
+     * entries are appended to it and checking their proof of work is left to
+     * the caller.
+     */
+    bool LoadBlockIndexGuts(boost::function<CBlockIndex*(const uint256&)> insertBlockIndex, std::vector<CBlockIndex*>* pvLoaded = nullptr);
 };
 
 #endif // VDS_TXDB_H
@@ -22,10 +22,10 @@
 
 CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                                  int64_t _nTime, unsigned int _entryHeight,
-                                 bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp, CAmount _nMinGasPrice):
+                                 bool _spendsCoinbase, int64_t _sigOpsCost, LockPoints lp, CAmount _nMinGasPrice, uint64_t _nGasLimit):
     tx(_tx), nFee(_nFee), nTime(_nTime), entryHeight(_entryHeight),
     spendsCoinbase(_spendsCoinbase), sigOpCost(_sigOpsCost), lockPoints(lp),
-    nMinGasPrice(_nMinGasPrice)
+    nMinGasPrice(_nMinGasPrice), nGasLimit(_nGasLimit)
 {
     nTxWeight = GetTransactionWeight(*tx);
     nUsageSize = RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx);
@@ -40,6 +40,9 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFe
     nSizeWithAncestors = GetTxSize();
     nModFeesWithAncestors = nFee;
     nSigOpCostWithAncestors = sigOpCost;
+
+    nClusterId = 0;
+    nCoinbaseMaturity = 0;
 }
 
 void CTxMemPoolEntry::UpdateFeeDelta(int64_t newFeeDelta)
@@ -65,13 +68,14 @@ size_t CTxMemPoolEntry::GetTxSize() const
 void CTxMemPool::UpdateForDescendants(txiter updateIt, cacheMap& cachedDescendants, const std::set<uint256>& setExclude)
 {
     setEntries stageEntries, setAllDescendants;
-    stageEntries = GetMemPoolChildren(updateIt);
+    const TxLinkSet& setUpdateChildren = GetMemPoolChildren(updateIt);
+    stageEntries.insert(setUpdateChildren.begin(), setUpdateChildren.end());
 
     while (!stageEntries.empty()) {
         const txiter cit = *stageEntries.begin();
         setAllDescendants.insert(cit);
         stageEntries.erase(cit);
-        const setEntries& setChildren = GetMemPoolChildren(cit);
+        const TxLinkSet& setChildren = GetMemPoolChildren(cit);
         for (const txiter childEntry : setChildren) {
             cacheMap::iterator cacheIt = cachedDescendants.find(childEntry);
             if (cacheIt != cachedDescendants.end()) {
@@ -150,6 +154,20 @@ void CTxMemPool::UpdateTransactionsFromBlock(const std::vector<uint256>& vHashes
         }
         UpdateForDescendants(it, mapMemPoolDescendantsToUpdate, setAlreadyIncluded);
     }
+
+    if (fClusterIndex) {
+        // The re-added block transactions went into clusters of their own
+        // (or of their parents); now that they are linked to their in-mempool
+        // children, join those clusters up.
+        std::vector<txiter> vUpdated;
+        vUpdated.reserve(vHashesToUpdate.size());
+        for (const uint256& hash : vHashesToUpdate) {
+            txiter it = mapTx.find(hash);
+            if (it != mapTx.end())
+                vUpdated.push_back(it);
+        }
+        ClusterLink(vUpdated);
+    }
 }
 
 bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents /* = true */) const
@@ -177,7 +195,21 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
         // If we're not searching for parents, we require this to be an
         // entry in the mempool already.
         txiter it = mapTx.iterator_to(entry);
-        parentHashes = GetMemPoolParents(it);
+        const TxLinkSet& setParents = GetMemPoolParents(it);
+        parentHashes.insert(setParents.begin(), setParents.end());
+    }
+
+    // Every ancestor of the new transaction, and every descendant of those
+    // ancestors, lives in one of its parents' clusters. If the union of those
+    // clusters is within all limits, the per-ancestor checks below can't fail.
+    // The cluster limit itself is checked by CheckClusterLimit, this walk has
+    // to complete for the paths that add without limits.
+    bool fWithinClusterLimits = false;
+    if (fClusterIndex && fSearchForParents) {
+        uint64_t nClusterCount, nClusterSize;
+        GetJoinedClusterSize(entry, parentHashes, nClusterCount, nClusterSize);
+        fWithinClusterLimits = nClusterCount <= limitAncestorCount && nClusterCount <= limitDescendantCount &&
+                               nClusterSize <= limitAncestorSize && nClusterSize <= limitDescendantSize;
     }
 
     size_t totalSizeWithAncestors = entry.GetTxSize();
@@ -189,6 +221,14 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
         parentHashes.erase(stageit);
         totalSizeWithAncestors += stageit->GetTxSize();
 
+        if (fWithinClusterLimits) {
+            for (const txiter& phash : GetMemPoolParents(stageit)) {
+                if (setAncestors.count(phash) == 0)
+                    parentHashes.insert(phash);
+            }
+            continue;
+        }
+
         if (stageit->GetSizeWithDescendants() + entry.GetTxSize() > limitDescendantSize) {
             errString = strprintf("exceeds descendant size limit for tx %s [limit: %u]", stageit->GetTx().GetHash().ToString(), limitDescendantSize);
             return false;
@@ -200,7 +240,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
             return false;
         }
 
-        const setEntries& setMemPoolParents = GetMemPoolParents(stageit);
+        const TxLinkSet& setMemPoolParents = GetMemPoolParents(stageit);
         for (const txiter& phash : setMemPoolParents) {
             // If this is a new ancestor, add it.
             if (setAncestors.count(phash) == 0) {
@@ -218,7 +258,7 @@ bool CTxMemPool::CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntr
 
 void CTxMemPool::UpdateAncestorsOf(bool add, txiter it, setEntries& setAncestors)
 {
-    setEntries parentIters = GetMemPoolParents(it);
+    const TxLinkSet& parentIters = GetMemPoolParents(it);
     // add or remove this tx as a child of each parent
     for (txiter piter : parentIters) {
         UpdateChild(piter, it, add);
@@ -247,7 +287,7 @@ void CTxMemPool::UpdateEntryForAncestors(txiter it, const setEntries& setAncesto
 
 void CTxMemPool::UpdateChildrenForRemoval(txiter it)
 {
-    const setEntries& setMemPoolChildren = GetMemPoolChildren(it);
+    const TxLinkSet& setMemPoolChildren = GetMemPoolChildren(it);
     for (txiter updateIt : setMemPoolChildren) {
         UpdateParent(updateIt, it, false);
     }
@@ -262,7 +302,7 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, b
         // updateDescendants should be true whenever we're not recursively
         // removing a tx and all its descendants, eg when a transaction is
         // confirmed in a block.
-        // Here we only update statistics and not data in mapLinks (which
+        // Here we only update statistics and not data in vLinks (which
         // we need to preserve until we're finished with all operations that
         // need to traverse the mempool).
         for (txiter removeIt : entriesToRemove) {
@@ -287,16 +327,16 @@ void CTxMemPool::UpdateForRemoveFromMempool(const setEntries& entriesToRemove, b
         // should be a bit faster.
         // However, if we happen to be in the middle of processing a reorg, then
         // the mempool can be in an inconsistent state.  In this case, the set
-        // of ancestors reachable via mapLinks will be the same as the set of
+        // of ancestors reachable via vLinks will be the same as the set of
         // ancestors whose packages include this transaction, because when we
         // add a new transaction to the mempool in addUnchecked(), we assume it
         // has no children, and in the case of a reorg where that assumption is
         // false, the in-mempool children aren't linked to the in-block tx's
         // until UpdateTransactionsFromBlock() is called.
         // So if we're being called during a reorg, ie before
-        // UpdateTransactionsFromBlock() has been called, then mapLinks[] will
+        // UpdateTransactionsFromBlock() has been called, then vLinks[] will
         // differ from the set of mempool parents we'd calculate by searching,
-        // and it's important that we use the mapLinks[] notion of ancestor
+        // and it's important that we use the vLinks[] notion of ancestor
         // transactions as the set of things to update for removal.
         CalculateMemPoolAncestors(entry, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummy, false);
         // Note that UpdateAncestorsOf severs the child links that point to
@@ -331,8 +371,45 @@ void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee,
     assert(int(nSigOpCostWithAncestors) >= 0);
 }
 
+/** Whether a lock time or BIP68 sequence lock can keep tx out of the next block at some tip */
+static bool HasBindingLocks(const CTransaction& tx)
+{
+    if (tx.nLockTime != 0 && tx.nFlag == CTransaction::BID_TX)
+        return true;
+    for (const CTxIn& txin : tx.vin) {
+        if (tx.nLockTime != 0 && txin.nSequence != CTxIn::SEQUENCE_FINAL)
+            return true;
+        if (static_cast<uint32_t>(tx.nVersion) >= 2 && !(txin.nSequence & CTxIn::SEQUENCE_LOCKTIME_DISABLE_FLAG))
+            return true;
+    }
+    return false;
+}
+
+/** Highest next-block height at which the entry is still locked; bids check their lock period at every tip */
+static int GetLockHeight(const CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = entry.GetTx();
+    if (tx.nLockTime != 0 && tx.nFlag == CTransaction::BID_TX)
+        return std::numeric_limits<int>::max();
+    int nHeight = entry.GetLockPoints().height;
+    if (tx.nLockTime != 0 && tx.nLockTime < LOCKTIME_THRESHOLD)
+        nHeight = std::max(nHeight, (int)tx.nLockTime - 1);
+    return nHeight;
+}
+
+/** Highest median time past at which the entry is still locked */
+static int64_t GetLockTime(const CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = entry.GetTx();
+    int64_t nTime = entry.GetLockPoints().time;
+    if (tx.nLockTime >= LOCKTIME_THRESHOLD)
+        nTime = std::max(nTime, (int64_t)tx.nLockTime - 1);
+    return nTime;
+}
+
 CTxMemPool::CTxMemPool(CBlockPolicyEstimator* estimator) :
-    nTransactionsUpdated(0), minerPolicyEstimator(estimator)
+    nTransactionsUpdated(0), minerPolicyEstimator(estimator),
+    fClusterIndex(false), nClusterLimit(DEFAULT_CLUSTER_LIMIT), nNextClusterId(1), cachedIndexUsage(0)
 {
     _clear(); //lock free clear
 
@@ -360,6 +437,26 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+const uint64_t CTxMemPool::SHORTTXID_UNKNOWN;
+
+CTxMemPool::ShortTxIDCache& CTxMemPool::GetShortTxIDCache(uint64_t k0, uint64_t k1)
+{
+    AssertLockHeld(cs);
+    std::vector<ShortTxIDCache>::iterator it = vShortTxIDCaches.begin();
+    while (it != vShortTxIDCaches.end() && (it->k0 != k0 || it->k1 != k1))
+        it++;
+    if (it == vShortTxIDCaches.end()) {
+        if (vShortTxIDCaches.size() < MAX_SHORTTXID_CACHES)
+            vShortTxIDCaches.emplace_back();
+        it = vShortTxIDCaches.end() - 1;
+        it->k0 = k0;
+        it->k1 = k1;
+        it->shortids.assign(vTxHashes.size(), SHORTTXID_UNKNOWN);
+    }
+    std::rotate(vShortTxIDCaches.begin(), it, it + 1);
+    return vShortTxIDCaches.front();
+}
+
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry, setEntries& setAncestors, bool validFeeEstimate)
 {
     NotifyEntryAdded(entry.GetSharedTx());
@@ -368,7 +465,13 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
     // all the appropriate checks.
     LOCK(cs);
     indexed_transaction_set::iterator newit = mapTx.insert(entry).first;
-    mapLinks.insert(make_pair(newit, TxLinks()));
+    if (vLinksFree.empty()) {
+        newit->nLinksIdx = vLinks.size();
+        vLinks.push_back(TxLinks());
+    } else {
+        newit->nLinksIdx = vLinksFree.back();
+        vLinksFree.pop_back();
+    }
 
     // Update transaction for any feeDelta created by PrioritiseTransaction
     // TODO: refactor so that the fee delta is calculated before inserting
@@ -408,9 +511,17 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
     }
     for (const SpendDescription& spendDescription : tx.vShieldedSpend) {
         mapSaplingNullifiers[spendDescription.nullifier] = &tx;
+        if (mapSaplingAnchors[spendDescription.anchor].insert(newit).second)
+            nSaplingAnchorSpenders++;
     }
+    if (HasBindingLocks(tx))
+        LockIndexAdd(newit);
+    if (entry.GetSpendsCoinbase())
+        setCoinbaseUnindexed.insert(newit);
     UpdateAncestorsOf(true, newit, setAncestors);
     UpdateEntryForAncestors(newit, setAncestors);
+    if (fClusterIndex)
+        ClusterAdd(newit);
 
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
@@ -420,6 +531,8 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
 
     vTxHashes.emplace_back(tx.GetWitnessHash(), newit);
     newit->vTxHashesIdx = vTxHashes.size() - 1;
+    for (ShortTxIDCache& cache : vShortTxIDCaches)
+        cache.shortids.push_back(SHORTTXID_UNKNOWN);
 
     return true;
 }
@@ -466,6 +579,7 @@ void CTxMemPool::addAddressIndex(const CTxMemPoolEntry& entry, const CCoinsViewC
         }
     }
 
+    cachedIndexUsage += memusage::DynamicUsage(inserted);
     mapAddressInserted.insert(make_pair(txhash, inserted));
 }
 
@@ -489,10 +603,11 @@ bool CTxMemPool::removeAddressIndex(const uint256 txhash)
     addressDeltaMapInserted::iterator it = mapAddressInserted.find(txhash);
 
     if (it != mapAddressInserted.end()) {
-        std::vector<CMempoolAddressDeltaKey> keys = (*it).second;
-        for (std::vector<CMempoolAddressDeltaKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
+        const std::vector<CMempoolAddressDeltaKey>& keys = (*it).second;
+        for (std::vector<CMempoolAddressDeltaKey>::const_iterator mit = keys.begin(); mit != keys.end(); mit++) {
             mapAddress.erase(*mit);
         }
+        cachedIndexUsage -= memusage::DynamicUsage(keys);
         mapAddressInserted.erase(it);
     }
 
@@ -526,6 +641,7 @@ void CTxMemPool::addSpentIndex(const CTxMemPoolEntry& entry, const CCoinsViewCac
 
     }
 
+    cachedIndexUsage += memusage::DynamicUsage(inserted);
     mapSpentInserted.insert(make_pair(txhash, inserted));
 }
 
@@ -548,10 +664,11 @@ bool CTxMemPool::removeSpentIndex(const uint256 txhash)
     mapSpentIndexInserted::iterator it = mapSpentInserted.find(txhash);
 
     if (it != mapSpentInserted.end()) {
-        std::vector<CSpentIndexKey> keys = (*it).second;
-        for (std::vector<CSpentIndexKey>::iterator mit = keys.begin(); mit != keys.end(); mit++) {
+        const std::vector<CSpentIndexKey>& keys = (*it).second;
+        for (std::vector<CSpentIndexKey>::const_iterator mit = keys.begin(); mit != keys.end(); mit++) {
             mapSpent.erase(*mit);
         }
+        cachedIndexUsage -= memusage::DynamicUsage(keys);
         mapSpentInserted.erase(it);
     }
 
@@ -563,10 +680,25 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
     NotifyEntryRemoved(it->GetSharedTx(), reason);
     for (const SpendDescription& spendDescription : it->GetSharedTx()->vShieldedSpend) {
         mapSaplingNullifiers.erase(spendDescription.nullifier);
+        auto itAnchor = mapSaplingAnchors.find(spendDescription.anchor);
+        if (itAnchor != mapSaplingAnchors.end() && itAnchor->second.erase(it)) {
+            nSaplingAnchorSpenders--;
+            if (itAnchor->second.empty())
+                mapSaplingAnchors.erase(itAnchor);
+        }
     }
     const uint256 hash = it->GetTx().GetHash();
     for (const CTxIn& txin : it->GetTx().vin)
         mapNextTx.erase(txin.prevout);
+    if (HasBindingLocks(it->GetTx()))
+        LockIndexErase(it);
+    if (it->nCoinbaseMaturity != 0) {
+        auto itMaturity = mapCoinbaseMaturity.find(it->nCoinbaseMaturity);
+        itMaturity->second.erase(it);
+        if (itMaturity->second.empty())
+            mapCoinbaseMaturity.erase(itMaturity);
+    } else if (it->GetSpendsCoinbase())
+        setCoinbaseUnindexed.erase(it);
 
     if (vTxHashes.size() > 1) {
         vTxHashes[it->vTxHashesIdx] = std::move(vTxHashes.back());
@@ -576,11 +708,17 @@ void CTxMemPool::removeUnchecked(txiter it, MemPoolRemovalReason reason)
             vTxHashes.shrink_to_fit();
     } else
         vTxHashes.clear();
+    for (ShortTxIDCache& cache : vShortTxIDCaches) {
+        cache.shortids[it->vTxHashesIdx] = cache.shortids.back();
+        cache.shortids.pop_back();
+    }
 
     totalTxSize -= it->GetTxSize();
     cachedInnerUsage -= it->DynamicMemoryUsage();
-    cachedInnerUsage -= memusage::DynamicUsage(mapLinks[it].parents) + memusage::DynamicUsage(mapLinks[it].children);
-    mapLinks.erase(it);
+    TxLinks& links = vLinks[it->nLinksIdx];
+    cachedInnerUsage -= links.parents.DynamicMemoryUsage() + links.children.DynamicMemoryUsage();
+    links = TxLinks();
+    vLinksFree.push_back(it->nLinksIdx);
     mapTx.erase(it);
     nTransactionsUpdated++;
     if (minerPolicyEstimator) {
@@ -611,7 +749,7 @@ void CTxMemPool::CalculateDescendants(txiter entryit, setEntries& setDescendants
         setDescendants.insert(it);
         stage.erase(it);
 
-        const setEntries& setChildren = GetMemPoolChildren(it);
+        const TxLinkSet& setChildren = GetMemPoolChildren(it);
         for (const txiter& childiter : setChildren) {
             if (!setDescendants.count(childiter)) {
                 stage.insert(childiter);
@@ -657,7 +795,23 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
     // Remove transactions spending a coinbase which are now immature and no-longer-final transactions
     LOCK(cs);
     setEntries txToRemove;
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+
+    // Lock points computed on a block that left the chain, and entries still
+    // locked at the new tip's height or median time past
+    setEntries setLocked;
+    for (const auto& item : mapLockInputBlock) {
+        if (!chainActive.Contains(item.first))
+            setLocked.insert(item.second.begin(), item.second.end());
+    }
+    for (auto itHeight = mapLockHeight.lower_bound(nMemPoolHeight); itHeight != mapLockHeight.end(); ++itHeight)
+        setLocked.insert(itHeight->second.begin(), itHeight->second.end());
+    int64_t nLockTimeCutoff = chainActive.Tip()->GetMedianTimePast();
+    if (!(std::max(flags, 0) & LOCKTIME_MEDIAN_TIME_PAST))
+        nLockTimeCutoff = std::min(nLockTimeCutoff, GetAdjustedTime());
+    for (auto itTime = mapLockTime.lower_bound(nLockTimeCutoff); itTime != mapLockTime.end(); ++itTime)
+        setLocked.insert(itTime->second.begin(), itTime->second.end());
+
+    for (txiter it : setLocked) {
         const CTransaction& tx = it->GetTx();
         LockPoints lp = it->GetLockPoints();
         bool validLP =  TestLockPointValidity(&lp);
@@ -665,23 +819,45 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
             // Note if CheckSequenceLocks fails the LockPoints may still be invalid
             // So it's critical that we remove the tx and not depend on the LockPoints.
             txToRemove.insert(it);
-        } else if (it->GetSpendsCoinbase()) {
-            for (const CTxIn& txin : tx.vin) {
-                indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
-                if (it2 != mapTx.end())
-                    continue;
-                const Coin& coin = pcoins->AccessCoin(txin.prevout);
-                if (nCheckFrequency != 0) assert(!coin.IsSpent());
-                if (coin.IsSpent() || (coin.IsCoinBase() && ((signed long)nMemPoolHeight) - coin.nHeight < COINBASE_MATURITY)) {
-                    txToRemove.insert(it);
-                    break;
-                }
-            }
         }
         if (!validLP) {
+            LockIndexErase(it);
             mapTx.modify(it, update_lock_points(lp));
+            LockIndexAdd(it);
+        }
+    }
+
+    // Coinbase spenders added since the last reorg: look up when they mature.
+    // The coinbase of a disconnected block takes its spenders out of the
+    // mempool before this runs, so the heights stay valid afterwards.
+    setEntries setUnindexed;
+    for (txiter it : setCoinbaseUnindexed) {
+        int nMaturity = 0;
+        for (const CTxIn& txin : it->GetTx().vin) {
+            if (mapTx.count(txin.prevout.hash))
+                continue;
+            const Coin& coin = pcoins->AccessCoin(txin.prevout);
+            if (nCheckFrequency != 0) assert(!coin.IsSpent());
+            if (coin.IsSpent()) {
+                txToRemove.insert(it);
+                nMaturity = 0;
+                break;
+            }
+            if (coin.IsCoinBase())
+                nMaturity = std::max(nMaturity, (int)(coin.nHeight + COINBASE_MATURITY));
         }
+        if (nMaturity != 0) {
+            it->nCoinbaseMaturity = nMaturity;
+            mapCoinbaseMaturity[nMaturity].insert(it);
+        } else
+            setUnindexed.insert(it);
     }
+    setCoinbaseUnindexed.swap(setUnindexed);
+
+    // Only spenders maturing above the new tip have become immature
+    for (auto itMaturity = mapCoinbaseMaturity.upper_bound(nMemPoolHeight); itMaturity != mapCoinbaseMaturity.end(); ++itMaturity)
+        txToRemove.insert(itMaturity->second.begin(), itMaturity->second.end());
+
     setEntries setAllRemoves;
     for (txiter it : txToRemove) {
         CalculateDescendants(it, setAllRemoves);
@@ -689,6 +865,34 @@ void CTxMemPool::removeForReorg(const CCoinsViewCache* pcoins, unsigned int nMem
     RemoveStaged(setAllRemoves, false, MemPoolRemovalReason::REORG);
 }
 
+void CTxMemPool::LockIndexAdd(txiter it)
+{
+    mapLockHeight[GetLockHeight(*it)].insert(it);
+    mapLockTime[GetLockTime(*it)].insert(it);
+    const CBlockIndex* pindex = it->GetLockPoints().maxInputBlock;
+    if (pindex)
+        mapLockInputBlock[pindex].insert(it);
+}
+
+void CTxMemPool::LockIndexErase(txiter it)
+{
+    auto itHeight = mapLockHeight.find(GetLockHeight(*it));
+    itHeight->second.erase(it);
+    if (itHeight->second.empty())
+        mapLockHeight.erase(itHeight);
+    auto itTime = mapLockTime.find(GetLockTime(*it));
+    itTime->second.erase(it);
+    if (itTime->second.empty())
+        mapLockTime.erase(itTime);
+    const CBlockIndex* pindex = it->GetLockPoints().maxInputBlock;
+    if (pindex) {
+        auto itBlock = mapLockInputBlock.find(pindex);
+        itBlock->second.erase(it);
+        if (itBlock->second.empty())
+            mapLockInputBlock.erase(itBlock);
+    }
+}
+
 void CTxMemPool::removeWithAnchor(const uint256& invalidRoot, ShieldedType type)
 {
     // If a block is disconnected from the tip, and the root changed,
@@ -696,29 +900,21 @@ void CTxMemPool::removeWithAnchor(const uint256& invalidRoot, ShieldedType type)
     // from that root -- almost as though they were spending coinbases
     // which are no longer valid to spend due to coinbase maturity.
     LOCK(cs);
-    std::list<CTransaction> transactionsToRemove;
-
-    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->GetTx();
-        switch (type) {
-        case SAPLING:
-            BOOST_FOREACH(const SpendDescription & spendDescription, tx.vShieldedSpend) {
-                if (spendDescription.anchor == invalidRoot) {
-                    transactionsToRemove.push_back(tx);
-                    break;
-                }
-            }
-            break;
-        default:
-            throw std::runtime_error("Unknown shielded type");
-            break;
-        }
+    setEntries setAllRemoves;
+    switch (type) {
+    case SAPLING: {
+        auto itAnchor = mapSaplingAnchors.find(invalidRoot);
+        if (itAnchor == mapSaplingAnchors.end())
+            return;
+        for (txiter it : itAnchor->second)
+            CalculateDescendants(it, setAllRemoves);
+        break;
     }
-
-    BOOST_FOREACH(const CTransaction & tx, transactionsToRemove) {
-        std::list<CTransaction> removed;
-        removeRecursive(tx, MemPoolRemovalReason::REORG);
+    default:
+        throw std::runtime_error("Unknown shielded type");
     }
+
+    RemoveStaged(setAllRemoves, false, MemPoolRemovalReason::REORG);
 }
 
 void CTxMemPool::removeConflicts(const CTransaction& tx)
@@ -737,7 +933,7 @@ void CTxMemPool::removeConflicts(const CTransaction& tx)
     }
 
     for (const SpendDescription& spendDescription : tx.vShieldedSpend) {
-        std::map<uint256, const CTransaction*>::iterator it = mapSaplingNullifiers.find(spendDescription.nullifier);
+        auto it = mapSaplingNullifiers.find(spendDescription.nullifier);
         if (it != mapSaplingNullifiers.end()) {
             const CTransaction& txConflict = *it->second;
             if (txConflict != tx) {
@@ -857,10 +1053,24 @@ void CTxMemPool::removeForBlock(const std::vector<CTransactionRef>& vtx, unsigne
 
 void CTxMemPool::_clear()
 {
-    mapLinks.clear();
+    vLinks.clear();
+    vLinksFree.clear();
     mapTx.clear();
+    vTxHashes.clear();
+    vShortTxIDCaches.clear();
     mapNextTx.clear();
+    mapSaplingNullifiers.clear();
+    mapSaplingAnchors.clear();
+    nSaplingAnchorSpenders = 0;
+    mapLockHeight.clear();
+    mapLockTime.clear();
+    mapLockInputBlock.clear();
+    setCoinbaseUnindexed.clear();
+    mapCoinbaseMaturity.clear();
     mapBiggestBid.clear();
+    mapClusters.clear();
+    mapClusterScore.clear();
+    setClusterScores.clear();
     totalTxSize = 0;
     cachedInnerUsage = 0;
     lastRollingFeeUpdate = GetTime();
@@ -898,6 +1108,7 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
 
     uint64_t checkTotal = 0;
     uint64_t innerUsage = 0;
+    size_t nLockEntries = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
@@ -910,10 +1121,20 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
         checkTotal += it->GetTxSize();
         innerUsage += it->DynamicMemoryUsage();
         const CTransaction& tx = it->GetTx();
-        txlinksMap::const_iterator linksiter = mapLinks.find(it);
-        assert(linksiter != mapLinks.end());
-        const TxLinks& links = linksiter->second;
-        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
+        assert(it->nLinksIdx < vLinks.size());
+        if (HasBindingLocks(tx)) {
+            nLockEntries++;
+            assert(mapLockHeight.count(GetLockHeight(*it)) && mapLockHeight.find(GetLockHeight(*it))->second.count(it));
+            assert(mapLockTime.count(GetLockTime(*it)) && mapLockTime.find(GetLockTime(*it))->second.count(it));
+            const CBlockIndex* pindexLock = it->GetLockPoints().maxInputBlock;
+            assert(!pindexLock || (mapLockInputBlock.count(pindexLock) && mapLockInputBlock.find(pindexLock)->second.count(it)));
+        }
+        if (it->nCoinbaseMaturity != 0)
+            assert(mapCoinbaseMaturity.count(it->nCoinbaseMaturity) && mapCoinbaseMaturity.find(it->nCoinbaseMaturity)->second.count(it));
+        else
+            assert(setCoinbaseUnindexed.count(it) == it->GetSpendsCoinbase());
+        const TxLinks& links = vLinks[it->nLinksIdx];
+        innerUsage += links.parents.DynamicMemoryUsage() + links.children.DynamicMemoryUsage();
         bool fDependsWait = false;
         setEntries setParentCheck;
         int64_t parentSizes = 0;
@@ -939,7 +1160,9 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
             assert(it3->second == &tx);
             i++;
         }
-        assert(setParentCheck == GetMemPoolParents(it));
+        assert(setParentCheck.size() == links.parents.size());
+        for (txiter parent : setParentCheck)
+            assert(links.parents.count(parent));
         // Verify ancestor state is correct.
         setEntries setAncestors;
         uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
@@ -972,7 +1195,9 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
                 childSizes += childit->GetTxSize();
             }
         }
-        assert(setChildrenCheck == GetMemPoolChildren(it));
+        assert(setChildrenCheck.size() == links.children.size());
+        for (txiter child : setChildrenCheck)
+            assert(links.children.count(child));
         // Also check to make sure size is greater than sum with immediate children.
         // just a sanity check, not definitive that this calc is correct...
         assert(it->GetSizeWithDescendants() >= childSizes + it->GetTxSize());
@@ -1013,13 +1238,47 @@ void CTxMemPool::check(const CCoinsViewCache* pcoins) const
 
     checkNullifiers(SAPLING);
 
+    if (fClusterIndex) {
+        // Every entry is in exactly one cluster, after all of its parents.
+        size_t nClustered = 0;
+        for (const auto& item : mapClusters) {
+            const TxCluster& cluster = item.second;
+            assert(!cluster.vLinearization.empty() && !cluster.vChunks.empty());
+            setEntries setSeen;
+            uint64_t nClusterSize = 0;
+            for (txiter it : cluster.vLinearization) {
+                assert(it->nClusterId == item.first);
+                for (txiter parent : GetMemPoolParents(it))
+                    assert(setSeen.count(parent));
+                setSeen.insert(it);
+                nClusterSize += it->GetTxSize();
+            }
+            assert(cluster.nTxSize == nClusterSize);
+            assert(cluster.vChunks.front().nBegin == 0 && cluster.vChunks.back().nEnd == cluster.vLinearization.size());
+            assert(mapClusterScore.count(item.first));
+            nClustered += cluster.vLinearization.size();
+        }
+        assert(nClustered == mapTx.size());
+        assert(setClusterScores.size() == mapClusters.size());
+    }
+
+    size_t nLockHeightEntries = 0;
+    for (const auto& item : mapLockHeight)
+        nLockHeightEntries += item.second.size();
+    assert(nLockHeightEntries == nLockEntries);
+    size_t nLockTimeEntries = 0;
+    for (const auto& item : mapLockTime)
+        nLockTimeEntries += item.second.size();
+    assert(nLockTimeEntries == nLockEntries);
+
+    assert(vLinks.size() == mapTx.size() + vLinksFree.size());
     assert(totalTxSize == checkTotal);
     assert(innerUsage == cachedInnerUsage);
 }
 
 void CTxMemPool::checkNullifiers(ShieldedType type) const
 {
-    const std::map<uint256, const CTransaction*>* mapToUse;
+    const std::unordered_map<uint256, const CTransaction*, SaltedTxidHasher>* mapToUse;
     switch (type) {
     case SAPLING:
         mapToUse = &mapSaplingNullifiers;
@@ -1034,6 +1293,19 @@ void CTxMemPool::checkNullifiers(ShieldedType type) const
         assert(findTx != mapTx.end());
         assert(&tx == entry.second);
     }
+
+    size_t nSpenders = 0;
+    for (const auto& entry : mapSaplingAnchors) {
+        assert(!entry.second.empty());
+        for (txiter it : entry.second) {
+            bool fSpends = false;
+            for (const SpendDescription& spendDescription : it->GetTx().vShieldedSpend)
+                fSpends |= spendDescription.anchor == entry.first;
+            assert(fSpends);
+        }
+        nSpenders += entry.second.size();
+    }
+    assert(nSpenders == nSaplingAnchorSpenders);
 }
 
 void CTxMemPool::CheckBiggestBid(const int& nHeight)
@@ -1182,6 +1454,8 @@ void CTxMemPool::PrioritiseTransaction(const uint256& hash, const CAmount& nFeeD
             for (txiter descendantIt : setDescendants) {
                 mapTx.modify(descendantIt, update_ancestor_state(0, nFeeDelta, 0, 0));
             }
+            if (fClusterIndex)
+                ClusterRelinearize(it->nClusterId);
             ++nTransactionsUpdated;
         }
     }
@@ -1255,14 +1529,39 @@ bool CCoinsViewMemPool::GetNullifier(const uint256& nf, ShieldedType type) const
 size_t CTxMemPool::DynamicMemoryUsage() const
 {
     LOCK(cs);
-    // Estimate the overhead of mapTx to be 12 pointers + an allocation, as no exact formula for boost::multi_index_contained is implemented.
-    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 12 * sizeof(void*)) * mapTx.size() + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(mapLinks) + memusage::DynamicUsage(vTxHashes) /*+ memusage::DynamicUsage(mapBiggestBid) + memusage::DynamicUsage(mapAddressInserted) + memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapSaplingNullifiers) */ + cachedInnerUsage;
+    // A mapTx node holds the entry, two pointers for the hashed txid index
+    // and three for each of the four ordered indices (the colour bit lives in
+    // the parent pointer); the hashed index adds its bucket array on top.
+    size_t nClusterUsage = 0;
+    if (fClusterIndex) {
+        // Linearizations and chunk lists are approximated as one slot per transaction.
+        nClusterUsage = memusage::DynamicUsage(mapClusters) + memusage::DynamicUsage(mapClusterScore) + memusage::DynamicUsage(setClusterScores) +
+                        memusage::MallocUsage(sizeof(txiter) + sizeof(ClusterChunk)) * mapTx.size();
+    }
+    size_t nTxUsage = memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 14 * sizeof(void*)) * mapTx.size() + memusage::MallocUsage(mapTx.bucket_count() * sizeof(void*));
+    size_t nShortTxIDUsage = memusage::DynamicUsage(vShortTxIDCaches);
+    for (const ShortTxIDCache& cache : vShortTxIDCaches)
+        nShortTxIDUsage += memusage::DynamicUsage(cache.shortids);
+    size_t nAnchorUsage = memusage::DynamicUsage(mapSaplingAnchors) + memusage::MallocUsage(sizeof(memusage::stl_tree_node<txiter>)) * nSaplingAnchorSpenders;
+    size_t nReorgUsage = memusage::DynamicUsage(mapLockHeight) + memusage::DynamicUsage(mapLockTime) + memusage::DynamicUsage(mapLockInputBlock) + memusage::DynamicUsage(setCoinbaseUnindexed) + memusage::DynamicUsage(mapCoinbaseMaturity);
+    for (const auto& item : mapLockHeight)
+        nReorgUsage += memusage::DynamicUsage(item.second);
+    for (const auto& item : mapLockTime)
+        nReorgUsage += memusage::DynamicUsage(item.second);
+    for (const auto& item : mapLockInputBlock)
+        nReorgUsage += memusage::DynamicUsage(item.second);
+    for (const auto& item : mapCoinbaseMaturity)
+        nReorgUsage += memusage::DynamicUsage(item.second);
+    size_t nIndexUsage = memusage::DynamicUsage(mapAddress) + memusage::DynamicUsage(mapAddressInserted) + memusage::DynamicUsage(mapSpent) + memusage::DynamicUsage(mapSpentInserted) + cachedIndexUsage;
+    return nTxUsage + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas) + memusage::DynamicUsage(vLinks) + memusage::DynamicUsage(vLinksFree) + memusage::DynamicUsage(vTxHashes) + memusage::DynamicUsage(mapBiggestBid) + memusage::DynamicUsage(mapSaplingNullifiers) + nAnchorUsage + nReorgUsage + nIndexUsage + nShortTxIDUsage + cachedInnerUsage + nClusterUsage;
 }
 
 void CTxMemPool::RemoveStaged(setEntries& stage, bool updateDescendants, MemPoolRemovalReason reason)
 {
     AssertLockHeld(cs);
     UpdateForRemoveFromMempool(stage, updateDescendants);
+    if (fClusterIndex)
+        ClusterRemove(stage);
     for (const txiter& it : stage) {
         removeUnchecked(it, reason);
     }
@@ -1297,38 +1596,36 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry,
 
 void CTxMemPool::UpdateChild(txiter entry, txiter child, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].children.insert(child).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].children.erase(child)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    TxLinkSet& children = vLinks[entry->nLinksIdx].children;
+    size_t nUsageBefore = children.DynamicMemoryUsage();
+    if (add ? children.insert(child) : children.erase(child)) {
+        cachedInnerUsage += children.DynamicMemoryUsage();
+        cachedInnerUsage -= nUsageBefore;
     }
 }
 
 void CTxMemPool::UpdateParent(txiter entry, txiter parent, bool add)
 {
-    setEntries s;
-    if (add && mapLinks[entry].parents.insert(parent).second) {
-        cachedInnerUsage += memusage::IncrementalDynamicUsage(s);
-    } else if (!add && mapLinks[entry].parents.erase(parent)) {
-        cachedInnerUsage -= memusage::IncrementalDynamicUsage(s);
+    TxLinkSet& parents = vLinks[entry->nLinksIdx].parents;
+    size_t nUsageBefore = parents.DynamicMemoryUsage();
+    if (add ? parents.insert(parent) : parents.erase(parent)) {
+        cachedInnerUsage += parents.DynamicMemoryUsage();
+        cachedInnerUsage -= nUsageBefore;
     }
 }
 
-const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+const CTxMemPool::TxLinkSet& CTxMemPool::GetMemPoolParents(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.parents;
+    assert(entry->nLinksIdx < vLinks.size());
+    return vLinks[entry->nLinksIdx].parents;
 }
 
-const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+const CTxMemPool::TxLinkSet& CTxMemPool::GetMemPoolChildren(txiter entry) const
 {
     assert (entry != mapTx.end());
-    txlinksMap::const_iterator it = mapLinks.find(entry);
-    assert(it != mapLinks.end());
-    return it->second.children;
+    assert(entry->nLinksIdx < vLinks.size());
+    return vLinks[entry->nLinksIdx].children;
 }
 
 CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
@@ -1372,19 +1669,31 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
     unsigned nTxnRemoved = 0;
     CFeeRate maxFeeRateRemoved(0);
     while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
-        indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+        setEntries stage;
+        CFeeRate removed;
+        if (fClusterIndex) {
+            // The last chunk of the cluster whose last chunk pays least is the
+            // set that would be mined last; it is a suffix of a topological
+            // order, so it already holds all of its in-mempool descendants.
+            const TxCluster& cluster = mapClusters[setClusterScores.begin()->nClusterId];
+            const ClusterChunk& chunk = cluster.vChunks.back();
+            removed = CFeeRate(chunk.nModFees, chunk.nSize);
+            for (size_t i = chunk.nBegin; i < chunk.nEnd; i++)
+                CalculateDescendants(cluster.vLinearization[i], stage);
+        } else {
+            indexed_transaction_set::index<descendant_score>::type::iterator it = mapTx.get<descendant_score>().begin();
+            removed = CFeeRate(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+            CalculateDescendants(mapTx.project<0>(it), stage);
+        }
 
         // We set the new mempool min fee to the feerate of the removed set, plus the
         // "minimum reasonable fee rate" (ie some value under which we consider txn
         // to have 0 fee). This way, we don't allow txn to enter mempool with feerate
         // equal to txn which were removed with no block in between.
-        CFeeRate removed(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
         removed += incrementalRelayFee;
         trackPackageRemoved(removed);
         maxFeeRateRemoved = std::max(maxFeeRateRemoved, removed);
 
-        setEntries stage;
-        CalculateDescendants(mapTx.project<0>(it), stage);
         nTxnRemoved += stage.size();
 
         std::vector<CTransaction> txn;
@@ -1408,6 +1717,346 @@ void CTxMemPool::TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpends
         LogPrint("mempool", "Removed %u txn, rolling minimum fee bumped to %s\n", nTxnRemoved, maxFeeRateRemoved.ToString());
 }
 
+void CTxMemPool::TrimClusters(std::vector<COutPoint>* pvNoSpendsRemaining)
+{
+    LOCK(cs);
+    if (!fClusterIndex)
+        return;
+
+    // A suffix of a linearization holds all of its in-mempool descendants and
+    // is the part of the cluster that pays least.
+    setEntries stage;
+    for (const auto& item : mapClusters) {
+        const std::vector<txiter>& vLinearization = item.second.vLinearization;
+        for (size_t i = nClusterLimit; i < vLinearization.size(); i++)
+            stage.insert(vLinearization[i]);
+    }
+    if (stage.empty())
+        return;
+
+    std::vector<CTransaction> txn;
+    if (pvNoSpendsRemaining) {
+        txn.reserve(stage.size());
+        for (txiter iter : stage)
+            txn.push_back(iter->GetTx());
+    }
+    LogPrint("mempool", "Removed %u txn over the cluster limit\n", stage.size());
+    RemoveStaged(stage, false, MemPoolRemovalReason::SIZELIMIT);
+    if (pvNoSpendsRemaining) {
+        for (const CTransaction& tx : txn) {
+            for (const CTxIn& txin : tx.vin) {
+                if (exists(txin.prevout.hash)) continue;
+                pvNoSpendsRemaining->push_back(txin.prevout);
+            }
+        }
+    }
+}
+
+namespace
+{
+/** Max-heap order on the modified fee rate of a single entry */
+struct CompareTxIterByModifiedFeeRate {
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        double f1 = (double)a->GetModifiedFee() * b->GetTxSize();
+        double f2 = (double)b->GetModifiedFee() * a->GetTxSize();
+        if (f1 == f2)
+            return b->GetTx().GetHash() < a->GetTx().GetHash();
+        return f1 < f2;
+    }
+};
+}
+
+void CTxMemPool::ClusterAdd(txiter it)
+{
+    // The largest parent cluster absorbs the others.
+    std::set<uint64_t> setParentClusters;
+    for (txiter parent : GetMemPoolParents(it)) {
+        if (parent->nClusterId != 0)
+            setParentClusters.insert(parent->nClusterId);
+    }
+    uint64_t id = 0;
+    for (uint64_t idParent : setParentClusters) {
+        if (id == 0 || mapClusters[idParent].vLinearization.size() > mapClusters[id].vLinearization.size())
+            id = idParent;
+    }
+    if (id == 0)
+        id = nNextClusterId++;
+    for (uint64_t idParent : setParentClusters) {
+        if (idParent != id)
+            ClusterMerge(id, idParent);
+    }
+
+    // A new transaction has no in-mempool children yet, so appending it keeps
+    // the linearization topological.
+    TxCluster& cluster = mapClusters[id];
+    cluster.vLinearization.push_back(it);
+    cluster.nTxSize += it->GetTxSize();
+    it->nClusterId = id;
+    ClusterRechunk(id);
+}
+
+void CTxMemPool::ClusterLink(const std::vector<txiter>& vEntries)
+{
+    std::set<uint64_t> setTouched;
+    for (txiter it : vEntries) {
+        uint64_t id = it->nClusterId;
+        for (txiter child : GetMemPoolChildren(it)) {
+            uint64_t idChild = child->nClusterId;
+            if (idChild == id)
+                continue;
+            if (mapClusters[idChild].vLinearization.size() > mapClusters[id].vLinearization.size())
+                std::swap(id, idChild);
+            ClusterMerge(id, idChild);
+            setTouched.erase(idChild);
+        }
+        setTouched.insert(id);
+    }
+    // Merging only interleaves chunks, which can put a child ahead of a
+    // parent it was just linked to, so order the merged clusters afresh.
+    for (uint64_t id : setTouched) {
+        if (mapClusters.count(id))
+            ClusterRelinearize(id);
+    }
+}
+
+void CTxMemPool::ClusterRemove(const setEntries& stage)
+{
+    std::set<uint64_t> setTouched;
+    for (txiter it : stage) {
+        if (it->nClusterId != 0)
+            setTouched.insert(it->nClusterId);
+    }
+
+    std::vector<uint64_t> vNewClusters;
+    for (uint64_t id : setTouched) {
+        std::vector<txiter> vRemaining;
+        for (txiter it : mapClusters[id].vLinearization) {
+            it->nClusterId = 0;
+            if (!stage.count(it))
+                vRemaining.push_back(it);
+        }
+        ClusterErase(id);
+
+        // The links to the staged entries are already gone, so whatever is
+        // left may fall apart into several clusters. Find them with a flood
+        // fill over the remaining links.
+        for (txiter it : vRemaining) {
+            if (it->nClusterId != 0)
+                continue;
+            uint64_t idNew = nNextClusterId++;
+            vNewClusters.push_back(idNew);
+            it->nClusterId = idNew;
+            std::vector<txiter> vStack(1, it);
+            while (!vStack.empty()) {
+                txiter cur = vStack.back();
+                vStack.pop_back();
+                for (txiter parent : GetMemPoolParents(cur)) {
+                    if (parent->nClusterId == 0 && !stage.count(parent)) {
+                        parent->nClusterId = idNew;
+                        vStack.push_back(parent);
+                    }
+                }
+                for (txiter child : GetMemPoolChildren(cur)) {
+                    if (child->nClusterId == 0 && !stage.count(child)) {
+                        child->nClusterId = idNew;
+                        vStack.push_back(child);
+                    }
+                }
+            }
+        }
+
+        // Each part keeps its relative order from the old linearization,
+        // which is still topological.
+        for (txiter it : vRemaining) {
+            TxCluster& cluster = mapClusters[it->nClusterId];
+            cluster.vLinearization.push_back(it);
+            cluster.nTxSize += it->GetTxSize();
+        }
+    }
+
+    for (uint64_t id : vNewClusters)
+        ClusterRechunk(id);
+}
+
+void CTxMemPool::ClusterMerge(uint64_t idTo, uint64_t idFrom)
+{
+    TxCluster& to = mapClusters[idTo];
+    TxCluster& from = mapClusters[idFrom];
+
+    // Both chunk lists are in non-increasing fee rate order; merging them
+    // keeps each cluster's own order, so the result stays topological.
+    std::vector<txiter> vMerged;
+    vMerged.reserve(to.vLinearization.size() + from.vLinearization.size());
+    size_t i = 0, j = 0;
+    while (i < to.vChunks.size() || j < from.vChunks.size()) {
+        bool fTakeTo;
+        if (j == from.vChunks.size()) {
+            fTakeTo = true;
+        } else if (i == to.vChunks.size()) {
+            fTakeTo = false;
+        } else {
+            const ClusterChunk& a = to.vChunks[i];
+            const ClusterChunk& b = from.vChunks[j];
+            fTakeTo = (double)a.nModFees * b.nSize >= (double)b.nModFees * a.nSize;
+        }
+        const ClusterChunk& chunk = fTakeTo ? to.vChunks[i++] : from.vChunks[j++];
+        const std::vector<txiter>& vLinearization = fTakeTo ? to.vLinearization : from.vLinearization;
+        vMerged.insert(vMerged.end(), vLinearization.begin() + chunk.nBegin, vLinearization.begin() + chunk.nEnd);
+    }
+
+    for (txiter it : from.vLinearization)
+        it->nClusterId = idTo;
+    to.vLinearization.swap(vMerged);
+    to.nTxSize += from.nTxSize;
+    ClusterErase(idFrom);
+    ClusterRechunk(idTo);
+}
+
+void CTxMemPool::ClusterRelinearize(uint64_t id)
+{
+    std::map<uint64_t, TxCluster>::iterator itCluster = mapClusters.find(id);
+    if (itCluster == mapClusters.end())
+        return;
+    TxCluster& cluster = itCluster->second;
+
+    // Kahn's algorithm, always taking the ready transaction with the best
+    // individual fee rate. Chunking then groups low fee parents with the
+    // children that pay for them.
+    CompareTxIterByModifiedFeeRate compare;
+    std::map<txiter, size_t, CompareIteratorByHash> mapParentsLeft;
+    std::vector<txiter> vReady;
+    for (txiter it : cluster.vLinearization) {
+        size_t nParents = GetMemPoolParents(it).size();
+        mapParentsLeft[it] = nParents;
+        if (nParents == 0)
+            vReady.push_back(it);
+    }
+    std::make_heap(vReady.begin(), vReady.end(), compare);
+
+    std::vector<txiter> vLinearization;
+    vLinearization.reserve(cluster.vLinearization.size());
+    while (!vReady.empty()) {
+        std::pop_heap(vReady.begin(), vReady.end(), compare);
+        txiter it = vReady.back();
+        vReady.pop_back();
+        vLinearization.push_back(it);
+        for (txiter child : GetMemPoolChildren(it)) {
+            if (--mapParentsLeft[child] == 0) {
+                vReady.push_back(child);
+                std::push_heap(vReady.begin(), vReady.end(), compare);
+            }
+        }
+    }
+    assert(vLinearization.size() == cluster.vLinearization.size());
+    cluster.vLinearization.swap(vLinearization);
+    ClusterRechunk(id);
+}
+
+void CTxMemPool::ClusterRechunk(uint64_t id)
+{
+    TxCluster& cluster = mapClusters[id];
+    const std::vector<txiter>& vLinearization = cluster.vLinearization;
+
+    // Start with a chunk per transaction and fold each chunk into the one
+    // before it for as long as it pays a better fee rate.
+    cluster.vChunks.clear();
+    for (size_t i = 0; i < vLinearization.size(); i++) {
+        ClusterChunk chunk = {i, i + 1, vLinearization[i]->GetModifiedFee(), vLinearization[i]->GetTxSize()};
+        while (!cluster.vChunks.empty()) {
+            const ClusterChunk& prev = cluster.vChunks.back();
+            if ((double)chunk.nModFees * prev.nSize <= (double)prev.nModFees * chunk.nSize)
+                break;
+            chunk.nBegin = prev.nBegin;
+            chunk.nModFees += prev.nModFees;
+            chunk.nSize += prev.nSize;
+            cluster.vChunks.pop_back();
+        }
+        cluster.vChunks.push_back(chunk);
+    }
+
+    std::map<uint64_t, ClusterScore>::iterator itScore = mapClusterScore.find(id);
+    if (itScore != mapClusterScore.end()) {
+        setClusterScores.erase(itScore->second);
+        mapClusterScore.erase(itScore);
+    }
+    if (!cluster.vChunks.empty()) {
+        ClusterScore score = {cluster.vChunks.back().nModFees, cluster.vChunks.back().nSize, id};
+        mapClusterScore.insert(std::make_pair(id, score));
+        setClusterScores.insert(score);
+    }
+}
+
+void CTxMemPool::ClusterErase(uint64_t id)
+{
+    std::map<uint64_t, ClusterScore>::iterator itScore = mapClusterScore.find(id);
+    if (itScore != mapClusterScore.end()) {
+        setClusterScores.erase(itScore->second);
+        mapClusterScore.erase(itScore);
+    }
+    mapClusters.erase(id);
+}
+
+void CTxMemPool::GetJoinedClusterSize(const CTxMemPoolEntry& entry, const setEntries& setParents, uint64_t& nCount, uint64_t& nSize) const
+{
+    std::set<uint64_t> setParentClusters;
+    for (txiter piter : setParents)
+        setParentClusters.insert(piter->nClusterId);
+    nCount = 1;
+    nSize = entry.GetTxSize();
+    for (uint64_t id : setParentClusters) {
+        std::map<uint64_t, TxCluster>::const_iterator itCluster = mapClusters.find(id);
+        if (itCluster == mapClusters.end())
+            continue;
+        nCount += itCluster->second.vLinearization.size();
+        nSize += itCluster->second.nTxSize;
+    }
+}
+
+bool CTxMemPool::CheckClusterLimit(const CTxMemPoolEntry& entry, std::string& errString) const
+{
+    LOCK(cs);
+    if (!fClusterIndex)
+        return true;
+
+    setEntries setParents;
+    for (const CTxIn& txin : entry.GetTx().vin) {
+        txiter piter = mapTx.find(txin.prevout.hash);
+        if (piter != mapTx.end())
+            setParents.insert(piter);
+    }
+    uint64_t nClusterCount, nClusterSize;
+    GetJoinedClusterSize(entry, setParents, nClusterCount, nClusterSize);
+    if (nClusterCount > nClusterLimit) {
+        errString = strprintf("too many transactions in cluster [limit: %u]", nClusterLimit);
+        return false;
+    }
+    return true;
+}
+
+void CTxMemPool::setClusterIndex(bool fEnable, unsigned int nLimit)
+{
+    LOCK(cs);
+    nClusterLimit = nLimit;
+    if (fEnable == fClusterIndex)
+        return;
+
+    mapClusters.clear();
+    mapClusterScore.clear();
+    setClusterScores.clear();
+    for (txiter it = mapTx.begin(); it != mapTx.end(); ++it)
+        it->nClusterId = 0;
+
+    fClusterIndex = fEnable;
+    if (!fClusterIndex)
+        return;
+
+    // Parents have fewer ancestors than their children, so this adds every
+    // entry after all of its in-mempool parents.
+    for (indexed_transaction_set::const_iterator it : GetSortedDepthAndScore())
+        ClusterAdd(it);
+}
+
 bool CTxMemPool::TransactionWithinChainLimit(const uint256& txid, size_t chainLimit) const
 {
     LOCK(cs);
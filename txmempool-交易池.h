@@ -7,9 +7,12 @@
 #ifndef VDS_TXMEMPOOL_H
 #define VDS_TXMEMPOOL_H
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 #include <string>
@@ -82,6 +85,7 @@ private:
     int64_t feeDelta;          //!< Used for determining the priority of the transaction for mining in a block
     LockPoints lockPoints;     //!< Track the height and time at which tx was final
     CAmount nMinGasPrice;      //!< The minimum gas price among the contract outputs of the tx
+    uint64_t nGasLimit;        //!< Sum of the gas limits of the contract outputs of the tx
 
     // Information about descendants of this transaction that are in the
     // mempool; if we remove this transaction we must remove all of these
@@ -100,7 +104,7 @@ public:
     CTxMemPoolEntry(const CTransactionRef& _tx, const CAmount& _nFee,
                     int64_t _nTime, unsigned int _entryHeight,
                     bool spendsCoinbase,
-                    int64_t nSigOpsCost, LockPoints lp, CAmount _nMinGasPrice = 0);
+                    int64_t nSigOpsCost, LockPoints lp, CAmount _nMinGasPrice = 0, uint64_t _nGasLimit = 0);
 
     const CTransaction& GetTx() const
     {
@@ -147,6 +151,10 @@ public:
     {
         return nMinGasPrice;
     }
+    uint64_t GetGasLimit() const
+    {
+        return nGasLimit;
+    }
 
     // Adjusts the descendant state, if this entry is not dirty.
     void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
@@ -194,6 +202,9 @@ public:
     }
 
     mutable size_t vTxHashesIdx; //!< Index in mempool's vTxHashes
+    mutable size_t nLinksIdx; //!< Index of the parent/child links in mempool's vLinks
+    mutable uint64_t nClusterId; //!< Cluster this entry belongs to, 0 if the cluster index is off
+    mutable int nCoinbaseMaturity; //!< Height from which its coinbase inputs are mature, 0 until removeForReorg looked them up
 };
 
 // Helpers for modifying CTxMemPool::mapTx, which is a boost multi_index.
@@ -506,7 +517,7 @@ public:
  *
  * In order for the feerate sort to remain correct, we must update transactions
  * in the mempool when new descendants arrive.  To facilitate this, we track
- * the set of in-mempool direct parents and direct children in mapLinks.  Within
+ * the set of in-mempool direct parents and direct children in vLinks.  Within
  * each CTxMemPoolEntry, we track the size and fees of all descendants.
  *
  * Usually when a new transaction is added to the mempool, it has no in-mempool
@@ -539,7 +550,7 @@ public:
  * state, to account for in-mempool, out-of-block descendants for all the
  * in-block transactions by calling UpdateTransactionsFromBlock().  Note that
  * until this is called, the mempool state is not consistent, and in particular
- * mapLinks may not be correct (and therefore functions like
+ * vLinks may not be correct (and therefore functions like
  * CalculateMemPoolAncestors() and CalculateDescendants() that rely
  * on them to walk the mempool are not generally safe to use).
  *
@@ -561,7 +572,7 @@ private:
     uint64_t totalTxSize;      //!< sum of all mempool tx's virtual sizes. Differs from serialized tx size since witness data is discounted. Defined in BIP 141.
     uint64_t cachedInnerUsage; //!< sum of dynamic memory usage of all the map elements (NOT the maps themselves)
 
-    std::map<uint256, const CTransaction*> mapSaplingNullifiers;
+    std::unordered_map<uint256, const CTransaction*, SaltedTxidHasher> mapSaplingNullifiers;
 
     mutable int64_t lastRollingFeeUpdate;
     mutable bool blockSinceLastRollingFeeBump;
@@ -613,6 +624,23 @@ public:
     typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
     std::vector<std::pair<uint256, txiter> > vTxHashes; //!< All tx witness hashes/entries in mapTx, in random order
 
+    /**
+     * Compact block short IDs of vTxHashes under the selector of a recent block, so
+     * that a second InitData for it only hashes transactions added since. The entries
+     * are kept in step with vTxHashes, SHORTTXID_UNKNOWN marks one not hashed yet.
+     */
+    struct ShortTxIDCache {
+        uint64_t k0;
+        uint64_t k1;
+        std::vector<uint64_t> shortids;
+    };
+    static const uint64_t SHORTTXID_UNKNOWN = std::numeric_limits<uint64_t>::max();
+    static const size_t MAX_SHORTTXID_CACHES = 2;
+    std::vector<ShortTxIDCache> vShortTxIDCaches; //!< Most recently used first
+
+    /** The short ID cache for a selector, replacing the least recently used one if it is new. Requires cs. */
+    ShortTxIDCache& GetShortTxIDCache(uint64_t k0, uint64_t k1);
+
     struct CompareIteratorByHash {
         bool operator()(const txiter& a, const txiter& b) const
         {
@@ -621,18 +649,165 @@ public:
     };
     typedef std::set<txiter, CompareIteratorByHash> setEntries;
 
-    const setEntries& GetMemPoolParents(txiter entry) const;
-    const setEntries& GetMemPoolChildren(txiter entry) const;
+    /**
+     * The direct in-mempool parents or children of one entry. Almost every
+     * entry has only a handful, so they are kept in a single vector sorted by
+     * txid rather than in a tree node per link, and iteration stays in one
+     * cache line or two. The txid order, the same as setEntries, keeps walks
+     * over the links independent of where the entries were allocated.
+     */
+    class TxLinkSet
+    {
+    private:
+        std::vector<txiter> vEntries;
+
+    public:
+        typedef std::vector<txiter>::const_iterator const_iterator;
+
+        const_iterator begin() const { return vEntries.begin(); }
+        const_iterator end() const { return vEntries.end(); }
+        size_t size() const { return vEntries.size(); }
+        bool empty() const { return vEntries.empty(); }
+
+        size_t count(const txiter& it) const
+        {
+            return std::binary_search(vEntries.begin(), vEntries.end(), it, CompareIteratorByHash());
+        }
+
+        /** Returns whether it was not in the set yet */
+        bool insert(const txiter& it)
+        {
+            std::vector<txiter>::iterator pos = std::lower_bound(vEntries.begin(), vEntries.end(), it, CompareIteratorByHash());
+            if (pos != vEntries.end() && *pos == it)
+                return false;
+            vEntries.insert(pos, it);
+            return true;
+        }
+
+        /** Returns whether it was in the set */
+        bool erase(const txiter& it)
+        {
+            std::vector<txiter>::iterator pos = std::lower_bound(vEntries.begin(), vEntries.end(), it, CompareIteratorByHash());
+            if (pos == vEntries.end() || *pos != it)
+                return false;
+            vEntries.erase(pos);
+            return true;
+        }
+
+        size_t DynamicMemoryUsage() const
+        {
+            return memusage::DynamicUsage(vEntries);
+        }
+    };
+
+    const TxLinkSet& GetMemPoolParents(txiter entry) const;
+    const TxLinkSet& GetMemPoolChildren(txiter entry) const;
 private:
     typedef std::map<txiter, setEntries, CompareIteratorByHash> cacheMap;
 
     struct TxLinks {
-        setEntries parents;
-        setEntries children;
+        TxLinkSet parents;
+        TxLinkSet children;
+    };
+
+    /**
+     * Links of all entries, addressed by CTxMemPoolEntry::nLinksIdx. Slots
+     * of removed entries are reset and reused through vLinksFree, so an
+     * entry's links cost no allocation of their own and no map lookup.
+     */
+    std::vector<TxLinks> vLinks;
+    std::vector<size_t> vLinksFree;
+
+    /** In-mempool spenders of each Sapling anchor, so removeWithAnchor only visits what it removes */
+    std::unordered_map<uint256, setEntries, SaltedTxidHasher> mapSaplingAnchors;
+    size_t nSaplingAnchorSpenders; //!< Entries in all sets of mapSaplingAnchors
+
+    /**
+     * Entries removeForReorg has to look at again. Transactions with a lock
+     * time or BIP68 sequence lock that can bind are keyed by the last
+     * next-block height and median time past they are still locked at, and
+     * by the block their lock points were computed on, so a reorg only
+     * re-checks those locked above the new tip or computed on a block that
+     * left the chain. Coinbase spenders are keyed by the height their
+     * coinbase inputs mature at, so a reorg only visits those maturing above
+     * the new tip; the ones added since the last reorg wait in
+     * setCoinbaseUnindexed until removeForReorg has looked up their coins.
+     */
+    std::map<int, setEntries> mapLockHeight;
+    std::map<int64_t, setEntries> mapLockTime;
+    std::map<const CBlockIndex*, setEntries> mapLockInputBlock;
+    setEntries setCoinbaseUnindexed;
+    std::map<int, setEntries> mapCoinbaseMaturity;
+
+    /** Add an entry with binding locks to mapLockHeight, mapLockTime and mapLockInputBlock */
+    void LockIndexAdd(txiter it);
+    void LockIndexErase(txiter it);
+
+public:
+    /** A run [nBegin, nEnd) of a cluster linearization mined together */
+    struct ClusterChunk {
+        size_t nBegin;
+        size_t nEnd;
+        CAmount nModFees;
+        uint64_t nSize;
+    };
+
+    /**
+     * A cluster is a maximal set of transactions connected through in-mempool
+     * parent/child links. vLinearization is a topologically valid ordering of
+     * the cluster, and vChunks splits it into runs of non-increasing fee rate,
+     * so the cluster is best mined chunk by chunk from the front and evicted
+     * chunk by chunk from the back.
+     */
+    struct TxCluster {
+        std::vector<txiter> vLinearization;
+        std::vector<ClusterChunk> vChunks;
+        uint64_t nTxSize;
+
+        TxCluster() : nTxSize(0) {}
     };
 
-    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
-    txlinksMap mapLinks;
+private:
+    /** Fee rate of the last (worst) chunk of a cluster, used to pick eviction candidates */
+    struct ClusterScore {
+        CAmount nModFees;
+        uint64_t nSize;
+        uint64_t nClusterId;
+    };
+
+    struct CompareClusterScore {
+        bool operator()(const ClusterScore& a, const ClusterScore& b) const
+        {
+            double f1 = (double)a.nModFees * b.nSize;
+            double f2 = (double)b.nModFees * a.nSize;
+            if (f1 == f2)
+                return a.nClusterId < b.nClusterId;
+            return f1 < f2;
+        }
+    };
+
+    bool fClusterIndex;            //!< Whether transactions are grouped into clusters (-mempoolclusters)
+    unsigned int nClusterLimit;    //!< Maximum number of transactions in one cluster
+    uint64_t nNextClusterId;
+    std::map<uint64_t, TxCluster> mapClusters;
+    std::map<uint64_t, ClusterScore> mapClusterScore;
+    std::set<ClusterScore, CompareClusterScore> setClusterScores;
+
+    /** Number and size of the transactions in the cluster an entry with these in-mempool parents would join, itself included */
+    void GetJoinedClusterSize(const CTxMemPoolEntry& entry, const setEntries& setParents, uint64_t& nCount, uint64_t& nSize) const;
+    /** Put a newly added entry into the cluster of its in-mempool parents, merging those clusters */
+    void ClusterAdd(txiter it);
+    /** Merge the clusters of the given entries and of their in-mempool children (after a reorg linked them) */
+    void ClusterLink(const std::vector<txiter>& vEntries);
+    /** Drop the staged entries from their clusters and split what is left into connected clusters */
+    void ClusterRemove(const setEntries& stage);
+    /** Move every transaction of cluster idFrom into cluster idTo, interleaving the two by chunk fee rate */
+    void ClusterMerge(uint64_t idTo, uint64_t idFrom);
+    /** Rebuild a topologically valid linearization of a cluster from scratch */
+    void ClusterRelinearize(uint64_t id);
+    /** Recompute the chunks of a cluster from its linearization and refresh its eviction score */
+    void ClusterRechunk(uint64_t id);
+    void ClusterErase(uint64_t id);
 
     typedef std::map<CMempoolAddressDeltaKey, CMempoolAddressDelta, CMempoolAddressDeltaKeyCompare> addressDeltaMap;
     addressDeltaMap mapAddress;
@@ -646,6 +821,9 @@ private:
     typedef std::map<uint256, std::vector<CSpentIndexKey> > mapSpentIndexInserted;
     mapSpentIndexInserted mapSpentInserted;
 
+    //! Heap usage of the key lists in mapAddressInserted and mapSpentInserted
+    uint64_t cachedIndexUsage;
+
     void UpdateParent(txiter entry, txiter parent, bool add);
     void UpdateChild(txiter entry, txiter child, bool add);
 
@@ -672,6 +850,20 @@ public:
         nCheckFrequency = dFrequency * 4294967295.0;
     }
 
+    /**
+     * Turn the cluster index on or off (-mempoolclusters). With it on,
+     * connected transactions are grouped into clusters with an incrementally
+     * maintained fee-rate linearization, which TrimToSize uses for eviction.
+     * nLimit bounds the cluster size.
+     */
+    void setClusterIndex(bool fEnable, unsigned int nLimit);
+    /** Whether an entry not in the mempool yet keeps its cluster within the limit, always true with the cluster index off */
+    bool CheckClusterLimit(const CTxMemPoolEntry& entry, std::string& errString) const;
+    bool HasClusterIndex() const
+    {
+        return fClusterIndex;
+    }
+
     void CheckBiggestBid(const int& nHeight);
 
     // addUnchecked must updated state for all ancestors of a given transaction,
@@ -744,7 +936,7 @@ public:
      *  limitDescendantSize = max size of descendants any ancestor can have
      *  errString = populated with error reason if any limits are hit
      *  fSearchForParents = whether to search a tx's vin for in-mempool parents, or
-     *    look up parents from mapLinks. Must be true for entries not in the mempool
+     *    look up parents from vLinks. Must be true for entries not in the mempool
      */
     bool CalculateMemPoolAncestors(const CTxMemPoolEntry& entry, setEntries& setAncestors, uint64_t limitAncestorCount, uint64_t limitAncestorSize, uint64_t limitDescendantCount, uint64_t limitDescendantSize, std::string& errString, bool fSearchForParents = true) const;
 
@@ -767,6 +959,9 @@ public:
       */
     void TrimToSize(size_t sizelimit, std::vector<COutPoint>* pvNoSpendsRemaining = nullptr);
 
+    /** Remove the worst paying transactions of clusters over the limit, which a reorg can link together; pvNoSpendsRemaining as in TrimToSize */
+    void TrimClusters(std::vector<COutPoint>* pvNoSpendsRemaining = nullptr);
+
     /** Expire all transaction (and their dependencies) in the mempool older than time. Return the number of removed transactions. */
     int Expire(int64_t time);
 
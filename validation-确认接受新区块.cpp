@@ -19,12 +19,14 @@
 #include "clue.h"
 #include "deprecation.h"
 #include "fs.h"
+#include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "net_processing.h"
 #include "policy/policy.h"
 #include "pow.h"
+#include "random.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -41,15 +43,28 @@
 #include "masternode-sync.h"
 #include "masternodeman.h"
 
+#include <deque>
+#include <limits>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 #include <boost/static_assert.hpp>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "librustzcash.h"
 
 using namespace std;
@@ -89,6 +104,7 @@ bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = true;
+bool fAddressUtxoHeightIndex = false;
 bool fLogEvents = true; // false as default
 bool fAddressIndex = true; // false as default
 bool fHavePruned = false;
@@ -531,7 +547,7 @@ bool IsClueRoot(const CTxDestination& dest, const int nCurHeight)
     }
 
     std::vector<CUtxo> vTxOut;
-    return GetUTXOAtHeight(dest, nHeight, vTxOut, 0.1 * COIN);
+    return GetUTXOAtHeight(dest, nHeight, vTxOut, 0.1 * COIN, 1);
 }
 
 bool GetTransactionClue(const CTransaction& tx, const CCoinsViewCache& view, CClue& clue, std::map<CTxDestination, CRankItem>& vItem, bool& fRoot)
@@ -662,6 +678,11 @@ void UpdateMempoolForReorg(DisconnectedBlockTransactions& disconnectpool, bool f
 
     // We also need to remove any now-immature transactions
     mempool.removeForReorg(pcoinsTip, chainActive.Tip()->nHeight + 1, STANDARD_LOCKTIME_VERIFY_FLAGS);
+    // The re-added transactions skipped the cluster limit and may have joined clusters
+    std::vector<COutPoint> vNoSpendsRemaining;
+    mempool.TrimClusters(&vNoSpendsRemaining);
+    for (const COutPoint& removed : vNoSpendsRemaining)
+        pcoinsTip->Uncache(removed);
     // Re-limit mempool size, in case we added any transactions
     LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
 }
@@ -878,6 +899,14 @@ bool ContextualCheckTransaction(
     const int nHeight,
     const int dosLevel,
     bool (*isInitBlockDownload)())
+{
+    if (!ContextualCheckTransactionWithoutProofVerification(tx, state, nHeight, dosLevel))
+        return false;
+
+    return CheckShieldedProofs(tx, state);
+}
+
+bool ContextualCheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState& state, const int nHeight, const int dosLevel)
 {
     // Check that all transactions are unexpired
     if (IsExpiredTx(tx, nHeight)) {
@@ -894,6 +923,11 @@ bool ContextualCheckTransaction(
         }
     }
 
+    return true;
+}
+
+bool CheckShieldedProofs(const CTransaction& tx, CValidationState& state)
+{
     uint256 dataToBeSigned;
 
     if (!tx.vShieldedSpend.empty() ||
@@ -1391,6 +1425,7 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const
         dev::u256 txMinGasPrice = 0;
 
         dev::u256 sumGas = dev::u256(0);
+        uint64_t nTxGasLimit = 0;
         //////////////////////////////////////////////////////////// // qtum
         if (tx.HasCreateOrCall()) {
 
@@ -1463,6 +1498,9 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const
             if (!CheckMinGasPrice(qtumETP, minGasPrice))
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-small-gasprice");
 
+            // Bounded by blockGasLimit above
+            nTxGasLimit = (uint64_t)gasAllTxs;
+
             if (count > qtumTransactions.size())
                 return state.DoS(100, false, REJECT_INVALID, "bad-txns-incorrect-format");
 
@@ -1497,7 +1535,7 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const
 
         CTransactionRef ptx = MakeTransactionRef(tx);
         CTxMemPoolEntry entry(ptx, nFees, nAcceptTime, chainActive.Height(),
-                              fSpendsCoinbase, nSigOps, lp, CAmount(txMinGasPrice));
+                              fSpendsCoinbase, nSigOps, lp, CAmount(txMinGasPrice), nTxGasLimit);
         unsigned int nSize = entry.GetTxSize();
 
         if (tx.nFlag == CTransaction::BID_TX) {
@@ -1570,6 +1608,10 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const
                              nFees, ::minRelayTxFee.GetFee(nSize) * 10000);
         }
 
+        std::string errString;
+        if (!pool.CheckClusterLimit(entry, errString))
+            return state.Invalid(false, REJECT_NONSTANDARD, "too-long-mempool-chain", errString);
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1603,57 +1645,259 @@ bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState& state, const
     return true;
 }
 
-/** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
-bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus::Params& consensusParams, uint256& hashBlock, bool fAllowSlow)
+// Index reads that also see batches still queued for ThreadIndexWriter
+static bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos);
+static bool ReadAnonymousBlock(const uint256& blockhash, AnonymousBlock& ablock);
+static bool ReadAddressIndex(uint160 addressHash, int type,
+                             std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start, int end);
+static bool ReadAddressUnspentIndex(uint160 addressHash, int type,
+                                    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+static bool ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                 const CAddressIndexKey* pkeyAfter, CAddressIndexPageResult& page);
+static bool ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                        const CAddressUnspentKey* pkeyAfter, CAddressUnspentPageResult& page);
+static bool ReadSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value);
+static bool ReadAddressUtxoAtHeight(uint160 addressHash, int type, int nHeight, CAmount nMinValue,
+                                    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> >& vect, size_t nMaxResults);
+
+/** Shards of the decoded transaction cache, each with its own lock */
+static const size_t TX_LOOKUP_CACHE_SHARDS = 16;
+/** Idle block file handles kept open for transaction lookups */
+static const size_t MAX_IDLE_BLOCK_FILE_HANDLES = 32;
+
+/**
+ * Transactions read through the transaction index, decoded, with the block they
+ * were found in. An index change for a txid erases its entry, and a lookup that
+ * raced with such a change does not store its result (see nGeneration).
+ */
+class CTxLookupCache
 {
-    CBlockIndex* pindexSlow = NULL;
+private:
+    struct Entry {
+        CTransactionRef tx;
+        uint256 hashBlock;
+        size_t nUsage;
+    };
+    typedef std::list<std::pair<uint256, Entry> > EntryList;
+
+    struct Shard {
+        boost::mutex mutex;
+        EntryList lru; //!< Most recently used first
+        boost::unordered_map<uint256, EntryList::iterator, BlockHasher> map;
+        size_t nUsage;
+        uint64_t nGeneration; //!< Bumped by every Erase
+        Shard() : nUsage(0), nGeneration(0) {}
+    };
+
+    Shard shards[TX_LOOKUP_CACHE_SHARDS];
+    const size_t nMaxShardUsage;
+
+    Shard& GetShard(const uint256& txid)
+    {
+        return shards[txid.GetCheapHash() % TX_LOOKUP_CACHE_SHARDS];
+    }
 
-    LOCK(cs_main);
+public:
+    explicit CTxLookupCache(size_t nMaxUsage) : nMaxShardUsage(nMaxUsage / TX_LOOKUP_CACHE_SHARDS) {}
 
-    CTransactionRef ptx = mempool.get(hash);
-    if (ptx) {
-        txOut = ptx;
+    /** nGeneration is to be passed to Put after a miss */
+    bool Get(const uint256& txid, CTransactionRef& tx, uint256& hashBlock, uint64_t& nGeneration)
+    {
+        Shard& shard = GetShard(txid);
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        nGeneration = shard.nGeneration;
+        boost::unordered_map<uint256, EntryList::iterator, BlockHasher>::iterator it = shard.map.find(txid);
+        if (it == shard.map.end())
+            return false;
+        shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+        tx = it->second->second.tx;
+        hashBlock = it->second->second.hashBlock;
         return true;
     }
 
-    if (fTxIndex) {
-        // Check if this is the coinbase transaction in genesis block
-        for (const auto& tx : Params().GenesisBlock().vtx) {
-            if (tx->GetHash() == hash) {
-                txOut = tx;
-                hashBlock = consensusParams.hashGenesisBlock;
-                return true;
+    void Put(const uint256& txid, const CTransactionRef& tx, const uint256& hashBlock, uint64_t nGeneration)
+    {
+        if (nMaxShardUsage == 0)
+            return;
+        Entry entry = {tx, hashBlock, RecursiveDynamicUsage(*tx) + memusage::DynamicUsage(tx) + memusage::MallocUsage(sizeof(EntryList::value_type) + 2 * sizeof(void*)) + memusage::MallocUsage(sizeof(void*) * 3)};
+        Shard& shard = GetShard(txid);
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        if (shard.nGeneration != nGeneration || shard.map.count(txid))
+            return;
+        shard.lru.push_front(std::make_pair(txid, entry));
+        shard.map[txid] = shard.lru.begin();
+        shard.nUsage += entry.nUsage;
+        while (shard.nUsage > nMaxShardUsage && !shard.lru.empty()) {
+            shard.nUsage -= shard.lru.back().second.nUsage;
+            shard.map.erase(shard.lru.back().first);
+            shard.lru.pop_back();
+        }
+    }
+
+    void Erase(const uint256& txid)
+    {
+        Shard& shard = GetShard(txid);
+        boost::unique_lock<boost::mutex> lock(shard.mutex);
+        shard.nGeneration++;
+        boost::unordered_map<uint256, EntryList::iterator, BlockHasher>::iterator it = shard.map.find(txid);
+        if (it == shard.map.end())
+            return;
+        shard.nUsage -= it->second->second.nUsage;
+        shard.lru.erase(it->second);
+        shard.map.erase(it);
+    }
+};
+
+static CTxLookupCache& GetTxLookupCache()
+{
+    static CTxLookupCache cache(std::max<int64_t>(GetArg("-txlookupcache", DEFAULT_TX_LOOKUP_CACHE), 0) << 20);
+    return cache;
+}
+
+/** Drop the cached transactions whose index entries an update changes, call once the update is readable */
+static void EraseTxLookupCache(const CBlockIndexUpdate& update)
+{
+    if (!fTxIndex)
+        return;
+    CTxLookupCache& cache = GetTxLookupCache();
+    for (const auto& item : update.vTxIndex)
+        cache.Erase(item.first);
+}
+
+/**
+ * Read only block file handles kept open between transaction lookups. A handle
+ * is used by one lookup at a time and given back with Release when it is done.
+ */
+class CBlockFileHandleCache
+{
+private:
+    boost::mutex mutex;
+    std::list<std::pair<int, FILE*> > lruIdle; //!< Most recently released first
+
+public:
+    ~CBlockFileHandleCache()
+    {
+        for (const auto& item : lruIdle)
+            fclose(item.second);
+    }
+
+    /** A handle to the block file of pos, positioned at pos */
+    FILE* Open(const CDiskBlockPos& pos)
+    {
+        FILE* file = nullptr;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            for (std::list<std::pair<int, FILE*> >::iterator it = lruIdle.begin(); it != lruIdle.end(); ++it) {
+                if (it->first == pos.nFile) {
+                    file = it->second;
+                    lruIdle.erase(it);
+                    break;
+                }
             }
         }
+        if (!file)
+            return OpenBlockFile(pos, true);
+        if (fseek(file, pos.nPos, SEEK_SET)) {
+            fclose(file);
+            return nullptr;
+        }
+        return file;
+    }
 
-        CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (const std::exception& e) {
-                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    void Release(int nFile, FILE* file)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        lruIdle.push_front(std::make_pair(nFile, file));
+        if (lruIdle.size() > MAX_IDLE_BLOCK_FILE_HANDLES) {
+            fclose(lruIdle.back().second);
+            lruIdle.pop_back();
+        }
+    }
+
+    /** Close the idle handles of a block file that is about to be deleted */
+    void Close(int nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (std::list<std::pair<int, FILE*> >::iterator it = lruIdle.begin(); it != lruIdle.end();) {
+            if (it->first == nFile) {
+                fclose(it->second);
+                it = lruIdle.erase(it);
+            } else {
+                ++it;
             }
-            hashBlock = header.GetHash();
-            if (txOut->GetHash() != hash)
-                return error("%s: txid mismatch", __func__);
+        }
+    }
+};
+
+static CBlockFileHandleCache blockFileHandles;
+
+static bool IsGenesisTransaction(const uint256& hash, CTransactionRef& txOut, uint256& hashBlock, const Consensus::Params& consensusParams)
+{
+    for (const auto& tx : Params().GenesisBlock().vtx) {
+        if (tx->GetHash() == hash) {
+            txOut = tx;
+            hashBlock = consensusParams.hashGenesisBlock;
             return true;
         }
     }
+    return false;
+}
+
+/** Read a transaction through the transaction index, which needs no cs_main */
+static bool ReadIndexedTransaction(const uint256& hash, CTransactionRef& txOut, uint256& hashBlock)
+{
+    CTxLookupCache& cache = GetTxLookupCache();
+    uint64_t nGeneration;
+    if (cache.Get(hash, txOut, hashBlock, nGeneration))
+        return true;
+
+    CDiskTxPos postx;
+    if (!ReadTxIndex(hash, postx))
+        return false;
+    CAutoFile file(blockFileHandles.Open(postx), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: OpenBlockFile failed", __func__);
+    CBlockHeader header;
+    try {
+        file >> header;
+        fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
+        file >> txOut;
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+    }
+    blockFileHandles.Release(postx.nFile, file.release());
+    hashBlock = header.GetHash();
+    if (txOut->GetHash() != hash)
+        return error("%s: txid mismatch", __func__);
+    cache.Put(hash, txOut, hashBlock, nGeneration);
+    return true;
+}
+
+/** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
+bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus::Params& consensusParams, uint256& hashBlock, bool fAllowSlow)
+{
+    CTransactionRef ptx = mempool.get(hash);
+    if (ptx) {
+        txOut = ptx;
+        return true;
+    }
+
+    if (fTxIndex) {
+        // Check if this is the coinbase transaction in genesis block
+        if (IsGenesisTransaction(hash, txOut, hashBlock, consensusParams))
+            return true;
+        if (ReadIndexedTransaction(hash, txOut, hashBlock))
+            return true;
+    }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
+        LOCK(cs_main);
+        CBlockIndex* pindexSlow = NULL;
         const Coin& coin = AccessByTxid(*pcoinsTip, hash);
         if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
-    }
 
-    if (pindexSlow) {
         CBlock block;
-        if (ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
+        if (pindexSlow && ReadBlockFromDisk(block, pindexSlow, consensusParams)) {
             for (const auto& tx : block.vtx) {
                 if (tx->GetHash() == hash) {
                     txOut = tx;
@@ -1667,6 +1911,96 @@ bool GetTransaction(const uint256& hash, CTransactionRef& txOut, const Consensus
     return false;
 }
 
+static bool CompareTxLookupPos(const std::pair<CDiskTxPos, size_t>& a, const std::pair<CDiskTxPos, size_t>& b)
+{
+    if (a.first.nFile != b.first.nFile)
+        return a.first.nFile < b.first.nFile;
+    if (a.first.nPos != b.first.nPos)
+        return a.first.nPos < b.first.nPos;
+    return a.first.nTxOffset < b.first.nTxOffset;
+}
+
+size_t GetTransactions(const std::vector<uint256>& vHash, std::vector<CTransactionRef>& vtxOut, std::vector<uint256>& vHashBlock, const Consensus::Params& consensusParams)
+{
+    vtxOut.assign(vHash.size(), CTransactionRef());
+    vHashBlock.assign(vHash.size(), uint256());
+    std::vector<uint64_t> vGeneration(vHash.size());
+    std::vector<std::pair<CDiskTxPos, size_t> > vRead;
+    CTxLookupCache& cache = GetTxLookupCache();
+    size_t nFound = 0;
+
+    for (size_t i = 0; i < vHash.size(); i++) {
+        vtxOut[i] = mempool.get(vHash[i]);
+        if (vtxOut[i]) {
+            nFound++;
+            continue;
+        }
+        if (!fTxIndex)
+            continue;
+        if (IsGenesisTransaction(vHash[i], vtxOut[i], vHashBlock[i], consensusParams) ||
+            cache.Get(vHash[i], vtxOut[i], vHashBlock[i], vGeneration[i])) {
+            nFound++;
+            continue;
+        }
+        CDiskTxPos pos;
+        if (ReadTxIndex(vHash[i], pos))
+            vRead.push_back(std::make_pair(pos, i));
+    }
+
+    // Read the rest in file order, every file opened once and every block header read once
+    std::sort(vRead.begin(), vRead.end(), CompareTxLookupPos);
+    size_t i = 0;
+    while (i < vRead.size()) {
+        const int nFile = vRead[i].first.nFile;
+        CAutoFile file(blockFileHandles.Open(vRead[i].first), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull()) {
+            error("%s: OpenBlockFile failed", __func__);
+            while (i < vRead.size() && vRead[i].first.nFile == nFile)
+                i++;
+            continue;
+        }
+        bool fHaveHeader = false;
+        unsigned int nHeaderPos = 0;
+        long nTxStart = 0;
+        uint256 hashBlock;
+        try {
+            for (; i < vRead.size() && vRead[i].first.nFile == nFile; i++) {
+                const CDiskTxPos& pos = vRead[i].first;
+                const size_t n = vRead[i].second;
+                if (!fHaveHeader || pos.nPos != nHeaderPos) {
+                    if (fseek(file.Get(), pos.nPos, SEEK_SET))
+                        throw std::ios_base::failure("seek failed");
+                    CBlockHeader header;
+                    file >> header;
+                    hashBlock = header.GetHash();
+                    nTxStart = ftell(file.Get());
+                    nHeaderPos = pos.nPos;
+                    fHaveHeader = true;
+                }
+                if (fseek(file.Get(), nTxStart + pos.nTxOffset, SEEK_SET))
+                    throw std::ios_base::failure("seek failed");
+                CTransactionRef tx;
+                file >> tx;
+                if (tx->GetHash() != vHash[n]) {
+                    error("%s: txid mismatch", __func__);
+                    continue;
+                }
+                vtxOut[n] = tx;
+                vHashBlock[n] = hashBlock;
+                cache.Put(vHash[n], tx, hashBlock, vGeneration[n]);
+                nFound++;
+            }
+        } catch (const std::exception& e) {
+            error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            while (i < vRead.size() && vRead[i].first.nFile == nFile)
+                i++;
+            continue;
+        }
+        blockFileHandles.Release(nFile, file.release());
+    }
+    return nFound;
+}
+
 /** Return merkletransaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const Consensus::Params& consensusParams)
 {
@@ -1676,9 +2010,6 @@ bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const
     int nIndex = -1;
     CBlock block;
 
-    LOCK(cs_main);
-
-
     if (fTxIndex) {
         // Check if this is the coinbase transaction in genesis block
         for (int i = 0; i < Params().GenesisBlock().vtx.size(); i++) {
@@ -1697,8 +2028,8 @@ bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const
         }
 
         CDiskTxPos postx;
-        if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
+        if (ReadTxIndex(hash, postx)) {
+            CAutoFile file(blockFileHandles.Open(postx), SER_DISK, CLIENT_VERSION);
             if (file.IsNull())
                 return error("%s: OpenBlockFile failed", __func__);
             try {
@@ -1706,6 +2037,7 @@ bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const
             } catch (const std::exception& e) {
                 return error("%s: Deserialize or I/O error - %s", __func__, e.what());
             }
+            blockFileHandles.Release(postx.nFile, file.release());
 
             fFindTx = true;
             for (int i = 0; i < block.vtx.size(); i++) {
@@ -1719,6 +2051,7 @@ bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const
     }
 
     if (!fFindTx) {
+        LOCK(cs_main);
         const Coin& coin = AccessByTxid(*pcoinsTip, hash);
         if (!coin.IsSpent()) pindexSlow = chainActive[coin.nHeight];
 
@@ -1739,53 +2072,43 @@ bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const
     return false;
 }
 
-bool GetMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char>>& filterdTxids, std::vector<CMerkleTxBlock>& output)
-{
-    AnonymousBlock ablock;
-    std::map<int, std::map<uint256, char>>::iterator filterItor = filterdTxids.find(blockHeight);
-    std::map<uint256, char> filteredTxs;
-    if (filterItor != filterdTxids.end())
-        filteredTxs = filterItor->second;
+typedef boost::unordered_set<uint256, BlockHasher> TxidFilter;
 
-    if (blockHeight > chainActive.Height())
-        return false;
+/** Blocks a range request reads ahead of the one it hands out, per reader thread */
+static const size_t MERKLE_RANGE_WINDOW_PER_THREAD = 4;
 
-    uint256 blockHash = chainActive[blockHeight]->GetBlockHash();
+static void MakeTxidFilter(const std::map<int, std::map<uint256, char> >& filterdTxids, int nHeight, TxidFilter& filter)
+{
+    std::map<int, std::map<uint256, char> >::const_iterator it = filterdTxids.find(nHeight);
+    if (it == filterdTxids.end())
+        return;
+    filter.reserve(it->second.size());
+    for (const auto& item : it->second)
+        filter.insert(item.first);
+}
 
-    if (!pblocktree->ReadAnonymousBlock(blockHash, ablock))
+/** Collect the filtered and the shielded transactions of a block, with the sapling tree before each shielded one */
+static bool BuildMerkleTxBlock(const CBlockIndex* pindex, const TxidFilter& filter, CMerkleTxBlock& merkleBlock)
+{
+    uint256 blockHash = pindex->GetBlockHash();
+    AnonymousBlock ablock;
+    if (!ReadAnonymousBlock(blockHash, ablock))
         return false;
 
-    if (filteredTxs.size() == 0 && ablock.txs.size() == 0) {
-        if (filterItor != filterdTxids.end())
-            filterdTxids.erase(filterItor);
+    if (filter.empty() && ablock.txs.empty())
         return true;
-    }
 
     CBlock block;
-    bool read;
-    int index = 0;
-    CBlockIndex* pblockindex = nullptr;
-    {
-        LOCK(cs_main);
-
-        if (mapBlockIndex.find(blockHash) != mapBlockIndex.end()) {
-            pblockindex = mapBlockIndex[blockHash];
-        }
-        assert(pblockindex != NULL);
-
-        if (!ReadBlockFromDisk(block, pblockindex, Params().GetConsensus())) {
-            LogPrintf("Cano not reade block %s from disk", blockHash.ToString().c_str());
-            return false;
-        }
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
+        LogPrintf("Cano not reade block %s from disk", blockHash.ToString().c_str());
+        return false;
     }
-    CMerkleTxBlock merkleBlock(blockHash);
+
+    int index = 0;
     std::vector<AnonymousTxInfo>::iterator itor_anonymousTx = ablock.txs.begin();
     for (CTransactionRef tx : block.vtx) {
-        read = false;
-
         uint256 txid = tx->GetHash();
-        if (filteredTxs.find(txid) != filteredTxs.end())
-            read = true;
+        bool read = filter.count(txid) > 0;
 
         boost::optional<SaplingMerkleTree> saplingMerkleTree = boost::none;
         if (itor_anonymousTx != ablock.txs.end()) {
@@ -1801,132 +2124,405 @@ bool GetMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std:
         }
         index++;
     }
-
-    if (merkleBlock.txs.size())
-        output.push_back(merkleBlock);
-
-    if (filterItor != filterdTxids.find(blockHeight))
-        filterdTxids.erase(filterItor);
-
     return true;
 }
 
-bool GetSampleMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char> >& filterdTxids, std::vector<CMerkleTxBlockSample>& output)
+/**
+ * Collect the filtered and the shielded transactions of a block and the
+ * sapling tree before the first shielded one. The anonymous block is only
+ * read if the block changed the sapling tree (fSaplingChanged).
+ */
+static bool BuildSampleMerkleTxBlock(const CBlockIndex* pindex, bool fSaplingChanged, const TxidFilter& filter, CMerkleTxBlockSample& merkleBlock)
 {
-    LOCK(cs_main);
+    uint256 blockHash = pindex->GetBlockHash();
     AnonymousBlock ablock;
-    std::map<int, std::map<uint256, char>>::iterator filterItor = filterdTxids.find(blockHeight);
-    std::map<uint256, char> filteredTxs;
-    if (filterItor != filterdTxids.end())
-        filteredTxs = filterItor->second;
-
-    if (blockHeight > chainActive.Height() || blockHeight < 1)
+    if (fSaplingChanged && !ReadAnonymousBlock(blockHash, ablock))
         return false;
 
-    CBlockIndex* blockIdx = chainActive[blockHeight];
-    uint256 blockHash = blockIdx->GetBlockHash();
-    if ((blockHeight <= chainActive.Height()) && (blockHeight >= 100)) {
-        CBlockIndex* prevBlockIdx = chainActive[blockHeight - 1];
-        if (blockIdx->hashFinalSaplingRoot != prevBlockIdx->hashFinalSaplingRoot) {
-            if (!pblocktree->ReadAnonymousBlock(blockHash, ablock))
-                return false;
-        }
-    }
-
-    CMerkleTxBlockSample merkleBlock(blockHash);
     if (ablock.txs.size())
         merkleBlock.tree = ablock.txs[0].saplingMerkleTree;
 
-    if (filteredTxs.empty() && ablock.txs.empty())
+    if (filter.empty() && ablock.txs.empty())
         return true;
 
     CBlock block;
-    if (!ReadBlockFromDisk(block, blockIdx, Params().GetConsensus())) {
+    if (!ReadBlockFromDisk(block, pindex, Params().GetConsensus())) {
         LogPrintf("Cano not reade block %s from disk", blockHash.ToString().c_str());
     }
 
-    BOOST_FOREACH (CTransactionRef tx, block.vtx) {
-        uint256 txid = tx->GetHash();
-        if (filteredTxs.find(txid) != filteredTxs.end())
+    for (const CTransactionRef& tx : block.vtx) {
+        if (filter.count(tx->GetHash()))
             merkleBlock.txs.push_back(tx);
         else if (tx->vShieldedSpend.size() || tx->vShieldedOutput.size())
             merkleBlock.txs.push_back(tx);
     }
-
-    output.push_back(merkleBlock);
     return true;
 }
 
-bool GetIndexKey(const CScript& scritPubKey, uint160& hashBytes, txnouttype& type)
+bool GetMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char>>& filterdTxids, std::vector<CMerkleTxBlock>& output)
 {
-    std::vector<std::vector<unsigned char> > vSolutions;
-    if (!Solver(scritPubKey, type, vSolutions))
-        return false;
-    switch (type) {
-    case TX_NONSTANDARD:
-        return "nonstandard";
-    case TX_PUBKEY:
-    case TX_WITNESS_V0_SCRIPTHASH:
-        memcpy(hashBytes.begin(), CPubKey(vSolutions[0]).GetID().begin(), 20);
-        type = TX_PUBKEYHASH;
-        return true;
-    case TX_PUBKEYHASH:
-    case TX_SCRIPTHASH:
-    case TX_WITNESS_V0_KEYHASH:
-        std::copy(vSolutions[0].begin(), vSolutions[0].end(), hashBytes.begin());
-        return true;
-    case TX_MULTISIG: {
-        CScriptID id(scritPubKey);
-        std::copy(id.begin(), id.end(), hashBytes.begin());
-    }
-    return true;
-    case TX_NULL_DATA:
-        return false;
-    case TX_CREATE:
-        return false;
-    case TX_CALL:
-        return false;
+    const CBlockIndex* pindex;
+    {
+        LOCK(cs_main);
+        if (blockHeight > chainActive.Height() || blockHeight < 0)
+            return false;
+        pindex = chainActive[blockHeight];
     }
 
-    return false;
-}
-
-bool GetSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value)
-{
-    if (mempool.getSpentIndex(key, value))
-        return true;
+    TxidFilter filter;
+    MakeTxidFilter(filterdTxids, blockHeight, filter);
 
-    if (!pblocktree->ReadSpentIndex(key, value))
+    CMerkleTxBlock merkleBlock(pindex->GetBlockHash());
+    if (!BuildMerkleTxBlock(pindex, filter, merkleBlock))
         return false;
 
+    if (merkleBlock.txs.size())
+        output.push_back(merkleBlock);
+
+    // Heights without a filter left are done with.
+    if (filter.empty())
+        filterdTxids.erase(blockHeight);
     return true;
 }
 
-bool GetAddressIndex(uint160 addressHash, int type,
-                     std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start, int end)
+bool GetSampleMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char> >& filterdTxids, std::vector<CMerkleTxBlockSample>& output)
 {
-    if (!fAddressIndex)
-        return error("address index not enabled");
+    const CBlockIndex* pindex;
+    bool fSaplingChanged = false;
+    {
+        LOCK(cs_main);
+        if (blockHeight > chainActive.Height() || blockHeight < 1)
+            return false;
+        pindex = chainActive[blockHeight];
+        if (blockHeight >= 100)
+            fSaplingChanged = pindex->hashFinalSaplingRoot != chainActive[blockHeight - 1]->hashFinalSaplingRoot;
+    }
 
-    if (!pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end))
-        return error("unable to get txids for address");
+    TxidFilter filter;
+    MakeTxidFilter(filterdTxids, blockHeight, filter);
 
+    CMerkleTxBlockSample merkleBlock(pindex->GetBlockHash());
+    if (!BuildSampleMerkleTxBlock(pindex, fSaplingChanged, filter, merkleBlock))
+        return false;
+
+    output.push_back(merkleBlock);
     return true;
 }
 
-bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit)
+/**
+ * Runs job(i) for every i in [0, nJobs) on worker threads and hands the
+ * results to deliver(i) on the calling thread in order, as soon as job i and
+ * every job before it are done. Jobs run at most nWindow ahead of the last
+ * delivered one, so results can be kept in a ring of nWindow slots.
+ */
+class COrderedJobRunner
 {
-    int start = 1;
-    int end = nHeight;
-    uint160 dest;
-    txnouttype type;
-    std::vector<std::pair<uint160, int> > addresses;
-    if (!GetIndexKey(script, dest, type))
-        return false;
-
-    addresses.push_back(std::make_pair(dest, type));
+private:
+    const size_t nJobs;
+    const size_t nWindow;
+    const boost::function<bool(size_t)>& job;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    size_t nNext;
+    size_t nDelivered;
+    std::vector<bool> vDone;
+    bool fStop;
+    bool fFailed;
+
+    void Thread()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (true) {
+            while (!fStop && nNext < nJobs && nNext >= nDelivered + nWindow)
+                cond.wait(lock);
+            if (fStop || nNext >= nJobs)
+                return;
+            size_t i = nNext++;
+            lock.unlock();
+            bool fOk = job(i);
+            lock.lock();
+            if (!fOk)
+                fFailed = fStop = true;
+            vDone[i % nWindow] = true;
+            cond.notify_all();
+        }
+    }
 
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+public:
+    COrderedJobRunner(size_t nJobsIn, size_t nWindowIn, const boost::function<bool(size_t)>& jobIn)
+        : nJobs(nJobsIn), nWindow(nWindowIn), job(jobIn), nNext(0), nDelivered(0), vDone(nWindowIn, false), fStop(false), fFailed(false) {}
+
+    /** Returns false if a job failed; a false deliver() only stops the run */
+    bool Run(int nThreads, const boost::function<bool(size_t)>& deliver)
+    {
+        if (nThreads <= 0) {
+            for (size_t i = 0; i < nJobs; i++) {
+                if (!job(i))
+                    return false;
+                if (!deliver(i))
+                    break;
+            }
+            return true;
+        }
+
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&COrderedJobRunner::Thread, this));
+
+        for (size_t i = 0; i < nJobs; i++) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!vDone[i % nWindow] && !fStop)
+                    cond.wait(lock);
+                if (fStop)
+                    break;
+            }
+            bool fContinue = deliver(i);
+            boost::unique_lock<boost::mutex> lock(mutex);
+            vDone[i % nWindow] = false;
+            nDelivered = i + 1;
+            if (!fContinue)
+                fStop = true;
+            cond.notify_all();
+            if (fStop)
+                break;
+        }
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            cond.notify_all();
+        }
+        threads.join_all();
+        return !fFailed;
+    }
+};
+
+/** The blocks of a range request, shared by the reader threads */
+struct CMerkleRange {
+    const std::map<int, std::map<uint256, char> >& filterdTxids;
+    std::vector<const CBlockIndex*> vpindex;
+    std::vector<bool> vSaplingChanged;
+    std::vector<CMerkleTxBlock> vBlocks;
+    std::vector<CMerkleTxBlockSample> vSampleBlocks;
+
+    CMerkleRange(const std::map<int, std::map<uint256, char> >& filterdTxidsIn) : filterdTxids(filterdTxidsIn) {}
+
+    /** Snapshot the active chain in [nFrom, nTo]; the sapling flags are only needed for sample blocks */
+    bool Init(int nFrom, int nTo, bool fSample)
+    {
+        LOCK(cs_main);
+        if (nFrom < (fSample ? 1 : 0) || nFrom > nTo || nFrom > chainActive.Height())
+            return false;
+        nTo = std::min(nTo, chainActive.Height());
+        for (int nHeight = nFrom; nHeight <= nTo; nHeight++) {
+            vpindex.push_back(chainActive[nHeight]);
+            if (fSample)
+                vSaplingChanged.push_back(nHeight >= 100 && chainActive[nHeight]->hashFinalSaplingRoot != chainActive[nHeight - 1]->hashFinalSaplingRoot);
+        }
+        return true;
+    }
+
+    bool Build(size_t i)
+    {
+        const CBlockIndex* pindex = vpindex[i];
+        TxidFilter filter;
+        MakeTxidFilter(filterdTxids, pindex->nHeight, filter);
+        CMerkleTxBlock& merkleBlock = vBlocks[i % vBlocks.size()];
+        merkleBlock = CMerkleTxBlock(pindex->GetBlockHash());
+        return BuildMerkleTxBlock(pindex, filter, merkleBlock);
+    }
+
+    bool BuildSample(size_t i)
+    {
+        const CBlockIndex* pindex = vpindex[i];
+        TxidFilter filter;
+        MakeTxidFilter(filterdTxids, pindex->nHeight, filter);
+        CMerkleTxBlockSample& merkleBlock = vSampleBlocks[i % vSampleBlocks.size()];
+        merkleBlock = CMerkleTxBlockSample(pindex->GetBlockHash());
+        return BuildSampleMerkleTxBlock(pindex, vSaplingChanged[i], filter, merkleBlock);
+    }
+
+    bool Deliver(size_t i, const MerkleTxBlockSink& sink)
+    {
+        CMerkleTxBlock& merkleBlock = vBlocks[i % vBlocks.size()];
+        // Like GetMerkleTransactionWithAnonymous, blocks without matches are skipped.
+        if (merkleBlock.txs.empty())
+            return true;
+        return sink(vpindex[i]->nHeight, merkleBlock);
+    }
+
+    bool DeliverSample(size_t i, const MerkleTxBlockSampleSink& sink)
+    {
+        return sink(vpindex[i]->nHeight, vSampleBlocks[i % vSampleBlocks.size()]);
+    }
+};
+
+bool GetMerkleTransactionRangeWithAnonymous(int nFrom, int nTo, const std::map<int, std::map<uint256, char> >& filterdTxids, const MerkleTxBlockSink& sink, int nThreads)
+{
+    CMerkleRange range(filterdTxids);
+    if (!range.Init(nFrom, nTo, false))
+        return false;
+
+    size_t nWindow = std::max(nThreads, 1) * MERKLE_RANGE_WINDOW_PER_THREAD;
+    range.vBlocks.resize(nWindow, CMerkleTxBlock(uint256()));
+    boost::function<bool(size_t)> job = boost::bind(&CMerkleRange::Build, &range, _1);
+    COrderedJobRunner runner(range.vpindex.size(), nWindow, job);
+    return runner.Run(nThreads, boost::bind(&CMerkleRange::Deliver, &range, _1, boost::cref(sink)));
+}
+
+bool GetSampleMerkleTransactionRangeWithAnonymous(int nFrom, int nTo, const std::map<int, std::map<uint256, char> >& filterdTxids, const MerkleTxBlockSampleSink& sink, int nThreads)
+{
+    CMerkleRange range(filterdTxids);
+    if (!range.Init(nFrom, nTo, true))
+        return false;
+
+    size_t nWindow = std::max(nThreads, 1) * MERKLE_RANGE_WINDOW_PER_THREAD;
+    range.vSampleBlocks.resize(nWindow, CMerkleTxBlockSample(uint256()));
+    boost::function<bool(size_t)> job = boost::bind(&CMerkleRange::BuildSample, &range, _1);
+    COrderedJobRunner runner(range.vpindex.size(), nWindow, job);
+    return runner.Run(nThreads, boost::bind(&CMerkleRange::DeliverSample, &range, _1, boost::cref(sink)));
+}
+
+bool GetIndexKey(const CScript& scritPubKey, uint160& hashBytes, txnouttype& type)
+{
+    std::vector<std::vector<unsigned char> > vSolutions;
+    if (!Solver(scritPubKey, type, vSolutions))
+        return false;
+    switch (type) {
+    case TX_NONSTANDARD:
+        return "nonstandard";
+    case TX_PUBKEY:
+    case TX_WITNESS_V0_SCRIPTHASH:
+        memcpy(hashBytes.begin(), CPubKey(vSolutions[0]).GetID().begin(), 20);
+        type = TX_PUBKEYHASH;
+        return true;
+    case TX_PUBKEYHASH:
+    case TX_SCRIPTHASH:
+    case TX_WITNESS_V0_KEYHASH:
+        std::copy(vSolutions[0].begin(), vSolutions[0].end(), hashBytes.begin());
+        return true;
+    case TX_MULTISIG: {
+        CScriptID id(scritPubKey);
+        std::copy(id.begin(), id.end(), hashBytes.begin());
+    }
+    return true;
+    case TX_NULL_DATA:
+        return false;
+    case TX_CREATE:
+        return false;
+    case TX_CALL:
+        return false;
+    }
+
+    return false;
+}
+
+bool GetSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    if (mempool.getSpentIndex(key, value))
+        return true;
+
+    if (!ReadSpentIndex(key, value))
+        return false;
+
+    return true;
+}
+
+bool GetAddressIndex(uint160 addressHash, int type,
+                     std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start, int end)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!ReadAddressIndex(addressHash, type, addressIndex, start, end))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressUnspent(uint160 addressHash, int type,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!ReadAddressUnspentIndex(addressHash, type, unspentOutputs))
+        return error("unable to get address unspent outputs");
+
+    return true;
+}
+
+bool GetAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                         const CAddressIndexKey* pkeyAfter, CAddressIndexPageResult& page)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!ReadAddressIndexPage(addressHash, type, query, pkeyAfter, page))
+        return error("unable to get txids for address");
+
+    return true;
+}
+
+bool GetAddressUnspentPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                           const CAddressUnspentKey* pkeyAfter, CAddressUnspentPageResult& page)
+{
+    if (!fAddressIndex)
+        return error("address index not enabled");
+
+    if (!ReadAddressUnspentIndexPage(addressHash, type, query, pkeyAfter, page))
+        return error("unable to get address unspent outputs");
+
+    return true;
+}
+
+bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit, size_t nMaxResults)
+{
+    int start = 1;
+    int end = nHeight;
+    uint160 dest;
+    txnouttype type;
+    std::vector<std::pair<uint160, int> > addresses;
+    if (!GetIndexKey(script, dest, type))
+        return false;
+
+    if (fAddressUtxoHeightIndex) {
+        std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > vUtxo;
+        if (!ReadAddressUtxoAtHeight(dest, type, nHeight, std::max(valueLimit, (CAmount)0), vUtxo, nMaxResults))
+            return false;
+
+        int ret = 0;
+        for (size_t i = 0; i < vUtxo.size(); i++) {
+            const CAddressUtxoHeightKey& utxoKey = vUtxo[i].first;
+            const CAddressUtxoHeightValue& utxoValue = vUtxo[i].second;
+            if (utxoKey.blockHeight < (unsigned int)start)
+                continue;
+            if (utxoValue.nSpentHeight == ADDRESS_UTXO_UNSPENT) {
+                // still unspent on chain, but it must not be spent in the mempool either
+                CSpentIndexKey key(utxoKey.txhash, utxoKey.index);
+                CSpentIndexValue value;
+                if (mempool.getSpentIndex(key, value))
+                    continue;
+            }
+            CUtxo txout;
+            txout.txid = utxoKey.txhash;
+            txout.n = utxoKey.index;
+            txout.nValue = utxoValue.nValue;
+            txout.nHeight = utxoKey.blockHeight;
+            vTxOut.push_back(txout);
+            ret += 1;
+        }
+        // Outputs skipped above may have hidden further ones past the limit.
+        if (nMaxResults && (size_t)ret < nMaxResults && vUtxo.size() >= nMaxResults) {
+            vTxOut.resize(vTxOut.size() - ret);
+            return GetUTXOAtHeight(script, nHeight, vTxOut, valueLimit, 0);
+        }
+        return (ret > 0);
+    }
+
+    addresses.push_back(std::make_pair(dest, type));
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
 
     for (std::vector<std::pair<uint160, int> >::iterator it = addresses.begin(); it != addresses.end(); it++) {
         if (!GetAddressIndex((*it).first, (*it).second, addressIndex, start, end)) {
@@ -1936,6 +2532,8 @@ bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo
 
     int ret = 0;
     for (std::vector<std::pair<CAddressIndexKey, CAmount> >::const_iterator it = addressIndex.begin(); it != addressIndex.end(); it++) {
+        if (nMaxResults && (size_t)ret >= nMaxResults)
+            break;
         int height = it->first.blockHeight;
         uint256 txid = it->first.txhash;
 
@@ -1972,6 +2570,222 @@ bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo
 // CBlock and CBlockIndex
 //
 
+/** Block and undo files kept mapped for reading, the least recently used is unmapped first */
+static const size_t MAX_BLOCK_FILE_MAPPINGS = 16;
+/** Bytes past a sequential reader that the kernel is asked to page in */
+static const size_t BLOCK_FILE_READAHEAD = 4 << 20;
+
+/**
+ * Reads the entries of block and undo files straight from a read only mapping of
+ * the file, so readers share the page cache instead of copying through stdio.
+ * Blocks are only appended and files only deleted by pruning, so what a mapping
+ * covers only changes when a finalized file is truncated to its data, which
+ * lowers nValidLength; a file that grew past its mapping is mapped again.
+ */
+class CMappedBlockFile
+{
+public:
+    const unsigned char* const pbegin;
+    const size_t nLength;
+    std::atomic<size_t> nValidLength; //!< Bytes still backed by the file, pages past it fault
+
+private:
+    std::atomic<size_t> nLastEnd;    //!< End of the last read, to detect sequential scans
+    std::atomic<size_t> nAdvisedEnd; //!< End of the range last asked to be paged in
+
+public:
+    CMappedBlockFile(const unsigned char* pbeginIn, size_t nLengthIn) : pbegin(pbeginIn), nLength(nLengthIn), nValidLength(nLengthIn), nLastEnd(0), nAdvisedEnd(0) {}
+
+    ~CMappedBlockFile()
+    {
+#ifndef WIN32
+        munmap((void*)pbegin, nLength);
+#endif
+    }
+
+    /** Record a read of [nBegin, nEnd), a read following the last one pages in the range ahead */
+    void Advise(size_t nBegin, size_t nEnd)
+    {
+#ifndef WIN32
+        size_t nLast = nLastEnd.exchange(nEnd);
+        // Entries are separated by their 8 byte message start and size
+        if (nBegin < nLast || nBegin > nLast + 8 || nEnd + BLOCK_FILE_READAHEAD / 2 <= nAdvisedEnd)
+            return;
+        static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+        size_t nAdviseBegin = nEnd & ~(nPageSize - 1);
+        size_t nAdviseEnd = std::min(nEnd + BLOCK_FILE_READAHEAD, (size_t)nValidLength);
+        if (nAdviseBegin < nAdviseEnd)
+            madvise((void*)(pbegin + nAdviseBegin), nAdviseEnd - nAdviseBegin, MADV_WILLNEED);
+        nAdvisedEnd = nAdviseEnd;
+#endif
+    }
+};
+
+class CBlockFileMappings
+{
+private:
+    boost::mutex mutex;
+    std::list<std::pair<std::pair<char, int>, std::shared_ptr<CMappedBlockFile> > > lru; //!< Most recently used first
+
+    static std::shared_ptr<CMappedBlockFile> Map(const CDiskBlockPos& pos, const char* prefix, size_t nEnd)
+    {
+#ifndef WIN32
+        int fd = open(GetBlockPosFilename(pos, prefix).string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < nEnd || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return nullptr;
+        // Most reads are of single blocks, read ahead only for sequential scans
+        madvise(p, st.st_size, MADV_RANDOM);
+        return std::make_shared<CMappedBlockFile>((const unsigned char*)p, (size_t)st.st_size);
+#else
+        return nullptr;
+#endif
+    }
+
+public:
+    /** A mapping of the file of pos covering its first nEnd bytes, null if there is none */
+    std::shared_ptr<CMappedBlockFile> Get(const CDiskBlockPos& pos, const char* prefix, size_t nEnd)
+    {
+        std::pair<char, int> key(prefix[0], pos.nFile);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end(); ++it) {
+            if (it->first == key) {
+                if (it->second->nValidLength >= nEnd) {
+                    lru.splice(lru.begin(), lru, it);
+                    return it->second;
+                }
+                lru.erase(it);
+                break;
+            }
+        }
+        std::shared_ptr<CMappedBlockFile> mapping = Map(pos, prefix, nEnd);
+        if (!mapping)
+            return nullptr;
+        lru.push_front(std::make_pair(key, mapping));
+        if (lru.size() > MAX_BLOCK_FILE_MAPPINGS)
+            lru.pop_back();
+        return mapping;
+    }
+
+    /** Unmap the files of nFile once their last reader is done, before pruning deletes them */
+    void Drop(int nFile)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();) {
+            if (it->first.second == nFile)
+                it = lru.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    /**
+     * Truncate the file of pos to nSize. Mappings of it are cut down to nSize
+     * first and forgotten, and no new one is made until the file is shorter.
+     */
+    void Truncate(const CDiskBlockPos& pos, const char* prefix, FILE* file, size_t nSize)
+    {
+        std::pair<char, int> key(prefix[0], pos.nFile);
+        boost::unique_lock<boost::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end(); ++it) {
+            if (it->first == key) {
+                if (it->second->nValidLength > nSize)
+                    it->second->nValidLength = nSize;
+                lru.erase(it);
+                break;
+            }
+        }
+        TruncateFile(file, nSize);
+    }
+};
+
+static CBlockFileMappings blockFileMappings;
+
+/** Deserializes from memory without copying it into a stream buffer first */
+class CSpanReader
+{
+private:
+    const int nType;
+    const int nVersion;
+    const unsigned char* pcur;
+    const unsigned char* const pend;
+
+public:
+    CSpanReader(int nTypeIn, int nVersionIn, const unsigned char* pbeginIn, const unsigned char* pendIn)
+        : nType(nTypeIn), nVersion(nVersionIn), pcur(pbeginIn), pend(pendIn) {}
+
+    template <typename T>
+    CSpanReader& operator>>(T& obj)
+    {
+        ::Unserialize(*this, obj);
+        return *this;
+    }
+
+    int GetType() const { return nType; }
+    int GetVersion() const { return nVersion; }
+    size_t size() const { return pend - pcur; }
+
+    void read(char* pch, size_t nSize)
+    {
+        if (nSize > size())
+            throw std::ios_base::failure("CSpanReader::read(): end of data");
+        memcpy(pch, pcur, nSize);
+        pcur += nSize;
+    }
+};
+
+/**
+ * The entry stored at pos of a block or undo file, nTrailer bytes past its size
+ * included. Falls back to reading the file where it cannot be mapped.
+ */
+static bool ReadBlockFileSpan(CBlockFileSpan& span, const CDiskBlockPos& pos, const char* prefix, size_t nTrailer)
+{
+    if (pos.IsNull() || pos.nPos < 8)
+        return error("%s: invalid position %s", __func__, pos.ToString());
+
+    std::shared_ptr<CMappedBlockFile> mapping = blockFileMappings.Get(pos, prefix, pos.nPos);
+    if (mapping) {
+        unsigned int nSize;
+        CSpanReader(SER_DISK, CLIENT_VERSION, mapping->pbegin + pos.nPos - 4, mapping->pbegin + pos.nPos) >> nSize;
+        size_t nEnd = (size_t)pos.nPos + nSize + nTrailer;
+        if (nEnd > mapping->nValidLength)
+            mapping = blockFileMappings.Get(pos, prefix, nEnd);
+        if (!mapping)
+            return error("%s: %s entry at %s is past the end of its file", __func__, prefix, pos.ToString());
+        mapping->Advise(pos.nPos, nEnd);
+        span = CBlockFileSpan(mapping, mapping->pbegin + pos.nPos, nSize + nTrailer);
+        return true;
+    }
+
+    CDiskBlockPos posSize(pos.nFile, pos.nPos - 4);
+    CAutoFile file(prefix[0] == 'r' ? OpenUndoFile(posSize, true) : OpenBlockFile(posSize, true), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return error("%s: failed to open %s file at %s", __func__, prefix, pos.ToString());
+    try {
+        unsigned int nSize;
+        file >> nSize;
+        std::shared_ptr<std::vector<unsigned char> > pvch = std::make_shared<std::vector<unsigned char> >((size_t)nSize + nTrailer);
+        file.read((char*)pvch->data(), pvch->size());
+        span = CBlockFileSpan(pvch, pvch->data(), pvch->size());
+    } catch (const std::exception& e) {
+        return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+    return true;
+}
+
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CDiskBlockPos& pos)
+{
+    return ReadBlockFileSpan(span, pos, "blk", 0);
+}
+
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart)
 {
     // Open history file to append
@@ -1997,14 +2811,13 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus:
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    CBlockFileSpan span;
+    if (!ReadBlockFileSpan(span, pos, "blk", 0))
         return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
     // Read block
     try {
-        filein >> block;
+        CSpanReader(SER_DISK, CLIENT_VERSION, span.begin(), span.end()) >> block;
     }    catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
     }
@@ -2707,27 +3520,27 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    // The undo data is followed by its checksum
+    CBlockFileSpan span;
+    if (!ReadBlockFileSpan(span, pos, "rev", sizeof(uint256)))
         return error("%s: OpenBlockFile failed", __func__);
+    const unsigned char* pchecksum = span.end() - sizeof(uint256);
+
+    // Verify checksum over the stored bytes, so the undo data need not be serialized again
+    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
+    hasher << hashBlock;
+    hasher.write((const char*)span.begin(), pchecksum - span.begin());
+    uint256 hashChecksum = hasher.GetHash();
+    if (memcmp(hashChecksum.begin(), pchecksum, sizeof(uint256)) != 0)
+        return error("%s: Checksum mismatch", __func__);
 
     // Read block
-    uint256 hashChecksum;
     try {
-        filein >> blockundo;
-        filein >> hashChecksum;
+        CSpanReader(SER_DISK, CLIENT_VERSION, span.begin(), pchecksum) >> blockundo;
     }    catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
     }
 
-    // Verify checksum
-    CHashWriter hasher(SER_GETHASH, PROTOCOL_VERSION);
-    hasher << hashBlock;
-    hasher << blockundo;
-    if (hashChecksum != hasher.GetHash())
-        return error("%s: Checksum mismatch", __func__);
-
     return true;
 }
 
@@ -2751,20 +3564,573 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 
 } // anon namespace
 
-enum DisconnectResult {
-    DISCONNECT_OK, // All good.
-    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
-    DISCONNECT_FAILED // Something else went wrong.
-};
-
 /**
- * Restore the UTXO in a Coin at a given COutPoint
- * @param undo The Coin to be restored.
- * @param view The coins view to which to apply the changes.
- * @param out The out point that corresponds to the tx input.
- * @return A DisconnectResult as an int
+ * Journal of per-block index batches not yet on disk. With -asyncindexwrite
+ * the first queued batch starts ThreadIndexWriter, which writes them in the
+ * order they were queued, so a disconnect never overtakes the connect it
+ * undoes, and only pops a batch once it is written; until then readers see it
+ * through the journal. Without the writer thread batches are written inline
+ * and the journal stays empty.
  */
-int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
+static boost::mutex csIndexWriter;
+static boost::condition_variable condIndexWriter;
+static std::deque<CBlockIndexUpdate> queueIndexWriter;
+static bool fIndexWriterRunning = false;
+static bool fIndexWriterStop = false;
+static boost::thread threadIndexWriter;
+static const size_t MAX_INDEX_WRITER_QUEUE = 64;
+/** Journal batches ThreadIndexWriter has written and popped */
+static uint64_t nIndexBatchesWritten = 0;
+
+/** Write the journal until StopIndexWriter asks to stop and it is empty */
+static void ThreadIndexWriter()
+{
+    RenameThread("vds-idxwriter");
+    while (true) {
+        const CBlockIndexUpdate* pupdate;
+        {
+            boost::unique_lock<boost::mutex> lock(csIndexWriter);
+            while (queueIndexWriter.empty() && !fIndexWriterStop)
+                condIndexWriter.wait(lock);
+            if (queueIndexWriter.empty()) {
+                fIndexWriterRunning = false;
+                condIndexWriter.notify_all();
+                return;
+            }
+            // Only this thread pops, and push_back leaves references to
+            // existing elements of a deque valid.
+            pupdate = &queueIndexWriter.front();
+        }
+        bool fWritten = pblocktree->WriteBlockIndexUpdate(*pupdate);
+        {
+            boost::unique_lock<boost::mutex> lock(csIndexWriter);
+            queueIndexWriter.pop_front();
+            nIndexBatchesWritten++;
+        }
+        condIndexWriter.notify_all();
+        if (!fWritten)
+            AbortNode("Failed to write block index batch");
+    }
+}
+
+/** Start ThreadIndexWriter if -asyncindexwrite is set and it is not running, returns whether it runs (csIndexWriter) */
+static bool StartIndexWriter()
+{
+    if (fIndexWriterRunning)
+        return true;
+    if (!GetBoolArg("-asyncindexwrite", DEFAULT_ASYNC_INDEX_WRITE))
+        return false;
+    // A writer StopIndexWriter stopped has already left ThreadIndexWriter
+    if (threadIndexWriter.joinable())
+        threadIndexWriter.join();
+    try {
+        threadIndexWriter = boost::thread(&ThreadIndexWriter);
+    } catch (const boost::thread_resource_error& e) {
+        LogPrintf("%s: failed to start the block index writer: %s\n", __func__, e.what());
+        return false;
+    }
+    fIndexWriterRunning = true;
+    return true;
+}
+
+/** Write out the journal and stop ThreadIndexWriter, the next queued batch starts it again */
+static void StopIndexWriter()
+{
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    fIndexWriterStop = true;
+    condIndexWriter.notify_all();
+    while (fIndexWriterRunning)
+        condIndexWriter.wait(lock);
+    fIndexWriterStop = false;
+    if (threadIndexWriter.joinable())
+        threadIndexWriter.join();
+}
+
+void SyncIndexWriter()
+{
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    while (!queueIndexWriter.empty())
+        condIndexWriter.wait(lock);
+}
+
+/** Set while a CBlockIndexUpdateBatch collects the index changes of a reorg (cs_main) */
+static std::vector<CBlockIndexUpdate>* pvIndexUpdateBatch = nullptr;
+
+/** Commit the index changes of a block, or queue them for ThreadIndexWriter with -asyncindexwrite */
+static bool WriteBlockIndexUpdate(CBlockIndexUpdate& update)
+{
+    if (pvIndexUpdateBatch) {
+        pvIndexUpdateBatch->push_back(CBlockIndexUpdate());
+        std::swap(pvIndexUpdateBatch->back(), update);
+        return true;
+    }
+
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    if (!StartIndexWriter()) {
+        lock.unlock();
+        bool fWritten = pblocktree->WriteBlockIndexUpdate(update);
+        EraseTxLookupCache(update);
+        return fWritten;
+    }
+    while (queueIndexWriter.size() >= MAX_INDEX_WRITER_QUEUE)
+        condIndexWriter.wait(lock);
+    queueIndexWriter.push_back(CBlockIndexUpdate());
+    std::swap(queueIndexWriter.back(), update);
+    EraseTxLookupCache(queueIndexWriter.back());
+    condIndexWriter.notify_all();
+    return true;
+}
+
+/** Commit the index changes of several blocks with one write, or queue them all for ThreadIndexWriter */
+static bool WriteBlockIndexUpdates(std::vector<CBlockIndexUpdate>& vUpdate)
+{
+    if (vUpdate.empty())
+        return true;
+
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    if (!StartIndexWriter()) {
+        lock.unlock();
+        bool fWritten = pblocktree->WriteBlockIndexUpdates(vUpdate);
+        for (const CBlockIndexUpdate& update : vUpdate)
+            EraseTxLookupCache(update);
+        vUpdate.clear();
+        return fWritten;
+    }
+    for (CBlockIndexUpdate& update : vUpdate) {
+        while (queueIndexWriter.size() >= MAX_INDEX_WRITER_QUEUE)
+            condIndexWriter.wait(lock);
+        queueIndexWriter.push_back(CBlockIndexUpdate());
+        std::swap(queueIndexWriter.back(), update);
+        EraseTxLookupCache(queueIndexWriter.back());
+        condIndexWriter.notify_all();
+    }
+    vUpdate.clear();
+    return true;
+}
+
+/**
+ * Collects the index changes of every block connected or disconnected while
+ * it is in scope and commits them together when it goes out of scope.
+ * FlushStateToDisk commits them early before it writes the chainstate.
+ */
+class CBlockIndexUpdateBatch
+{
+private:
+    std::vector<CBlockIndexUpdate> vUpdate;
+
+public:
+    CBlockIndexUpdateBatch()
+    {
+        AssertLockHeld(cs_main);
+        assert(pvIndexUpdateBatch == nullptr);
+        pvIndexUpdateBatch = &vUpdate;
+    }
+
+    ~CBlockIndexUpdateBatch()
+    {
+        pvIndexUpdateBatch = nullptr;
+        if (!WriteBlockIndexUpdates(vUpdate))
+            AbortNode("Failed to write block index batch");
+    }
+};
+
+// The point readers below hold csIndexWriter while they read the database.
+// The writer can then at most finish the oldest journal batch meanwhile, and
+// as every batch only writes or erases whole entries, applying the journal on
+// top of either database state gives the same result. The range readers copy
+// the queued changes they need under csIndexWriter and scan the database
+// after releasing it, so a long scan doesn't hold up WriteBlockIndexUpdate,
+// see CIndexJournalRead.
+
+/** Scans a range reader makes outside csIndexWriter before it scans holding it */
+static const int INDEX_READ_UNLOCKED_TRIES = 3;
+
+/**
+ * Lets a range reader merge its copy of the journal against the database
+ * state that copy belongs to. A database iterator reads the snapshot taken
+ * when it was created; if ThreadIndexWriter popped no batch between the copy
+ * and the end of the scan, it wrote at most the oldest batch of the copy, so
+ * the snapshot plus the copy is the state of the copy. Otherwise a newer
+ * batch may be in the snapshot and the reader starts over, scanning with
+ * csIndexWriter held after INDEX_READ_UNLOCKED_TRIES attempts.
+ */
+class CIndexJournalRead
+{
+private:
+    boost::unique_lock<boost::mutex> lock;
+    uint64_t nWritten;
+    int nTry;
+
+public:
+    CIndexJournalRead() : lock(csIndexWriter, boost::defer_lock), nWritten(0), nTry(0) {}
+
+    /** Lock the journal to copy the queued changes */
+    void Copy()
+    {
+        lock.lock();
+        nWritten = nIndexBatchesWritten;
+    }
+
+    /** Release the journal for the database scan, unless earlier scans were overtaken too often */
+    void Scan()
+    {
+        if (nTry < INDEX_READ_UNLOCKED_TRIES)
+            lock.unlock();
+    }
+
+    /** Whether the scan saw the database state of the copy; if not, copy and scan again */
+    bool Consistent()
+    {
+        if (!lock.owns_lock())
+            lock.lock();
+        bool fConsistent = nIndexBatchesWritten == nWritten;
+        lock.unlock();
+        nTry++;
+        return fConsistent;
+    }
+};
+
+static bool ReadTxIndex(const uint256& txid, CDiskTxPos& pos)
+{
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    for (std::deque<CBlockIndexUpdate>::const_reverse_iterator it = queueIndexWriter.rbegin(); it != queueIndexWriter.rend(); ++it) {
+        for (const auto& item : it->vTxIndex) {
+            if (item.first == txid) {
+                pos = item.second;
+                return true;
+            }
+        }
+    }
+    return pblocktree->ReadTxIndex(txid, pos);
+}
+
+static bool ReadAnonymousBlock(const uint256& blockhash, AnonymousBlock& ablock)
+{
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    for (std::deque<CBlockIndexUpdate>::const_reverse_iterator it = queueIndexWriter.rbegin(); it != queueIndexWriter.rend(); ++it) {
+        for (const uint256& hash : it->vAnonymousBlockErase) {
+            if (hash == blockhash)
+                return false;
+        }
+        for (const auto& item : it->vAnonymousBlock) {
+            if (item.first == blockhash) {
+                ablock = item.second;
+                return true;
+            }
+        }
+    }
+    return pblocktree->ReadAnonymousBlock(blockhash, ablock);
+}
+
+static bool ReadAddressIndex(uint160 addressHash, int type,
+                             std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex, int start, int end)
+{
+    // Queued changes of the address in write order, true marks an erase.
+    // Same range as the database read: start only counts together with end.
+    std::vector<std::pair<bool, std::pair<CAddressIndexKey, CAmount> > > vQueued;
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vRead;
+    CIndexJournalRead journal;
+    do {
+        vQueued.clear();
+        vRead.clear();
+        journal.Copy();
+        for (const CBlockIndexUpdate& update : queueIndexWriter) {
+            for (const auto& item : update.vAddressIndexErase) {
+                if (item.first.hashBytes == addressHash && (int)item.first.type == type)
+                    vQueued.push_back(std::make_pair(true, item));
+            }
+            for (const auto& item : update.vAddressIndex) {
+                const CAddressIndexKey& key = item.first;
+                if (key.hashBytes != addressHash || (int)key.type != type)
+                    continue;
+                if ((end > 0 && key.blockHeight > end) || (start > 0 && end > 0 && key.blockHeight < start))
+                    continue;
+                vQueued.push_back(std::make_pair(false, item));
+            }
+        }
+        journal.Scan();
+        if (vQueued.empty())
+            return pblocktree->ReadAddressIndex(addressHash, type, addressIndex, start, end);
+        if (!pblocktree->ReadAddressIndex(addressHash, type, vRead, start, end))
+            return false;
+    } while (!journal.Consistent());
+
+    std::map<CAddressIndexKey, CAmount, CompareAddressIndexKey> mapMerged(vRead.begin(), vRead.end());
+    for (const auto& item : vQueued) {
+        if (item.first)
+            mapMerged.erase(item.second.first);
+        else
+            mapMerged[item.second.first] = item.second.second;
+    }
+    addressIndex.insert(addressIndex.end(), mapMerged.begin(), mapMerged.end());
+    return true;
+}
+
+static bool ReadAddressUnspentIndex(uint160 addressHash, int type,
+                                    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs)
+{
+    // Queued changes of the address in write order, null values are erases
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vQueued;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vRead;
+    CIndexJournalRead journal;
+    do {
+        vQueued.clear();
+        vRead.clear();
+        journal.Copy();
+        for (const CBlockIndexUpdate& update : queueIndexWriter) {
+            for (const auto& item : update.vAddressUnspentIndex) {
+                if (item.first.hashBytes == addressHash && (int)item.first.type == type)
+                    vQueued.push_back(item);
+            }
+        }
+        journal.Scan();
+        if (vQueued.empty())
+            return pblocktree->ReadAddressUnspentIndex(addressHash, type, unspentOutputs);
+        if (!pblocktree->ReadAddressUnspentIndex(addressHash, type, vRead))
+            return false;
+    } while (!journal.Consistent());
+
+    std::map<CAddressUnspentKey, CAddressUnspentValue, CompareAddressUnspentKey> mapMerged(vRead.begin(), vRead.end());
+    for (const auto& item : vQueued) {
+        if (item.second.IsNull())
+            mapMerged.erase(item.first);
+        else
+            mapMerged[item.first] = item.second;
+    }
+    unspentOutputs.insert(unspentOutputs.end(), mapMerged.begin(), mapMerged.end());
+    return true;
+}
+
+static CAmount AddressPageValue(CAmount nValue)
+{
+    return nValue;
+}
+
+static CAmount AddressPageValue(const CAddressUnspentValue& value)
+{
+    return value.satoshis;
+}
+
+/**
+ * Cut a page out of the entries of an address, in database order and already
+ * limited to the heights of the query, the way the paged database readers
+ * walk them.
+ */
+template <typename Key, typename Value, typename Compare>
+static void TakeAddressPage(const std::vector<std::pair<Key, Value> >& vAll, const CAddressIndexQuery& query,
+                            const Key* pkeyAfter, CAddressIndexPage<Key, Value>& page)
+{
+    Compare compare;
+    std::vector<std::pair<Key, Value> > vFound;
+    if (query.fReverse) {
+        for (typename std::vector<std::pair<Key, Value> >::const_reverse_iterator it = vAll.rbegin(); it != vAll.rend(); ++it) {
+            if (!pkeyAfter || compare(it->first, *pkeyAfter))
+                vFound.push_back(*it);
+        }
+    } else {
+        for (typename std::vector<std::pair<Key, Value> >::const_iterator it = vAll.begin(); it != vAll.end(); ++it) {
+            if (!pkeyAfter || compare(*pkeyAfter, it->first))
+                vFound.push_back(*it);
+        }
+    }
+    if (query.fSum) {
+        for (const auto& item : vFound) {
+            page.nSum += AddressPageValue(item.second);
+            page.nCount++;
+        }
+    }
+    size_t nBegin = std::min(query.nOffset, vFound.size());
+    size_t nEnd = vFound.size();
+    if (query.nLimit && nBegin + query.nLimit < nEnd) {
+        nEnd = nBegin + query.nLimit;
+        page.fMore = true;
+    }
+    page.vEntries.assign(vFound.begin() + nBegin, vFound.begin() + nEnd);
+    if (!page.vEntries.empty())
+        page.keyLast = page.vEntries.back().first;
+}
+
+// The paged readers read straight from the database while the journal holds
+// nothing for the address. Otherwise they take the page out of the merged
+// entries of ReadAddressIndex and ReadAddressUnspentIndex.
+
+static bool ReadAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                 const CAddressIndexKey* pkeyAfter, CAddressIndexPageResult& page)
+{
+    bool fQueued = false;
+    {
+        boost::unique_lock<boost::mutex> lock(csIndexWriter);
+        for (std::deque<CBlockIndexUpdate>::const_iterator it = queueIndexWriter.begin(); it != queueIndexWriter.end() && !fQueued; ++it) {
+            for (const auto& item : it->vAddressIndex)
+                fQueued = fQueued || (item.first.hashBytes == addressHash && (int)item.first.type == type);
+            for (const auto& item : it->vAddressIndexErase)
+                fQueued = fQueued || (item.first.hashBytes == addressHash && (int)item.first.type == type);
+        }
+    }
+    if (!fQueued)
+        return pblocktree->ReadAddressIndexPage(addressHash, type, query, pkeyAfter, page);
+
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vRead;
+    if (!ReadAddressIndex(addressHash, type, vRead, 0, 0))
+        return false;
+    // Same heights as ReadAddressIndexPage: a reverse walk without an end starts at the tip
+    int nBottom = query.fReverse ? std::max(query.nStart, 0) : query.nStart;
+    int nTop = query.nEnd > 0 ? query.nEnd : (query.fReverse ? std::max(chainActive.Height(), 0) : std::numeric_limits<int>::max());
+    std::vector<std::pair<CAddressIndexKey, CAmount> > vAll;
+    for (const auto& item : vRead) {
+        if ((int)item.first.blockHeight >= nBottom && (int)item.first.blockHeight <= nTop)
+            vAll.push_back(item);
+    }
+    TakeAddressPage<CAddressIndexKey, CAmount, CompareAddressIndexKey>(vAll, query, pkeyAfter, page);
+    return true;
+}
+
+static bool ReadAddressUnspentIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                                        const CAddressUnspentKey* pkeyAfter, CAddressUnspentPageResult& page)
+{
+    bool fQueued = false;
+    {
+        boost::unique_lock<boost::mutex> lock(csIndexWriter);
+        for (std::deque<CBlockIndexUpdate>::const_iterator it = queueIndexWriter.begin(); it != queueIndexWriter.end() && !fQueued; ++it) {
+            for (const auto& item : it->vAddressUnspentIndex)
+                fQueued = fQueued || (item.first.hashBytes == addressHash && (int)item.first.type == type);
+        }
+    }
+    if (!fQueued)
+        return pblocktree->ReadAddressUnspentIndexPage(addressHash, type, query, pkeyAfter, page);
+
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > vAll;
+    if (!ReadAddressUnspentIndex(addressHash, type, vAll))
+        return false;
+    TakeAddressPage<CAddressUnspentKey, CAddressUnspentValue, CompareAddressUnspentKey>(vAll, query, pkeyAfter, page);
+    return true;
+}
+
+static bool ReadSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value)
+{
+    boost::unique_lock<boost::mutex> lock(csIndexWriter);
+    for (std::deque<CBlockIndexUpdate>::const_reverse_iterator it = queueIndexWriter.rbegin(); it != queueIndexWriter.rend(); ++it) {
+        for (const auto& item : it->vSpentIndex) {
+            if (item.first.txid == key.txid && item.first.outputIndex == key.outputIndex) {
+                if (item.second.IsNull())
+                    return false;
+                value = item.second;
+                return true;
+            }
+        }
+    }
+    return pblocktree->ReadSpentIndex(key, value);
+}
+
+static bool ReadAddressUtxoAtHeight(uint160 addressHash, int type, int nHeight, CAmount nMinValue,
+                                    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> >& vect, size_t nMaxResults)
+{
+    // Queued changes of the address in write order, true marks an erase
+    std::vector<std::pair<bool, std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > > vQueued;
+    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > vRead;
+    CIndexJournalRead journal;
+    do {
+        vQueued.clear();
+        vRead.clear();
+        journal.Copy();
+        for (const CBlockIndexUpdate& update : queueIndexWriter) {
+            for (const auto& item : update.vAddressUtxoHeight) {
+                if (item.first.hashBytes == addressHash && (int)item.first.type == type)
+                    vQueued.push_back(std::make_pair(false, item));
+            }
+            for (const CAddressUtxoHeightKey& key : update.vAddressUtxoHeightErase) {
+                if (key.hashBytes == addressHash && (int)key.type == type)
+                    vQueued.push_back(std::make_pair(true, std::make_pair(key, CAddressUtxoHeightValue())));
+            }
+        }
+        journal.Scan();
+        if (vQueued.empty())
+            return pblocktree->ReadAddressUtxoAtHeight(addressHash, type, nHeight, nMinValue, vect, nMaxResults);
+        // Queued batches can add, spend or remove outputs of any height, so read
+        // the whole range and apply them before filtering.
+        if (!pblocktree->ReadAddressUtxoAtHeight(addressHash, type, nHeight, std::numeric_limits<CAmount>::min(), vRead))
+            return false;
+    } while (!journal.Consistent());
+
+    std::map<CAddressUtxoHeightKey, CAddressUtxoHeightValue> mapMerged(vRead.begin(), vRead.end());
+    for (const auto& item : vQueued) {
+        if (item.first)
+            mapMerged.erase(item.second.first);
+        else
+            mapMerged[item.second.first] = item.second.second;
+    }
+    for (const auto& item : mapMerged) {
+        if (item.second.nValue < nMinValue || !item.second.IsUnspentAt(item.first, nHeight))
+            continue;
+        vect.push_back(item);
+        if (nMaxResults && vect.size() >= nMaxResults)
+            break;
+    }
+    return true;
+}
+
+int ReadHeightIndex(int low, int high, int minconf,
+                    std::vector<std::vector<uint256> >& blocksOfHashes,
+                    const std::set<dev::h160>& addresses)
+{
+    std::vector<std::pair<CHeightTxIndexKey, std::vector<uint256> > > vQueued;
+    std::vector<std::vector<uint256> > vRead;
+    std::vector<CHeightTxIndexKey> vKeys;
+    int nHeight;
+    CIndexJournalRead journal;
+    do {
+        vQueued.clear();
+        vRead.clear();
+        vKeys.clear();
+        journal.Copy();
+        for (const CBlockIndexUpdate& update : queueIndexWriter) {
+            for (const auto& item : update.vHeightIndex) {
+                const CHeightTxIndexKey& key = item.first;
+                if ((int)key.height < low || (high > -1 && (int)key.height > high))
+                    continue;
+                if (minconf > 0 && chainActive.Height() - (int)key.height < minconf)
+                    continue;
+                if (!addresses.empty() && !addresses.count(key.address))
+                    continue;
+                vQueued.push_back(item);
+            }
+        }
+        journal.Scan();
+        if (vQueued.empty())
+            return pblocktree->ReadHeightIndex(low, high, minconf, blocksOfHashes, addresses);
+        nHeight = pblocktree->ReadHeightIndex(low, high, minconf, vRead, addresses, &vKeys);
+        if (nHeight < 0)
+            return nHeight;
+    } while (!journal.Consistent());
+
+    std::map<std::pair<unsigned int, dev::h160>, std::vector<uint256> > mapMerged;
+    for (size_t i = 0; i < vKeys.size(); i++)
+        mapMerged[std::make_pair(vKeys[i].height, vKeys[i].address)].swap(vRead[i]);
+    for (auto& item : vQueued) {
+        mapMerged[std::make_pair(item.first.height, item.first.address)].swap(item.second);
+        nHeight = std::max(nHeight, (int)item.first.height);
+    }
+    for (auto& item : mapMerged) {
+        blocksOfHashes.push_back(std::vector<uint256>());
+        blocksOfHashes.back().swap(item.second);
+    }
+    return nHeight;
+}
+
+enum DisconnectResult {
+    DISCONNECT_OK, // All good.
+    DISCONNECT_UNCLEAN, // Rolled back, but UTXO set was inconsistent with block.
+    DISCONNECT_FAILED // Something else went wrong.
+};
+
+/**
+ * Restore the UTXO in a Coin at a given COutPoint
+ * @param undo The Coin to be restored.
+ * @param view The coins view to which to apply the changes.
+ * @param out The out point that corresponds to the tx input.
+ * @return A DisconnectResult as an int
+ */
+int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
@@ -2788,26 +4154,122 @@ int ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 }
 
 
+/**
+ * Tandia votes accepted or undone by checked connects and disconnects, so the
+ * check can reject a bad vote and still take it back afterwards. A checked
+ * ConnectBlock takes back its own votes before it returns, unless a caller
+ * collects them while a CTandiaCheckVotesScope is in place: checks 3 and 4 of
+ * VerifyDB roll the votes back and forth with the blocks and restore them once
+ * all blocks are done. With fApply unset no votes are touched at all.
+ */
+class CTandiaCheckVotes
+{
+private:
+    struct CVoteChange {
+        bool fAccepted;
+        int nHeight;
+        CScript scriptFrom;
+        CScript scriptTo;
+        uint256 txhash;
+    };
+    std::vector<CVoteChange> vChanges;
+    bool fApply;
+
+public:
+    explicit CTandiaCheckVotes(bool fApplyIn = true) : fApply(fApplyIn) {}
+
+    ~CTandiaCheckVotes()
+    {
+        Restore();
+    }
+
+    bool Accept(int nHeight, const CScript& scriptFrom, const CScript& scriptTo, const uint256& txhash)
+    {
+        if (!fApply)
+            return true;
+        if (!pTandia->AcceptVote(nHeight, scriptFrom, scriptTo, txhash))
+            return false;
+        vChanges.push_back(CVoteChange{true, nHeight, scriptFrom, scriptTo, txhash});
+        return true;
+    }
+
+    bool Undo(int nHeight, const CScript& scriptFrom, const CScript& scriptTo, const uint256& txhash)
+    {
+        if (!fApply)
+            return true;
+        if (!pTandia->UndoVote(nHeight, scriptFrom, scriptTo, txhash))
+            return false;
+        vChanges.push_back(CVoteChange{false, nHeight, scriptFrom, scriptTo, txhash});
+        return true;
+    }
+
+    /** Take back every change, newest first */
+    void Restore()
+    {
+        if (vChanges.empty())
+            return;
+        LOCK(cs_main);
+        bool fRestored = true;
+        for (std::vector<CVoteChange>::const_reverse_iterator it = vChanges.rbegin(); it != vChanges.rend(); ++it) {
+            if (it->fAccepted)
+                fRestored = pTandia->UndoVote(it->nHeight, it->scriptFrom, it->scriptTo, it->txhash) && fRestored;
+            else
+                fRestored = pTandia->AcceptVote(it->nHeight, it->scriptFrom, it->scriptTo, it->txhash) && fRestored;
+        }
+        vChanges.clear();
+        if (!fRestored)
+            AbortNode("Failed to restore tandia votes after a block check");
+    }
+};
+
+/** Where checked connects and disconnects record their tandia votes, if not in their own CTandiaCheckVotes (cs_main) */
+static CTandiaCheckVotes* pTandiaCheckVotes = nullptr;
+
+/** Makes checked connects and disconnects record their votes in a caller's CTandiaCheckVotes while in scope (cs_main) */
+class CTandiaCheckVotesScope
+{
+public:
+    explicit CTandiaCheckVotesScope(CTandiaCheckVotes* pvotes)
+    {
+        AssertLockHeld(cs_main);
+        assert(pTandiaCheckVotes == nullptr);
+        pTandiaCheckVotes = pvotes;
+    }
+
+    ~CTandiaCheckVotesScope()
+    {
+        pTandiaCheckVotes = nullptr;
+    }
+};
+
+
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
- *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state. */
-static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, CClueViewCache& clueview)
+ *  When UNCLEAN or FAILED is returned, view is left in an indeterminate state.
+ *  With fJustCheck the block indexes and ads are left alone and the tandia
+ *  votes are undone through a CTandiaCheckVotes, so a check can run between
+ *  live blocks. pblockUndoIn is undo data
+ *  the caller already read for the block; it is consumed. */
+static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& state, const CBlockIndex* pindex, CCoinsViewCache& view, CClueViewCache& clueview, bool fJustCheck = false, CBlockUndo* pblockUndoIn = nullptr)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
     assert(pindex->GetBlockHash() == clueview.GetBestBlock());
 
     bool fClean = true;
+    CTandiaCheckVotes checkVotes;
+    CTandiaCheckVotes* pcheckVotes = pTandiaCheckVotes ? pTandiaCheckVotes : &checkVotes;
 
-    CBlockUndo blockUndo;
+    CBlockUndo blockUndoRead;
     CDiskBlockPos pos = pindex->GetUndoPos();
 
     if (pos.IsNull()) {
         error("DisconnectBlock(): no undo data available");
         return DISCONNECT_FAILED;
     }
-    if (!UndoReadFromDisk(blockUndo, pos, pindex->pprev->GetBlockHash())) {
+    if (!pblockUndoIn && !UndoReadFromDisk(blockUndoRead, pos, pindex->pprev->GetBlockHash())) {
         error("DisconnectBlock(): failure reading undo data");
         return DISCONNECT_FAILED;
     }
+    CBlockUndo& blockUndo = pblockUndoIn ? *pblockUndoIn : blockUndoRead;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size()) {
         error("DisconnectBlock(): block and undo data inconsistent");
@@ -2817,6 +4279,8 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
     std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
     std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
     std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > addressUtxoHeight;
+    std::vector<CAddressUtxoHeightKey> addressUtxoHeightErase;
 
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
@@ -2835,6 +4299,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
                 // undo unspent index
                 addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, uint160(hashBytes), hash, k), CAddressUnspentValue()));
+                addressUtxoHeightErase.push_back(CAddressUtxoHeightKey(addressType, uint160(hashBytes), pindex->nHeight, hash, k));
 
             } else {
                 continue;
@@ -2884,7 +4349,9 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
                 if (tx.nFlag == CTransaction::TANDIA_TX) {
                     for (std::vector<CTxOut>::const_iterator it = tx.vout.begin(); it < tx.vout.end(); it++) {
                         if (it->nFlag == CTxOut::TANDIA) {
-                            if (!pTandia->UndoVote(pindex->nHeight, prevout.scriptPubKey, it->scriptPubKey, hash))
+                            bool fUndone = fJustCheck ? pcheckVotes->Undo(pindex->nHeight, prevout.scriptPubKey, it->scriptPubKey, hash) :
+                                                        pTandia->UndoVote(pindex->nHeight, prevout.scriptPubKey, it->scriptPubKey, hash);
+                            if (!fUndone)
                                 fClean = DISCONNECT_UNCLEAN;
                         }
                     }
@@ -2900,6 +4367,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
 
                     // restore unspent index
                     addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, uint160(hashBytes), input.prevout.hash, input.prevout.n), CAddressUnspentValue(prevout.nValue, prevout.scriptPubKey, undoHeight)));
+                    addressUtxoHeight.push_back(std::make_pair(CAddressUtxoHeightKey(addressType, uint160(hashBytes), undoHeight, input.prevout.hash, input.prevout.n), CAddressUtxoHeightValue(prevout.nValue, ADDRESS_UTXO_UNSPENT)));
 
                 } else {
                     continue;
@@ -2911,7 +4379,7 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
                 UndoClue(tx, state, view, clueview, pindex->nHeight, pindex->GetBlockHash());
             }
 
-            if (tx.nFlag == CTransaction::BID_TX) {
+            if (tx.nFlag == CTransaction::BID_TX && !fJustCheck) {
                 if (paddb->HaveAd(tx.GetHash())) {
                     CAd adRead;
                     paddb->ReadAd(tx.GetHash(), adRead);
@@ -2943,17 +4411,18 @@ static DisconnectResult DisconnectBlock(const CBlock& block, CValidationState& s
     globalState->setRoot(uintToh256(pindex->pprev->hashStateRoot)); // qtum
     globalState->setRootUTXO(uintToh256(pindex->pprev->hashUTXORoot)); // qtum
 
-    if (!pblocktree->EraseAddressIndex(addressIndex)) {
-        AbortNode("Failed to delete address index");
-        return DISCONNECT_FAILED;
-    }
-    if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-        AbortNode("Failed to write address unspent index");
-        return DISCONNECT_FAILED;
-    }
-
-    if (!pblocktree->EraseAnonymousBlock(pindex->GetBlockHash())) {
-        AbortNode(state, "Failed to delete anonymous block index");
+    if (fJustCheck)
+        return fClean ? DISCONNECT_OK : DISCONNECT_UNCLEAN;
+
+    CBlockIndexUpdate indexUpdate;
+    indexUpdate.hashBestBlock = pindex->pprev->GetBlockHash();
+    indexUpdate.vAddressIndexErase.swap(addressIndex);
+    indexUpdate.vAddressUnspentIndex.swap(addressUnspentIndex);
+    indexUpdate.vAddressUtxoHeight.swap(addressUtxoHeight);
+    indexUpdate.vAddressUtxoHeightErase.swap(addressUtxoHeightErase);
+    indexUpdate.vAnonymousBlockErase.push_back(pindex->GetBlockHash());
+    if (!WriteBlockIndexUpdate(indexUpdate)) {
+        AbortNode(state, "Failed to write block index");
         return DISCONNECT_FAILED;
     }
 
@@ -2973,7 +4442,7 @@ void static FlushBlockFile(bool fFinalize = false)
     FILE* fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nSize);
+            blockFileMappings.Truncate(posOld, "blk", fileOld, vinfoBlockFile[nLastBlockFile].nSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2981,7 +4450,7 @@ void static FlushBlockFile(bool fFinalize = false)
     fileOld = OpenUndoFile(posOld);
     if (fileOld) {
         if (fFinalize)
-            TruncateFile(fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
+            blockFileMappings.Truncate(posOld, "rev", fileOld, vinfoBlockFile[nLastBlockFile].nUndoSize);
         FileCommit(fileOld);
         fclose(fileOld);
     }
@@ -2997,6 +4466,241 @@ void ThreadScriptCheck()
     scriptcheckqueue.Thread();
 }
 
+// Shielded proofs are a lot heavier than a script check, and index entries
+// are built per transaction, so hand out smaller batches than scriptcheckqueue.
+static CCheckQueue<CConnectCheck> connectcheckqueue(16);
+
+/** Running ThreadConnectCheck instances; without any the checks run inline instead of through connectcheckqueue */
+static std::atomic<int> nConnectCheckThreads(0);
+
+void ThreadConnectCheck()
+{
+    RenameThread("vds-connectch");
+    ++nConnectCheckThreads;
+    try {
+        connectcheckqueue.Thread();
+    } catch (...) {
+        --nConnectCheckThreads;
+        throw;
+    }
+    --nConnectCheckThreads;
+}
+
+static bool CheckShieldedProofsWorker(const CTransaction* ptx)
+{
+    CValidationState state;
+    return CheckShieldedProofs(*ptx, state);
+}
+
+/** Address and spent index entries produced by one transaction of a connected block */
+struct CTxIndexEntries {
+    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
+    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
+    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
+    std::vector<std::pair<CAddressUtxoHeightKey, CAddressUtxoHeightValue> > addressUtxoHeight;
+};
+
+/**
+ * Build the index entries of the nTx-th transaction of a block from the coins
+ * it spent, as recorded in its undo data. Only reads data that is immutable
+ * once the block has been applied to the view, so it may run on the connect
+ * check threads.
+ */
+static bool BuildTxIndexEntries(const CTransaction* ptx, const CTxUndo* ptxundo, int nHeight, unsigned int nTx, CTxIndexEntries* pentries)
+{
+    const CTransaction& tx = *ptx;
+    const uint256 txhash = tx.GetHash();
+
+    if (!tx.IsCoinBase()) {
+        assert(ptxundo && ptxundo->vprevout.size() == tx.vin.size());
+        for (size_t j = 0; j < tx.vin.size(); j++) {
+            const CTxIn& input = tx.vin[j];
+            const CTxOut& prevout = ptxundo->vprevout[j].out;
+            uint160 hashBytes;
+            txnouttype addressType = TX_NONSTANDARD;
+
+            if (GetIndexKey(prevout.scriptPubKey, hashBytes, addressType)) {
+                // record spending activity
+                pentries->addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, nTx, txhash, j, true), prevout.nValue * -1));
+
+                // remove address from unspent index
+                pentries->addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
+
+                // record the spent height of the output
+                pentries->addressUtxoHeight.push_back(std::make_pair(CAddressUtxoHeightKey(addressType, hashBytes, ptxundo->vprevout[j].nHeight, input.prevout.hash, input.prevout.n), CAddressUtxoHeightValue(prevout.nValue, nHeight)));
+            }
+
+            // add the spent index to determine the txid and input that spent an output
+            // and to find the amount and address from an input
+            pentries->spentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, nHeight, prevout.nValue, addressType, hashBytes)));
+        }
+    }
+
+    for (unsigned int k = 0; k < tx.vout.size(); k++) {
+        const CTxOut& out = tx.vout[k];
+        uint160 hashBytes;
+        txnouttype addressType = TX_NONSTANDARD;
+
+        if (GetIndexKey(out.scriptPubKey, hashBytes, addressType)) {
+            // record receiving activity
+            pentries->addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, nHeight, nTx, txhash, k, false), out.nValue));
+
+            // record unspent output
+            pentries->addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, nHeight)));
+            pentries->addressUtxoHeight.push_back(std::make_pair(CAddressUtxoHeightKey(addressType, hashBytes, nHeight, txhash, k), CAddressUtxoHeightValue(out.nValue, ADDRESS_UTXO_UNSPENT)));
+        }
+    }
+    return true;
+}
+
+/** The index changes DisconnectBlock makes for a block, from its undo data */
+static void BuildBlockIndexUndo(const CBlock& block, const CBlockUndo& blockundo, const CBlockIndex* pindex, CBlockIndexUpdate& update)
+{
+    update.hashBestBlock = pindex->pprev->GetBlockHash();
+    for (int i = block.vtx.size() - 1; i >= 0; i--) {
+        const CTransaction& tx = *block.vtx[i];
+        const uint256 hash = tx.GetHash();
+        for (unsigned int k = tx.vout.size(); k-- > 0;) {
+            const CTxOut& out = tx.vout[k];
+            uint160 hashBytes;
+            txnouttype addressType = TX_NONSTANDARD;
+            if (GetIndexKey(out.scriptPubKey, hashBytes, addressType)) {
+                update.vAddressIndexErase.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, k, false), out.nValue));
+                update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, hash, k), CAddressUnspentValue()));
+                update.vAddressUtxoHeightErase.push_back(CAddressUtxoHeightKey(addressType, hashBytes, pindex->nHeight, hash, k));
+            }
+        }
+        if (i == 0)
+            continue;
+        const CTxUndo& txundo = blockundo.vtxundo[i - 1];
+        for (unsigned int j = tx.vin.size(); j-- > 0;) {
+            const COutPoint& prevout = tx.vin[j].prevout;
+            const Coin& coin = txundo.vprevout[j];
+            update.vSpentIndex.push_back(std::make_pair(CSpentIndexKey(prevout.hash, prevout.n), CSpentIndexValue()));
+            uint160 hashBytes;
+            txnouttype addressType = TX_NONSTANDARD;
+            if (GetIndexKey(coin.out.scriptPubKey, hashBytes, addressType)) {
+                update.vAddressIndexErase.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, hash, j, true), coin.out.nValue * -1));
+                update.vAddressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, prevout.hash, prevout.n), CAddressUnspentValue(coin.out.nValue, coin.out.scriptPubKey, coin.nHeight)));
+                update.vAddressUtxoHeight.push_back(std::make_pair(CAddressUtxoHeightKey(addressType, hashBytes, coin.nHeight, prevout.hash, prevout.n), CAddressUtxoHeightValue(coin.out.nValue, ADDRESS_UTXO_UNSPENT)));
+            }
+        }
+    }
+    update.vAnonymousBlockErase.push_back(pindex->GetBlockHash());
+}
+
+bool ReplayBlockIndexJournal(const CChainParams& chainparams)
+{
+    LOCK(cs_main);
+    if (chainActive.Tip() == NULL)
+        return true;
+
+    uint256 hashIndexBest;
+    if (!pblocktree->ReadIndexBestBlock(hashIndexBest) || hashIndexBest.IsNull()) {
+        // Written before the marker existed: the indexes were synced with the chainstate.
+        return pblocktree->WriteIndexBestBlock(chainActive.Tip()->GetBlockHash());
+    }
+    if (hashIndexBest == chainActive.Tip()->GetBlockHash())
+        return true;
+
+    BlockMap::iterator mi = mapBlockIndex.find(hashIndexBest);
+    if (mi == mapBlockIndex.end())
+        return error("%s: block index is at unknown block %s; restart with -reindex", __func__, hashIndexBest.ToString());
+    CBlockIndex* pindexIndexBest = mi->second;
+
+    // Index batches are committed before the chainstate, so after a crash the
+    // marker is usually ahead of the tip. Connecting those blocks again
+    // rewrites their entries.
+    if (pindexIndexBest->GetAncestor(chainActive.Height()) == chainActive.Tip()) {
+        LogPrintf("Block indexes are ahead of the chain state at height %d, they get rewritten from height %d\n", pindexIndexBest->nHeight, chainActive.Height() + 1);
+        return true;
+    }
+
+    // Blocks of a fork the chainstate never got to are taken out again
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindexIndexBest);
+    if (pindexFork == NULL)
+        return error("%s: block index is at %s, which shares no block with the active chain; restart with -reindex", __func__, hashIndexBest.ToString());
+    if (pindexFork != pindexIndexBest)
+        LogPrintf("Undoing block indexes of stale blocks from height %d to %d\n", pindexFork->nHeight + 1, pindexIndexBest->nHeight);
+    for (const CBlockIndex* pindex = pindexIndexBest; pindex != pindexFork; pindex = pindex->pprev) {
+        boost::this_thread::interruption_point();
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            return error("%s: failed to read stale block %s; restart with -reindex", __func__, pindex->GetBlockHash().ToString());
+        CBlockUndo blockundo;
+        if (!UndoReadFromDisk(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+            return error("%s: failed to read undo data of stale block %s; restart with -reindex", __func__, pindex->GetBlockHash().ToString());
+        if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+            return error("%s: undo data of block %s does not match", __func__, pindex->GetBlockHash().ToString());
+        for (size_t i = 1; i < block.vtx.size(); i++) {
+            if (blockundo.vtxundo[i - 1].vprevout.size() != block.vtx[i]->vin.size())
+                return error("%s: undo data of block %s does not match", __func__, pindex->GetBlockHash().ToString());
+        }
+
+        CBlockIndexUpdate update;
+        BuildBlockIndexUndo(block, blockundo, pindex, update);
+        if (!pblocktree->WriteBlockIndexUpdate(update, true))
+            return error("%s: failed to write block index of block %s", __func__, pindex->GetBlockHash().ToString());
+        EraseTxLookupCache(update);
+    }
+
+    LogPrintf("Replaying block indexes from height %d to %d\n", pindexFork->nHeight + 1, chainActive.Height());
+    for (CBlockIndex* pindex = chainActive.Next(pindexFork); pindex != NULL; pindex = chainActive.Next(pindex)) {
+        boost::this_thread::interruption_point();
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
+            return error("%s: failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+        CBlockUndo blockundo;
+        if (!UndoReadFromDisk(blockundo, pindex->GetUndoPos(), pindex->pprev->GetBlockHash()))
+            return error("%s: failed to read undo data of block %s", __func__, pindex->GetBlockHash().ToString());
+        if (blockundo.vtxundo.size() + 1 != block.vtx.size())
+            return error("%s: undo data of block %s does not match", __func__, pindex->GetBlockHash().ToString());
+
+        SaplingMerkleTree sapling_tree;
+        if (!pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, sapling_tree))
+            return error("%s: missing sapling anchor before block %s", __func__, pindex->GetBlockHash().ToString());
+
+        CBlockIndexUpdate update;
+        update.hashBestBlock = pindex->GetBlockHash();
+        CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+        AnonymousBlock anonymousBlock;
+        std::map<dev::Address, std::pair<CHeightTxIndexKey, std::vector<uint256> > > heightIndexes;
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTransaction& tx = *block.vtx[i];
+            CTxIndexEntries entries;
+            BuildTxIndexEntries(&tx, i > 0 ? &blockundo.vtxundo[i - 1] : nullptr, pindex->nHeight, i, &entries);
+            update.vAddressIndex.insert(update.vAddressIndex.end(), entries.addressIndex.begin(), entries.addressIndex.end());
+            update.vAddressUnspentIndex.insert(update.vAddressUnspentIndex.end(), entries.addressUnspentIndex.begin(), entries.addressUnspentIndex.end());
+            update.vSpentIndex.insert(update.vSpentIndex.end(), entries.spentIndex.begin(), entries.spentIndex.end());
+            update.vAddressUtxoHeight.insert(update.vAddressUtxoHeight.end(), entries.addressUtxoHeight.begin(), entries.addressUtxoHeight.end());
+
+            if (tx.vShieldedSpend.size() || tx.vShieldedOutput.size())
+                anonymousBlock.txs.push_back(AnonymousTxInfo(tx.GetHash(), sapling_tree));
+            for (const OutputDescription& outputDescription : tx.vShieldedOutput)
+                sapling_tree.append(outputDescription.cm);
+
+            if (fLogEvents) {
+                for (const TransactionReceiptInfo& tri : pstorageresult->getResult(uintToh256(tx.GetHash()))) {
+                    if (!heightIndexes.count(tri.contractAddress))
+                        heightIndexes[tri.contractAddress].first = CHeightTxIndexKey(pindex->nHeight, tri.contractAddress);
+                    heightIndexes[tri.contractAddress].second.push_back(tx.GetHash());
+                }
+            }
+
+            update.vTxIndex.push_back(std::make_pair(tx.GetHash(), pos));
+            pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+        }
+        for (const auto& e : heightIndexes)
+            update.vHeightIndex.push_back(e.second);
+        update.vAnonymousBlock.push_back(std::make_pair(pindex->GetBlockHash(), anonymousBlock));
+
+        if (!pblocktree->WriteBlockIndexUpdate(update, true))
+            return error("%s: failed to write block index of block %s", __func__, pindex->GetBlockHash().ToString());
+        EraseTxLookupCache(update);
+    }
+    return true;
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -3073,36 +4777,104 @@ bool CheckSenderScript(const CCoinsViewCache& view, const CTransaction& tx)
     return true;
 }
 
-std::vector<ResultExecute> CallContract(const dev::Address& addrContract, std::vector<unsigned char> opcode, const dev::Address& sender, uint64_t gasLimit)
+/** Puts back the contract state roots of the active chain once a verification batch or contract calls are done */
+class CGlobalStateRootsRestorer
 {
-    CBlock block;
-    CMutableTransaction tx;
+private:
+    dev::h256 hashStateRoot;
+    dev::h256 hashUTXORoot;
 
-    CBlockIndex* pblockindex = mapBlockIndex[chainActive.Tip()->GetBlockHash()];
-    ReadBlockFromDisk(block, pblockindex, Params().GetConsensus());
-    block.nTime = GetAdjustedTime();
+public:
+    CGlobalStateRootsRestorer() : hashStateRoot(globalState->rootHash()), hashUTXORoot(globalState->rootHashUTXO()) {}
 
-    block.vtx.erase(block.vtx.begin() + 1, block.vtx.end());
+    ~CGlobalStateRootsRestorer()
+    {
+        globalState->setRoot(hashStateRoot); // qtum
+        globalState->setRootUTXO(hashUTXORoot); // qtum
+    }
+};
 
+/** What read only contract calls need of the tip, rebuilt when the tip changes (cs_main) */
+struct CContractCallEnv {
+    uint256 hashTip;
+    CBlock block;              //!< The tip with only its coinbase, the call is appended
+    uint64_t nBlockGasLimit;   //!< Of the next block
+    dev::eth::EnvInfo envInfo; //!< For the next block, the timestamp is set per call
+};
 
-    QtumDGP qtumDGP(globalState.get(), fGettingValuesDGP);
-    uint64_t blockGasLimit = qtumDGP.getBlockGasLimit(chainActive.Tip()->nHeight + 1);
+static const CContractCallEnv* GetContractCallEnv()
+{
+    static CContractCallEnv env;
+
+    AssertLockHeld(cs_main);
+    CBlockIndex* pindexTip = chainActive.Tip();
+    if (env.hashTip == pindexTip->GetBlockHash())
+        return &env;
 
-    if (gasLimit == 0) {
-        gasLimit = blockGasLimit - 1;
+    CBlock block;
+    if (!ReadBlockFromDisk(block, pindexTip, Params().GetConsensus())) {
+        error("%s: failed to read tip block %s", __func__, pindexTip->GetBlockHash().ToString());
+        return nullptr;
     }
-    dev::Address senderAddress = sender == dev::Address() ? dev::Address("ffffffffffffffffffffffffffffffffffffffff") : sender;
-    tx.vout.push_back(CTxOut(0, CTxOut::NORMAL, CScript() << OP_DUP << OP_HASH160 << senderAddress.asBytes() << OP_EQUALVERIFY << OP_CHECKSIG));
-    block.vtx.push_back(MakeTransactionRef(CTransaction(tx)));
+    block.vtx.erase(block.vtx.begin() + 1, block.vtx.end());
+    QtumDGP qtumDGP(globalState.get(), fGettingValuesDGP);
+    env.nBlockGasLimit = qtumDGP.getBlockGasLimit(pindexTip->nHeight + 1);
+    env.block = block;
+    env.envInfo = ByteCodeExec(env.block, std::vector<QtumTransaction>(), env.nBlockGasLimit).BuildEVMEnvironment();
+    env.hashTip = pindexTip->GetBlockHash();
+    return &env;
+}
 
-    QtumTransaction callTransaction(0, 1, dev::u256(gasLimit), addrContract, opcode, dev::u256(0));
-    callTransaction.forceSender(senderAddress);
-    callTransaction.setVersion(VersionVM::GetEVMDefault());
+std::vector<ResultExecute> CallContract(const dev::Address& addrContract, std::vector<unsigned char> opcode, const dev::Address& sender, uint64_t gasLimit)
+{
+    std::vector<CContractCall> vCalls(1);
+    vCalls[0].addrContract = addrContract;
+    vCalls[0].opcode = opcode;
+    vCalls[0].sender = sender;
+    vCalls[0].gasLimit = gasLimit;
+    std::vector<std::vector<ResultExecute> > vResults = CallContracts(vCalls);
+    return vResults.empty() ? std::vector<ResultExecute>() : vResults[0];
+}
 
+std::vector<std::vector<ResultExecute> > CallContracts(const std::vector<CContractCall>& vCalls, const uint256& hashStateRoot, const uint256& hashUTXORoot)
+{
+    std::vector<std::vector<ResultExecute> > vResults;
 
-    ByteCodeExec exec(block, std::vector<QtumTransaction>(1, callTransaction), blockGasLimit);
-    exec.performByteCode(dev::eth::Permanence::Reverted);
-    return exec.getResult();
+    LOCK(cs_main);
+    const CContractCallEnv* penv = GetContractCallEnv();
+    if (!penv)
+        return vResults;
+
+    // Run every call against the requested state, then go back to the tip's
+    CGlobalStateRootsRestorer restorer;
+    if (!hashStateRoot.IsNull())
+        globalState->setRoot(uintToh256(hashStateRoot));
+    if (!hashUTXORoot.IsNull())
+        globalState->setRootUTXO(uintToh256(hashUTXORoot));
+
+    vResults.reserve(vCalls.size());
+    for (const CContractCall& call : vCalls) {
+        CBlock block(penv->block);
+        block.nTime = GetAdjustedTime();
+        dev::eth::EnvInfo envInfo(penv->envInfo);
+        envInfo.setTimestamp(dev::u256(block.nTime));
+
+        uint64_t gasLimit = call.gasLimit == 0 ? penv->nBlockGasLimit - 1 : call.gasLimit;
+        dev::Address senderAddress = call.sender == dev::Address() ? dev::Address("ffffffffffffffffffffffffffffffffffffffff") : call.sender;
+        CMutableTransaction tx;
+        tx.vout.push_back(CTxOut(0, CTxOut::NORMAL, CScript() << OP_DUP << OP_HASH160 << senderAddress.asBytes() << OP_EQUALVERIFY << OP_CHECKSIG));
+        block.vtx.push_back(MakeTransactionRef(CTransaction(tx)));
+
+        QtumTransaction callTransaction(0, 1, dev::u256(gasLimit), call.addrContract, call.opcode, dev::u256(0));
+        callTransaction.forceSender(senderAddress);
+        callTransaction.setVersion(VersionVM::GetEVMDefault());
+
+        ByteCodeExec exec(block, std::vector<QtumTransaction>(1, callTransaction), penv->nBlockGasLimit);
+        exec.SetEnvInfo(envInfo);
+        exec.performByteCode(dev::eth::Permanence::Reverted);
+        vResults.push_back(exec.getResult());
+    }
+    return vResults;
 }
 
 bool CheckMinGasPrice(std::vector<EthTransactionParams>& etps, const uint64_t& minGasPrice)
@@ -3310,31 +5082,177 @@ UniValue vmLogToJSON(const ResultExecute& execRes, const CTransaction& tx, const
     return result;
 }
 
-void writeVMlog(const std::vector<ResultExecute>& res, const CTransaction& tx, const CBlock& block)
+/**
+ * VM execution logs (-record-log-opcodes) are written as newline-delimited
+ * JSON, one execution result per line, to <datadir>/vmlogs. A file is named
+ * after the height of its first line and is closed after -vmlogmaxsize MB or
+ * -vmlogrotateheight blocks. Its .idx companion lists the txid and offset of
+ * the first line of every transaction. ThreadVMLogWriter appends the queued
+ * lines in order; without the writer thread writeVMlog appends them itself.
+ */
+struct CVMLogLine {
+    uint256 txid;
+    int nHeight;
+    std::string strLine;
+};
+
+class CVMLogFile
 {
-    boost::filesystem::path qtumDir = GetDataDir() / "vmExecLogs.json";
-    std::stringstream ss;
-    if (fIsVMlogFile) {
-        ss << ",";
-    } else {
-        std::ofstream file(qtumDir.string(), std::ios::out | std::ios::app);
-        file << "{\"logs\":[]}";
-        file.close();
+private:
+    FILE* fileLog;
+    FILE* fileIndex;
+    int nStartHeight;
+    uint64_t nSize;
+    uint64_t nMaxSize;
+    int nRotateHeight;
+    uint256 txidLast;
+
+    bool Open(int nHeight)
+    {
+        boost::filesystem::path dir = GetDataDir() / "vmlogs";
+        boost::filesystem::create_directories(dir);
+        nMaxSize = std::max<int64_t>(0, GetArg("-vmlogmaxsize", DEFAULT_VMLOG_MAX_SIZE)) << 20;
+        nRotateHeight = std::max<int64_t>(0, GetArg("-vmlogrotateheight", DEFAULT_VMLOG_ROTATE_HEIGHT));
+        // A file left full by an earlier run is not appended to again
+        boost::filesystem::path path;
+        for (int n = 0; ; n++) {
+            path = dir / (n == 0 ? strprintf("vmlog-%08d.ndjson", nHeight) : strprintf("vmlog-%08d-%d.ndjson", nHeight, n));
+            if (!boost::filesystem::exists(path) || nMaxSize == 0 || boost::filesystem::file_size(path) < nMaxSize)
+                break;
+        }
+        fileLog = fsbridge::fopen(path, "ab");
+        if (!fileLog)
+            return error("%s: failed to open %s", __func__, path.string());
+        path.replace_extension(".idx");
+        fileIndex = fsbridge::fopen(path, "ab");
+        if (!fileIndex) {
+            Close();
+            return error("%s: failed to open %s", __func__, path.string());
+        }
+        fseek(fileLog, 0, SEEK_END);
+        nSize = ftell(fileLog);
+        nStartHeight = nHeight;
+        txidLast.SetNull();
+        return true;
+    }
+
+public:
+    CVMLogFile() : fileLog(nullptr), fileIndex(nullptr), nStartHeight(0), nSize(0), nMaxSize(0), nRotateHeight(0) {}
+
+    ~CVMLogFile()
+    {
+        Close();
+    }
+
+    void Close()
+    {
+        if (fileLog)
+            fclose(fileLog);
+        if (fileIndex)
+            fclose(fileIndex);
+        fileLog = nullptr;
+        fileIndex = nullptr;
+    }
+
+    bool Append(const CVMLogLine& line)
+    {
+        if (fileLog && ((nMaxSize > 0 && nSize >= nMaxSize) || (nRotateHeight > 0 && line.nHeight >= nStartHeight + nRotateHeight)))
+            Close();
+        if (!fileLog && !Open(line.nHeight))
+            return false;
+        if (line.txid != txidLast) {
+            std::string strIndex = strprintf("%s %u\n", line.txid.GetHex(), nSize);
+            if (fwrite(strIndex.data(), 1, strIndex.size(), fileIndex) != strIndex.size())
+                return error("%s: failed to write the VM log index", __func__);
+            txidLast = line.txid;
+        }
+        if (fwrite(line.strLine.data(), 1, line.strLine.size(), fileLog) != line.strLine.size() || fputc('\n', fileLog) == EOF)
+            return error("%s: failed to write the VM log", __func__);
+        nSize += line.strLine.size() + 1;
+        return true;
+    }
+
+    void Flush()
+    {
+        if (fileLog)
+            fflush(fileLog);
+        if (fileIndex)
+            fflush(fileIndex);
+    }
+};
+
+static boost::mutex csVMLogWriter;
+static boost::condition_variable condVMLogWriter;
+static std::deque<CVMLogLine> queueVMLogWriter;
+static bool fVMLogWriterRunning = false;
+static const size_t MAX_VMLOG_WRITER_QUEUE = 4096;
+/** Written by ThreadVMLogWriter while it runs, otherwise under csVMLogWriter */
+static CVMLogFile vmLogFile;
+
+void ThreadVMLogWriter()
+{
+    RenameThread("vds-vmlogwriter");
+    {
+        boost::unique_lock<boost::mutex> lock(csVMLogWriter);
+        fVMLogWriterRunning = true;
+    }
+    try {
+        std::vector<CVMLogLine> vLines;
+        while (true) {
+            {
+                boost::unique_lock<boost::mutex> lock(csVMLogWriter);
+                while (queueVMLogWriter.empty())
+                    condVMLogWriter.wait(lock);
+                vLines.assign(std::make_move_iterator(queueVMLogWriter.begin()), std::make_move_iterator(queueVMLogWriter.end()));
+                queueVMLogWriter.clear();
+            }
+            condVMLogWriter.notify_all();
+            for (const CVMLogLine& line : vLines)
+                vmLogFile.Append(line);
+            vmLogFile.Flush();
+            vLines.clear();
+        }
+    } catch (const boost::thread_interrupted&) {
+        // Whatever is still queued goes to disk before shutdown.
+        boost::unique_lock<boost::mutex> lock(csVMLogWriter);
+        fVMLogWriterRunning = false;
+        for (const CVMLogLine& line : queueVMLogWriter)
+            vmLogFile.Append(line);
+        queueVMLogWriter.clear();
+        vmLogFile.Close();
+        condVMLogWriter.notify_all();
+        throw;
     }
+}
 
+void writeVMlog(const std::vector<ResultExecute>& res, const CTransaction& tx, const CBlock& block)
+{
+    // Same height as vmLogToJSON reports
+    int nHeight = chainActive.Tip()->nHeight + (block.GetHash() != CBlock().GetHash() ? 1 : 0);
+    std::vector<CVMLogLine> vLines(res.size());
     for (size_t i = 0; i < res.size(); i++) {
-        ss << vmLogToJSON(res[i], tx, block).write();
-        if (i != res.size() - 1) {
-            ss << ",";
+        vLines[i].txid = tx.GetHash();
+        vLines[i].nHeight = nHeight;
+        vLines[i].strLine = vmLogToJSON(res[i], tx, block).write();
+    }
+
+    boost::unique_lock<boost::mutex> lock(csVMLogWriter);
+    bool fAppended = false;
+    for (CVMLogLine& line : vLines) {
+        // Wait rather than drop lines when the writer falls behind, and
+        // write them here once it has stopped
+        while (fVMLogWriterRunning && queueVMLogWriter.size() >= MAX_VMLOG_WRITER_QUEUE)
+            condVMLogWriter.wait(lock);
+        if (fVMLogWriterRunning) {
+            queueVMLogWriter.push_back(std::move(line));
+            condVMLogWriter.notify_all();
         } else {
-            ss << "]}";
+            vmLogFile.Append(line);
+            fAppended = true;
         }
     }
-
-    std::ofstream file(qtumDir.string(), std::ios::in | std::ios::out);
-    file.seekp(-2, std::ios::end);
-    file << ss.str();
-    file.close();
+    if (fAppended)
+        vmLogFile.Flush();
     fIsVMlogFile = true;
 }
 
@@ -3362,7 +5280,7 @@ bool ByteCodeExec::performByteCode(dev::eth::Permanence type)
         if (tx.getVersion().toRaw() != VersionVM::GetEVMDefault().toRaw()) {
             return false;
         }
-        dev::eth::EnvInfo envInfo(BuildEVMEnvironment());
+        dev::eth::EnvInfo envInfo(fEnvInfo ? envInfoSet : BuildEVMEnvironment());
         if (!tx.isCreation() && !globalState->addressInUse(tx.receiveAddress())) {
             dev::eth::ExecutionResult execRes;
             execRes.excepted = dev::eth::TransactionException::Unknown;
@@ -3371,8 +5289,11 @@ bool ByteCodeExec::performByteCode(dev::eth::Permanence type)
         }
         result.push_back(globalState->execute(envInfo, *globalSealEngine.get(), tx, type, OnOpFunc()));
     }
-    globalState->db().commit();
-    globalState->dbUtxo().commit();
+    // A reverted execution leaves nothing in the overlays to write
+    if (type != dev::eth::Permanence::Reverted && fCommit) {
+        globalState->db().commit();
+        globalState->dbUtxo().commit();
+    }
     globalSealEngine.get()->deleteAddresses.clear();
     return true;
 }
@@ -3570,6 +5491,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     uint256 blockhash = block.GetHash();
     bool fExpensiveChecks = true;
 
+    // Tandia votes of a checked connect are taken back when it returns, unless
+    // the caller collects them
+    CTandiaCheckVotes checkVotes;
+    CTandiaCheckVotes* pcheckVotes = pTandiaCheckVotes ? pTandiaCheckVotes : &checkVotes;
+
     auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
@@ -3614,6 +5540,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<CTxOut> checkVouts; // here must coinbase, masternodes, free heart, refundgas
 
     uint64_t countCumulativeGasUsed = 0;
+    // Every contract transaction of the block runs in the same environment, and
+    // the state databases are committed once after the last one
+    dev::eth::EnvInfo envInfoBlock;
+    bool fContractsExecuted = false;
     /////////////////////////////////////////////////
 
     CAmount nFees = 0;
@@ -3623,9 +5553,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
-    std::vector<std::pair<CAddressIndexKey, CAmount> > addressIndex;
-    std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > addressUnspentIndex;
-    std::vector<std::pair<CSpentIndexKey, CSpentIndexValue> > spentIndex;
 
     SaplingMerkleTree sapling_tree;
     assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
@@ -3720,7 +5647,9 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                     if (out.nFlag == CTxOut::TANDIA) {
                         const Coin& coin = view.AccessCoin(tx.vin[0].prevout);
                         const CTxOut& prevout = coin.out;
-                        if (!pTandia->AcceptVote(pindex->nHeight, prevout.scriptPubKey, out.scriptPubKey, txhash))
+                        bool fAccepted = fJustCheck ? pcheckVotes->Accept(pindex->nHeight, prevout.scriptPubKey, out.scriptPubKey, txhash) :
+                                                      pTandia->AcceptVote(pindex->nHeight, prevout.scriptPubKey, out.scriptPubKey, txhash);
+                        if (!fAccepted)
                             return state.DoS(100, error("ConnectBlock(): Tandia vote accept failed"),
                                              REJECT_INVALID, "bad-txns-tandia-vote-not-accept");
                     }
@@ -3748,42 +5677,19 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                         if (adlocal.admsg != "") {
                             ad.admsg = adlocal.admsg;
                         }
-                        paddb->WriteAd(ad);
-                        GetMainSignals().NotifyAdReceived(tx.GetHash(), ad);
-                        uiInterface.NotifyAdReceived(tx.GetHash(), ad);
+                        if (!fJustCheck) {
+                            paddb->WriteAd(ad);
+                            GetMainSignals().NotifyAdReceived(tx.GetHash(), ad);
+                            uiInterface.NotifyAdReceived(tx.GetHash(), ad);
+                        }
                     }
                 }
             }
-
-
-            for (size_t j = 0; j < tx.vin.size(); j++) {
-                const CTxIn input = tx.vin[j];
-                const Coin& coin = view.AccessCoin(tx.vin[j].prevout);
-                const CTxOut& prevout = coin.out;
-                uint160 hashBytes;
-                txnouttype addressType = TX_NONSTANDARD;
-
-                if (GetIndexKey(prevout.scriptPubKey, hashBytes, addressType)) {
-                    // record spending activity
-                    addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, hashBytes, pindex->nHeight, i, txhash, j, true), prevout.nValue * -1));
-
-                    // remove address from unspent index
-                    addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, hashBytes, input.prevout.hash, input.prevout.n), CAddressUnspentValue()));
-                }
-
-
-                // add the spent index to determine the txid and input that spent an output
-                // and to find the amount and address from an input
-                spentIndex.push_back(std::make_pair(CSpentIndexKey(input.prevout.hash, input.prevout.n), CSpentIndexValue(txhash, j, pindex->nHeight, prevout.nValue, addressType, hashBytes)));
-
-            }
-
-
             control.Add(vChecks);
         }
 
         // update adking for last bid period.
-        if (((pindex->nHeight % params.nBidPeriod) == 0) && (pindex->nHeight > 0)) {
+        if (((pindex->nHeight % params.nBidPeriod) == 0) && (pindex->nHeight > 0) && !fJustCheck) {
             CAd lastad;
             if (paddb->ReadAd(pindex->nHeight - params.nBidPeriod, lastad)) {
                 if (lastad.adValue > g_AdKing.adValue) {
@@ -3871,6 +5777,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                 }
             }
 
+            if (!fContractsExecuted) {
+                envInfoBlock = exec.BuildEVMEnvironment();
+                fContractsExecuted = true;
+            }
+            exec.SetEnvInfo(envInfoBlock);
+            exec.DeferCommit();
             if (!exec.performByteCode()) {
                 return state.DoS(100, error("ConnectBlock(): Unknown error during contract execution"), REJECT_INVALID, "bad-tx-unknown-error");
             }
@@ -3894,7 +5806,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
                                                          countCumulativeGasUsed, uint64_t(resultExec[k].execRes.gasUsed), resultExec[k].execRes.newAddress, resultExec[k].txRec.log(), resultExec[k].execRes.excepted});
                 }
 
-                pstorageresult->addResult(uintToh256(tx.GetHash()), tri);
+                if (!fJustCheck)
+                    pstorageresult->addResult(uintToh256(tx.GetHash()), tri);
             }
 
             bool ifSuccess = true;
@@ -3925,25 +5838,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
         /////////////////////////////////////////////////////////////////////////////////////////
 
-        for (unsigned int k = 0; k < tx.vout.size(); k++) {
-            const CTxOut& out = tx.vout[k];
-
-            uint160 hashBytes;
-            txnouttype addressType = TX_NONSTANDARD;
-
-            if (GetIndexKey(out.scriptPubKey, hashBytes, addressType)) {
-                // record receiving activity
-                addressIndex.push_back(std::make_pair(CAddressIndexKey(addressType, uint160(hashBytes), pindex->nHeight, i, txhash, k, false), out.nValue));
-
-                // record unspent output
-                addressUnspentIndex.push_back(std::make_pair(CAddressUnspentKey(addressType, uint160(hashBytes), txhash, k), CAddressUnspentValue(out.nValue, out.scriptPubKey, pindex->nHeight)));
-
-            } else {
-                continue;
-            }
-
-        }
-
         CTxUndo undoDummy;
         if (i > 0) {
             blockundo.vtxundo.push_back(CTxUndo());
@@ -3970,6 +5864,26 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     view.PushAnchor(sapling_tree);
 
+    // The address/spent index entries only depend on the block and on the coins
+    // it spent (now in blockundo), so build them on the connect check threads
+    // while the reward and script checks below run. Each transaction fills its
+    // own slot and the slots are merged in block order before the index write.
+    std::vector<CTxIndexEntries> vIndexEntries;
+    bool fIndexChecksQueued = !fJustCheck && nConnectCheckThreads > 0;
+    CCheckQueueControl<CConnectCheck> indexControl(fIndexChecksQueued ? &connectcheckqueue : nullptr);
+    if (!fJustCheck) {
+        vIndexEntries.resize(block.vtx.size());
+        std::vector<CConnectCheck> vIndexChecks;
+        for (unsigned int i = 0; i < block.vtx.size(); i++) {
+            const CTxUndo* ptxundo = i > 0 ? &blockundo.vtxundo[i - 1] : nullptr;
+            if (fIndexChecksQueued)
+                vIndexChecks.push_back(CConnectCheck(boost::bind(&BuildTxIndexEntries, block.vtx[i].get(), ptxundo, pindex->nHeight, i, &vIndexEntries[i])));
+            else
+                BuildTxIndexEntries(block.vtx[i].get(), ptxundo, pindex->nHeight, i, &vIndexEntries[i]);
+        }
+        indexControl.Add(vIndexChecks);
+    }
+
     if (blockhash == params.hashGenesisBlock) {
         if (!fJustCheck) {
             view.SetBestBlock(blockhash);
@@ -4049,6 +5963,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs - 1), nTimeVerify * 0.000001);
 
     ////////////////////////////////////////////////////////////////// // qtum
+    if (fContractsExecuted) {
+        globalState->db().commit();
+        globalState->dbUtxo().commit();
+    }
     checkBlock.hashMerkleRoot = BlockMerkleRoot(checkBlock);
     checkBlock.hashStateRoot = h256Touint(globalState->rootHash());
     checkBlock.hashUTXORoot = h256Touint(globalState->rootHashUTXO());
@@ -4139,29 +6057,29 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fLogEvents) {
-        for (const auto& e : heightIndexes) {
-            if (!pblocktree->WriteHeightIndex(e.second.first, e.second.second))
-                return AbortNode(state, "Failed to write height index");
-        }
-    }
-
-    if (!pblocktree->WriteTxIndex(vPos))
-        return AbortNode(state, "Failed to write transaction index");
+    if (!indexControl.Wait())
+        return AbortNode(state, "Failed to build address index entries");
 
-    if (!pblocktree->WriteAddressIndex(addressIndex)) {
-        return AbortNode(state, "Failed to write address index");
+    // All index changes of the block go to the block tree as one batch.
+    CBlockIndexUpdate indexUpdate;
+    indexUpdate.hashBestBlock = blockhash;
+    for (const CTxIndexEntries& entries : vIndexEntries) {
+        indexUpdate.vAddressIndex.insert(indexUpdate.vAddressIndex.end(), entries.addressIndex.begin(), entries.addressIndex.end());
+        indexUpdate.vAddressUnspentIndex.insert(indexUpdate.vAddressUnspentIndex.end(), entries.addressUnspentIndex.begin(), entries.addressUnspentIndex.end());
+        indexUpdate.vSpentIndex.insert(indexUpdate.vSpentIndex.end(), entries.spentIndex.begin(), entries.spentIndex.end());
+        indexUpdate.vAddressUtxoHeight.insert(indexUpdate.vAddressUtxoHeight.end(), entries.addressUtxoHeight.begin(), entries.addressUtxoHeight.end());
     }
 
-    if (!pblocktree->UpdateAddressUnspentIndex(addressUnspentIndex)) {
-        return AbortNode(state, "Failed to write address unspent index");
+    if (fLogEvents) {
+        for (const auto& e : heightIndexes)
+            indexUpdate.vHeightIndex.push_back(e.second);
     }
 
-    if (!pblocktree->UpdateSpentIndex(spentIndex))
-        return AbortNode(state, "Failed to write transaction index");
+    indexUpdate.vTxIndex.swap(vPos);
+    indexUpdate.vAnonymousBlock.push_back(std::make_pair(blockhash, anonymousBlock));
 
-    if (!pblocktree->WriteAnonymousBlock(blockhash, anonymousBlock))
-        return AbortNode(state, "Failed to write anonymous block index");
+    if (!WriteBlockIndexUpdate(indexUpdate))
+        return AbortNode(state, "Failed to write block index");
 
     // add this block to the view's block chain
     view.SetBestBlock(blockhash);
@@ -4186,6 +6104,307 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     return true;
 }
 
+/**
+ * Incremented every time pcoinsTip is flushed to the coins database. Coins
+ * read from the database by the block prefetcher are only trusted if no
+ * flush happened after the read started: until then an outpoint that is not
+ * cached in pcoinsTip has the same state in pcoinsTip as on disk.
+ */
+static std::atomic<uint64_t> nCoinsFlushGeneration(0);
+
+/**
+ * Outpoints spent in pcoinsTip since its last flush, as salted hashes, by a
+ * connected block or, for the outputs of a disconnected block, by a
+ * disconnect. pcoinsTip keeps such a coin cached as spent, which
+ * HaveCoinInCache does not tell apart from an uncached coin, while the coins
+ * database still has it unspent, so a prefetched read of it is not trusted.
+ * A hash collision only costs a lookup through pcoinsTip. Guarded by cs_main
+ * and cleared with every flush.
+ */
+class CCoinsSpentSinceFlush
+{
+private:
+    const uint64_t k0, k1;
+    boost::unordered_set<uint64_t> setHashes;
+
+    uint64_t Hash(const COutPoint& outpoint) const
+    {
+        return SipHashUint256Extra(k0, k1, outpoint.hash, outpoint.n);
+    }
+
+public:
+    CCoinsSpentSinceFlush() : k0(GetRand(std::numeric_limits<uint64_t>::max())), k1(GetRand(std::numeric_limits<uint64_t>::max())) {}
+
+    bool Contains(const COutPoint& outpoint) const { return setHashes.count(Hash(outpoint)) != 0; }
+    void Clear() { boost::unordered_set<uint64_t>().swap(setHashes); }
+
+    /** Note the coins a block spends, or creates if it was disconnected */
+    void AddBlock(const CBlock& block, bool fDisconnected)
+    {
+        for (const auto& tx : block.vtx) {
+            if (fDisconnected) {
+                for (size_t o = 0; o < tx->vout.size(); o++)
+                    setHashes.insert(Hash(COutPoint(tx->GetHash(), o)));
+            } else if (!tx->IsCoinBase()) {
+                for (const CTxIn& txin : tx->vin)
+                    setHashes.insert(Hash(txin.prevout));
+            }
+        }
+    }
+};
+static CCoinsSpentSinceFlush coinsSpentSinceFlush;
+
+/**
+ * View layered between pcoinsTip and the view ConnectBlock works on. It
+ * answers lookups from coins prefetched out of the coins database, but only
+ * for outpoints pcoinsTip has not cached (for those the database is still
+ * authoritative) and that no block spent since the last flush. Outpoints
+ * known to be absent are stored as spent coins.
+ */
+class CCoinsViewPrefetched : public CCoinsViewBacked
+{
+private:
+    const CCoinsViewCache* cache;
+    const std::map<COutPoint, Coin>& mapCoins;
+
+public:
+    CCoinsViewPrefetched(CCoinsViewCache* cacheIn, const std::map<COutPoint, Coin>& mapCoinsIn) : CCoinsViewBacked(cacheIn), cache(cacheIn), mapCoins(mapCoinsIn) {}
+
+    bool GetCoin(const COutPoint& outpoint, Coin& coin) const
+    {
+        std::map<COutPoint, Coin>::const_iterator it = mapCoins.find(outpoint);
+        if (it == mapCoins.end() || cache->HaveCoinInCache(outpoint) || coinsSpentSinceFlush.Contains(outpoint))
+            return base->GetCoin(outpoint, coin);
+        coin = it->second;
+        return !coin.IsSpent();
+    }
+
+    bool HaveCoin(const COutPoint& outpoint) const
+    {
+        Coin coin;
+        return GetCoin(outpoint, coin);
+    }
+};
+
+/**
+ * Background reader for the blocks ActivateBestChain is about to connect.
+ * Worker threads load each queued block from disk and then look up every
+ * coin it spends or creates in the coins database, in chunks, so that
+ * ConnectTip neither re-reads the block nor does synchronous LevelDB reads
+ * for most of the ConnectBlock lookups while holding cs_main. Blocks are
+ * served in connect order, and the coin lookups of a loaded block take
+ * priority over loading later blocks.
+ */
+class CBlockPrefetcher
+{
+private:
+    struct CPrefetchBlock {
+        uint64_t nSequence;
+        uint64_t nGeneration;
+        const CBlockIndex* pindex;
+        std::shared_ptr<const CBlock> pblock;
+        std::vector<std::pair<COutPoint, Coin> > vCoins;
+        std::map<COutPoint, Coin> mapCoins;
+        size_t nPendingJobs;
+        bool fDone;
+        bool fFailed;
+    };
+
+    /** Either load a block (nBegin == nEnd) or read the coins vCoins[nBegin, nEnd) of it */
+    struct CPrefetchJob {
+        uint64_t nSequence;
+        CPrefetchBlock* pentry;
+        size_t nBegin;
+        size_t nEnd;
+
+        bool operator<(const CPrefetchJob& other) const
+        {
+            if (nSequence != other.nSequence)
+                return nSequence < other.nSequence;
+            return nBegin < other.nBegin;
+        }
+    };
+
+    static const size_t COINS_PER_JOB = 128;
+
+    const Consensus::Params& consensusParams;
+    const int nThreads;
+    uint64_t nNextSequence;
+    bool fStop;
+    boost::mutex mutex;
+    boost::condition_variable condWork;
+    boost::condition_variable condDone;
+    std::map<const CBlockIndex*, CPrefetchBlock> mapBlocks;
+    std::set<CPrefetchJob> setJobs;
+    boost::thread_group threads;
+
+    void Finish(CPrefetchBlock& entry, bool fFailed)
+    {
+        entry.fFailed = fFailed;
+        entry.fDone = true;
+        condDone.notify_all();
+    }
+
+    void LoadBlock(CPrefetchBlock& entry)
+    {
+        std::shared_ptr<const CBlock> pblock = entry.pblock;
+        if (!pblock) {
+            std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
+            if (!ReadBlockFromDisk(*pblockNew, entry.pindex, consensusParams)) {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                Finish(entry, true);
+                return;
+            }
+            pblock = pblockNew;
+        }
+
+        std::vector<std::pair<COutPoint, Coin> > vCoins;
+        for (const auto& tx : pblock->vtx) {
+            if (!tx->IsCoinBase()) {
+                for (const CTxIn& txin : tx->vin)
+                    vCoins.push_back(std::make_pair(txin.prevout, Coin()));
+            }
+            // ConnectBlock's BIP30 check looks every new output up as well
+            for (size_t o = 0; o < tx->vout.size(); o++)
+                vCoins.push_back(std::make_pair(COutPoint(tx->GetHash(), o), Coin()));
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        entry.pblock = pblock;
+        entry.vCoins.swap(vCoins);
+        if (entry.vCoins.empty()) {
+            Finish(entry, false);
+            return;
+        }
+        for (size_t nBegin = 0; nBegin < entry.vCoins.size(); nBegin += COINS_PER_JOB) {
+            CPrefetchJob job = {entry.nSequence, &entry, nBegin, std::min(nBegin + COINS_PER_JOB, entry.vCoins.size())};
+            setJobs.insert(job);
+            entry.nPendingJobs++;
+        }
+        condWork.notify_all();
+    }
+
+    void ReadCoins(const CPrefetchJob& job)
+    {
+        CPrefetchBlock& entry = *job.pentry;
+        bool fFailed = false;
+        try {
+            for (size_t i = job.nBegin; i < job.nEnd; i++) {
+                // A missing coin is left as the default, spent, Coin.
+                pcoinsdbview->GetCoin(entry.vCoins[i].first, entry.vCoins[i].second);
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: error reading coins of block %s: %s\n", __func__, entry.pindex->GetBlockHash().ToString(), e.what());
+            fFailed = true;
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            entry.fFailed |= fFailed;
+            if (--entry.nPendingJobs > 0)
+                return;
+        }
+
+        // Last job of this block: nobody else touches the entry until it is done.
+        std::map<COutPoint, Coin> mapCoins;
+        if (!entry.fFailed) {
+            for (auto& item : entry.vCoins)
+                mapCoins.insert(std::make_pair(item.first, std::move(item.second)));
+        }
+        std::vector<std::pair<COutPoint, Coin> >().swap(entry.vCoins);
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        entry.mapCoins.swap(mapCoins);
+        Finish(entry, entry.fFailed);
+    }
+
+    void Thread()
+    {
+        while (true) {
+            CPrefetchJob job;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (setJobs.empty() && !fStop)
+                    condWork.wait(lock);
+                if (fStop)
+                    return;
+                job = *setJobs.begin();
+                setJobs.erase(setJobs.begin());
+            }
+            if (job.nBegin == job.nEnd)
+                LoadBlock(*job.pentry);
+            else
+                ReadCoins(job);
+        }
+    }
+
+public:
+    CBlockPrefetcher(const Consensus::Params& params, int nThreadsIn) : consensusParams(params), nThreads(nThreadsIn), nNextSequence(0), fStop(false) {}
+
+    ~CBlockPrefetcher()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+            condWork.notify_all();
+        }
+        threads.join_all();
+    }
+
+    /**
+     * Queue the blocks in vpindex (given tip first, as built by
+     * ActivateBestChainStep) that are not queued yet. Must be called with
+     * cs_main held, so the flush generation recorded for them is current.
+     */
+    void Queue(const std::vector<CBlockIndex*>& vpindex, const CBlockIndex* pindexBlock, const std::shared_ptr<const CBlock>& pblock)
+    {
+        if (nThreads <= 0)
+            return;
+
+        boost::unique_lock<boost::mutex> lock(mutex);
+        BOOST_REVERSE_FOREACH(const CBlockIndex* pindex, vpindex) {
+            if (mapBlocks.count(pindex))
+                continue;
+            CPrefetchBlock& entry = mapBlocks[pindex];
+            entry.nSequence = nNextSequence++;
+            entry.nGeneration = nCoinsFlushGeneration;
+            entry.pindex = pindex;
+            if (pindex == pindexBlock)
+                entry.pblock = pblock;
+            entry.nPendingJobs = 0;
+            entry.fDone = false;
+            entry.fFailed = false;
+            CPrefetchJob job = {entry.nSequence, &entry, 0, 0};
+            setJobs.insert(job);
+        }
+        while ((int)threads.size() < nThreads)
+            threads.create_thread(boost::bind(&CBlockPrefetcher::Thread, this));
+        condWork.notify_all();
+    }
+
+    /**
+     * Wait for pindex to be prefetched and hand out its data. Coins are only
+     * returned if pcoinsTip has not been flushed since pindex was queued.
+     * Returns false if pindex was not queued or could not be read.
+     */
+    bool Get(const CBlockIndex* pindex, std::shared_ptr<const CBlock>& pblock, std::map<COutPoint, Coin>& mapCoins)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<const CBlockIndex*, CPrefetchBlock>::iterator it = mapBlocks.find(pindex);
+        if (it == mapBlocks.end())
+            return false;
+        while (!it->second.fDone)
+            condDone.wait(lock);
+
+        bool fRead = it->second.pblock != nullptr;
+        pblock = it->second.pblock;
+        if (!it->second.fFailed && it->second.nGeneration == nCoinsFlushGeneration)
+            mapCoins.swap(it->second.mapCoins);
+        mapBlocks.erase(it);
+        return fRead;
+    }
+};
+
 enum FlushStateMode {
     FLUSH_STATE_NONE,
     FLUSH_STATE_IF_NEEDED,
@@ -4281,8 +6500,16 @@ bool static FlushStateToDisk(CValidationState& state, FlushStateMode mode)
             // overwrite one. Still, use a conservative safety factor of 2.
             if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
                 return state.Error("out of disk space");
+            // Index changes a reorg holds back go first, so the indexes never
+            // end up on the other side of a fork from the chainstate.
+            if (pvIndexUpdateBatch && !WriteBlockIndexUpdates(*pvIndexUpdateBatch))
+                return AbortNode(state, "Failed to write block index batch");
             // Flush the chainstate (which may refer to block index entries).
-            if (!pcoinsTip->Flush())
+            bool fCoinsFlushed = pcoinsTip->Flush();
+            // Coins prefetched before this point may be stale now.
+            ++nCoinsFlushGeneration;
+            coinsSpentSinceFlush.Clear();
+            if (!fCoinsFlushed)
                 return AbortNode(state, "Failed to write to coin database");
 
             if (!pclueTip->Flush())
@@ -4305,6 +6532,8 @@ void FlushStateToDisk()
 {
     CValidationState state;
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
+    // Called at shutdown before pblocktree goes away
+    StopIndexWriter();
 }
 
 void PruneAndFlush()
@@ -4383,6 +6612,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
 
         assert(view.Flush());
         assert(clueview.Flush());
+        coinsSpentSinceFlush.AddBlock(block, true);
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
     uint256 saplingAnchorAfterDisconnect = pcoinsTip->GetBestAnchor(SAPLING);    // Write the chain state to disk, if necessary.
@@ -4422,6 +6652,195 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
     return true;
 }
 
+/** Blocks a reorg disconnects in one view before it is flushed into pcoinsTip */
+static const size_t MAX_REORG_BATCH_BLOCKS = 64;
+/** Blocks and undo data read ahead of the block being disconnected, per prefetch thread */
+static const size_t REORG_WINDOW_PER_THREAD = 4;
+
+/** A block DisconnectTips took off the chain state whose listeners are still to be told */
+struct CDisconnectedTip {
+    CBlockIndex* pindex;
+    std::shared_ptr<const CBlock> pblock;
+    uint256 saplingAnchorBefore;
+    uint256 saplingAnchorAfter;
+    SaplingMerkleTree saplingTree;
+};
+
+/**
+ * Disconnects the active blocks above a fork point, the multi-block
+ * counterpart of DisconnectTip. The prefetch threads read the blocks and
+ * their undo data ahead, the blocks are disconnected MAX_REORG_BATCH_BLOCKS
+ * at a time in one view on top of pcoinsTip, and only once a batch has been
+ * flushed are chainActive, the disconnect pool and the listeners updated,
+ * block by block as DisconnectTip does. cs_main stays held across batches:
+ * until the reorg is done the disconnected transactions are only in the
+ * disconnect pool, and a mempool or tip read in between would see neither
+ * chain.
+ */
+class CReorgDisconnector
+{
+private:
+    CValidationState& state;
+    const Consensus::Params& consensusParams;
+    DisconnectedBlockTransactions& disconnectpool;
+    std::vector<CBlockIndex*> vpindex;
+    const size_t nWindow;
+    std::vector<std::shared_ptr<CBlock> > vBlockSlot;
+    std::vector<CBlockUndo> vUndoSlot;
+    std::vector<char> vBlockRead;
+    std::vector<char> vUndoRead;
+    std::unique_ptr<CCoinsViewCache> pview;
+    std::unique_ptr<CClueViewCache> pclueview;
+    dev::h256 oldHashStateRoot;
+    dev::h256 oldHashUTXORoot;
+    std::vector<CDisconnectedTip> vDisconnected;
+    size_t nIndexUpdateMark;
+
+    /**
+     * Drop the batch in progress; the coins, the contract state and the index
+     * changes stay at the last flushed batch. The tandia and ad databases are
+     * written as blocks are disconnected and can't be rolled back, so a
+     * failure aborts the node.
+     */
+    bool Fail(const std::string& strMessage)
+    {
+        if (pview) {
+            globalState->setRoot(oldHashStateRoot); // qtum
+            globalState->setRootUTXO(oldHashUTXORoot); // qtum
+            if (pvIndexUpdateBatch && pvIndexUpdateBatch->size() > nIndexUpdateMark)
+                pvIndexUpdateBatch->erase(pvIndexUpdateBatch->begin() + nIndexUpdateMark, pvIndexUpdateBatch->end());
+        }
+        pview.reset();
+        pclueview.reset();
+        vDisconnected.clear();
+        return AbortNode(state, strMessage);
+    }
+
+    bool Commit()
+    {
+        int64_t nStart = GetTimeMicros();
+        bool fFlushed = pview->Flush();
+        assert(fFlushed);
+        fFlushed = pclueview->Flush();
+        assert(fFlushed);
+        for (const CDisconnectedTip& tip : vDisconnected)
+            coinsSpentSinceFlush.AddBlock(*tip.pblock, true);
+        pview.reset();
+        pclueview.reset();
+        LogPrint("bench", "- Disconnect %u blocks: %.2fms\n", vDisconnected.size(), (GetTimeMicros() - nStart) * 0.001);
+        // Write the chain state to disk, if necessary.
+        if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED)) {
+            vDisconnected.clear();
+            return false;
+        }
+
+        for (const CDisconnectedTip& tip : vDisconnected) {
+            const CBlock& block = *tip.pblock;
+            // Save transactions to re-add to mempool at end of reorg
+            for (auto it = block.vtx.rbegin(); it != block.vtx.rend(); ++it) {
+                disconnectpool.addTransaction(*it);
+            }
+
+            if (tip.saplingAnchorBefore != tip.saplingAnchorAfter) {
+                disconnectpool.saplingAnchorToRemove = tip.saplingAnchorBefore;
+            }
+
+            while (disconnectpool.DynamicMemoryUsage() > MAX_DISCONNECTED_TX_POOL_SIZE * 1000) {
+                // Drop the earliest entry, and remove its children from the mempool.
+                auto it = disconnectpool.queuedTx.get<insertion_order>().begin();
+                mempool.removeRecursive(**it, MemPoolRemovalReason::REORG);
+                disconnectpool.removeEntry(it);
+            }
+
+            // Update chainActive and related variables.
+            UpdateTip(tip.pindex->pprev);
+            // Let wallets know transactions went from 1-confirmed to
+            // 0-confirmed or conflicted:
+            for (int i = 0; i < block.vtx.size(); i++) {
+                GetMainSignals().SyncTransaction(block.vtx[i], tip.pindex, i);
+            }
+
+            // Update cached incremental witnesses
+            GetMainSignals().ChainTip(tip.pindex, &block, tip.saplingTree, false);
+        }
+        vDisconnected.clear();
+        return true;
+    }
+
+public:
+    CReorgDisconnector(CValidationState& stateIn, const Consensus::Params& consensusParamsIn, const CBlockIndex* pindexFork, DisconnectedBlockTransactions& disconnectpoolIn, int nThreads)
+        : state(stateIn), consensusParams(consensusParamsIn), disconnectpool(disconnectpoolIn), nWindow(std::max(nThreads, 1) * REORG_WINDOW_PER_THREAD),
+          vBlockSlot(nWindow), vUndoSlot(nWindow), vBlockRead(nWindow, 0), vUndoRead(nWindow, 0), nIndexUpdateMark(0)
+    {
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex != pindexFork; pindex = pindex->pprev)
+            vpindex.push_back(pindex);
+    }
+
+    size_t Size() const { return vpindex.size(); }
+    size_t Window() const { return nWindow; }
+
+    /** Read block i and its undo data; runs on the prefetch threads */
+    bool Read(size_t i)
+    {
+        size_t nSlot = i % nWindow;
+        const CBlockIndex* pindex = vpindex[i];
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        vBlockRead[nSlot] = ReadBlockFromDisk(*pblock, pindex, consensusParams);
+        vBlockSlot[nSlot] = pblock;
+        // DisconnectBlock reads the undo data again itself, and reports the
+        // error, if it could not be read here.
+        vUndoSlot[nSlot] = CBlockUndo();
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        vUndoRead[nSlot] = vBlockRead[nSlot] && !pos.IsNull() && UndoReadFromDisk(vUndoSlot[nSlot], pos, pindex->pprev->GetBlockHash());
+        return true;
+    }
+
+    /** Disconnect block i, in chain order; returns false on failure */
+    bool Deliver(size_t i)
+    {
+        size_t nSlot = i % nWindow;
+        CBlockIndex* pindex = vpindex[i];
+        if (!vBlockRead[nSlot])
+            return Fail("Failed to read block");
+
+        if (!pview) {
+            pview.reset(new CCoinsViewCache(pcoinsTip));
+            pclueview.reset(new CClueViewCache(pclueTip));
+            oldHashStateRoot = globalState->rootHash(); // qtum
+            oldHashUTXORoot = globalState->rootHashUTXO(); // qtum
+            nIndexUpdateMark = pvIndexUpdateBatch ? pvIndexUpdateBatch->size() : 0;
+        }
+
+        CDisconnectedTip tip;
+        tip.pindex = pindex;
+        tip.pblock = vBlockSlot[nSlot];
+        vBlockSlot[nSlot].reset();
+        tip.saplingAnchorBefore = pview->GetBestAnchor(SAPLING);
+        if (DisconnectBlock(*tip.pblock, state, pindex, *pview, *pclueview, false, vUndoRead[nSlot] ? &vUndoSlot[nSlot] : nullptr) != DISCONNECT_OK) {
+            return Fail(strprintf("DisconnectTip(): DisconnectBlock %s failed", pindex->GetBlockHash().ToString()));
+        }
+        // Get the current commitment tree
+        tip.saplingAnchorAfter = pview->GetBestAnchor(SAPLING);
+        assert(pview->GetSaplingAnchorAt(tip.saplingAnchorAfter, tip.saplingTree));
+        vDisconnected.push_back(tip);
+
+        if (vDisconnected.size() >= MAX_REORG_BATCH_BLOCKS || i + 1 == vpindex.size())
+            return Commit();
+        return true;
+    }
+};
+
+/** Disconnect the active blocks above pindexFork, see CReorgDisconnector */
+static bool DisconnectTips(CValidationState& state, const CChainParams& chainparams, const CBlockIndex* pindexFork, DisconnectedBlockTransactions& disconnectpool)
+{
+    int nThreads = GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS);
+    CReorgDisconnector disconnector(state, chainparams.GetConsensus(), pindexFork, disconnectpool, nThreads);
+    boost::function<bool(size_t)> read = boost::bind(&CReorgDisconnector::Read, &disconnector, _1);
+    COrderedJobRunner runner(disconnector.Size(), disconnector.Window(), read);
+    runner.Run(nThreads, boost::bind(&CReorgDisconnector::Deliver, &disconnector, _1));
+    return chainActive.Tip() == pindexFork;
+}
+
 static int64_t nTimeReadFromDisk = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
@@ -4440,12 +6859,18 @@ struct ConnectTrace {
  * Connect a new block to chainActive. pblock is either NULL or a pointer to a CBlock
  * corresponding to pindexNew, to bypass loading it again from disk.
  */
-bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool)
+bool static ConnectTip(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexNew, const std::shared_ptr<const CBlock>& pblock, ConnectTrace& connectTrace, DisconnectedBlockTransactions& disconnectpool, CBlockPrefetcher* prefetcher = nullptr)
 {
     assert(pindexNew->pprev == chainActive.Tip());
-    // Read block from disk.
+    // Read block from disk, unless the prefetcher already did.
     int64_t nTime1 = GetTimeMicros();
-    if (!pblock) {
+    std::shared_ptr<const CBlock> pblockPrefetched;
+    std::map<COutPoint, Coin> mapCoinsPrefetched;
+    if (prefetcher && !prefetcher->Get(pindexNew, pblockPrefetched, mapCoinsPrefetched))
+        pblockPrefetched.reset();
+    if (!pblock && pblockPrefetched) {
+        connectTrace.blocksConnected.emplace_back(pindexNew, pblockPrefetched);
+    } else if (!pblock) {
         std::shared_ptr<CBlock> pblockNew = std::make_shared<CBlock>();
         connectTrace.blocksConnected.emplace_back(pindexNew, pblockNew);
         if (!ReadBlockFromDisk(*pblockNew, pindexNew, chainparams.GetConsensus()))
@@ -4464,7 +6889,8 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
     {
-        CCoinsViewCache view(pcoinsTip);
+        CCoinsViewPrefetched viewPrefetched(pcoinsTip, mapCoinsPrefetched);
+        CCoinsViewCache view(&viewPrefetched);
         CClueViewCache clueview(pclueTip);
 
         dev::h256 oldHashStateRoot(globalState->rootHash()); // qtum
@@ -4488,6 +6914,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
         assert(clueview.Flush());
+        coinsSpentSinceFlush.AddBlock(block, false);
     }
     int64_t nTime4 = GetTimeMicros();
     nTimeFlush += nTime4 - nTime3;
@@ -4594,7 +7021,7 @@ static void PruneBlockIndexCandidates()
  * Try to make some progress towards making pindexMostWork the active block.
  * pblock is either NULL or a pointer to a CBlock corresponding to pindexMostWork.
  */
-static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace)
+static bool ActivateBestChainStep(CValidationState& state, const CChainParams& chainparams, CBlockIndex* pindexMostWork, const std::shared_ptr<const CBlock>& pblock, bool& fInvalidFound, ConnectTrace& connectTrace, CBlockPrefetcher* prefetcher)
 {
     AssertLockHeld(cs_main);
     const CBlockIndex* pindexOldTip = chainActive.Tip();
@@ -4602,6 +7029,17 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
 
     bool fBlocksDisconnected = false;
     DisconnectedBlockTransactions disconnectpool;
+    // A reorg of more than one block disconnects in batches and commits the
+    // index changes of the whole step at once.
+    std::unique_ptr<CBlockIndexUpdateBatch> pindexBatch;
+    if (chainActive.Tip() && chainActive.Tip() != pindexFork && chainActive.Tip()->pprev != pindexFork) {
+        pindexBatch.reset(new CBlockIndexUpdateBatch());
+        if (!DisconnectTips(state, chainparams, pindexFork, disconnectpool)) {
+            UpdateMempoolForReorg(disconnectpool, false);
+            return false;
+        }
+        fBlocksDisconnected = true;
+    }
     // Disconnect active blocks which are no longer in the best chain.
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
         if (!DisconnectTip(state, chainparams.GetConsensus(), &disconnectpool)) {
@@ -4630,10 +7068,14 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
         }
         nHeight = nTargetHeight;
 
+        // Start reading the blocks and their coins in the background.
+        if (prefetcher)
+            prefetcher->Queue(vpindexToConnect, pindexMostWork, pblock);
+
         // Connect new blocks.
 
         BOOST_REVERSE_FOREACH(CBlockIndex * pindexConnect, vpindexToConnect) {
-            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : nullptr, connectTrace, disconnectpool)) {
+            if (!ConnectTip(state, chainparams, pindexConnect, pindexConnect == pindexMostWork ? pblock : nullptr, connectTrace, disconnectpool, prefetcher)) {
                 if (state.IsInvalid()) {
                     // The block violates a consensus rule.
                     if (!state.CorruptionPossible())
@@ -4653,7 +7095,9 @@ static bool ActivateBestChainStep(CValidationState& state, const CChainParams& c
                 }
             } else {
                 PruneBlockIndexCandidates();
-                if (!pindexOldTip || chainActive.Tip()->nChainWork > pindexOldTip->nChainWork) {
+                // After a reorg keep going to pindexMostWork, so the disconnected
+                // transactions are re-accepted once, against the final tip.
+                if (!fBlocksDisconnected && (!pindexOldTip || chainActive.Tip()->nChainWork > pindexOldTip->nChainWork)) {
                     // We're in a better position than we were. Return temporarily to release the lock.
                     fContinue = false;
                     break;
@@ -4715,6 +7159,9 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
 
     CBlockIndex* pindexNewTip = nullptr;
     CBlockIndex* pindexMostWork = nullptr;
+    // Lives across the steps below, so blocks queued by one step are still
+    // being read while the previous ones are connected.
+    CBlockPrefetcher prefetcher(chainparams.GetConsensus(), GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS));
     do {
         boost::this_thread::interruption_point();
 
@@ -4743,7 +7190,7 @@ bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams,
                 return true;
 
             bool fInvalidFound = false;
-            if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : nullptr, fInvalidFound, connectTrace))
+            if (!ActivateBestChainStep(state, chainparams, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : nullptr, fInvalidFound, connectTrace, &prefetcher))
                 return false;
 
             if (fInvalidFound) {
@@ -5281,11 +7728,27 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const int nHeight = pindexPrev == nullptr ? 0 : pindexPrev->nHeight + 1;
     const CChainParams& chainParams = Params();
 
+    // Verify the Sapling proofs of all shielded transactions on the connect
+    // check threads first. If any of them fails, fall back to checking every
+    // transaction serially below so the rejection reason is the same as before.
+    bool fProofsVerified = false;
+    if (nConnectCheckThreads > 0) {
+        CCheckQueueControl<CConnectCheck> control(&connectcheckqueue);
+        std::vector<CConnectCheck> vChecks;
+        for (const auto& tx : block.vtx) {
+            if (!tx->vShieldedSpend.empty() || !tx->vShieldedOutput.empty())
+                vChecks.push_back(CConnectCheck(boost::bind(&CheckShieldedProofsWorker, tx.get())));
+        }
+        control.Add(vChecks);
+        fProofsVerified = control.Wait();
+    }
+
     // Check that all transactions are finalized
     for (const auto& tx : block.vtx) {
 
         // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(*tx, state, nHeight, 100)) {
+        if (fProofsVerified ? !ContextualCheckTransactionWithoutProofVerification(*tx, state, nHeight, 100)
+                            : !ContextualCheckTransaction(*tx, state, nHeight, 100)) {
             return false; // Failure reason has been set in validation state object
         }
 
@@ -5317,7 +7780,8 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex)
+/** fCheckedHeader: the caller already ran CheckBlockHeader on this header */
+static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fCheckedHeader = false)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -5335,7 +7799,7 @@ static bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state
             return true;
         }
 
-        if (!CheckBlockHeader(block, state))
+        if (!fCheckedHeader && !CheckBlockHeader(block, state))
             return false;
 
         // Get prev block index
@@ -5383,7 +7847,8 @@ bool ProcessNewBlockHeaders(const std::vector<CBlockHeader>& headers, CValidatio
     return true;
 }
 
-static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock)
+/** fChecked: the caller already ran CheckBlock on this block and it passed */
+static bool AcceptBlock(const CBlock& block, CValidationState& state, const CChainParams& chainparams, CBlockIndex** ppindex, bool fRequested, const CDiskBlockPos* dbp, bool* fNewBlock, bool fChecked = false)
 {
     if (fNewBlock) *fNewBlock = false;
     AssertLockHeld(cs_main);
@@ -5391,7 +7856,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
     CBlockIndex* pindexDummy = nullptr;
     CBlockIndex*& pindex = ppindex ? *ppindex : pindexDummy;
 
-    if (!AcceptBlockHeader(block, state, chainparams, &pindex))
+    if (!AcceptBlockHeader(block, state, chainparams, &pindex, fChecked))
         return false;
 
     // Try to process all requested blocks that we don't have, but only
@@ -5420,7 +7885,7 @@ static bool AcceptBlock(const CBlock& block, CValidationState& state, const CCha
 
     // See method docstring for why this is always disabled
     auto verifier = libzcash::ProofVerifier::Disabled();
-    if ((!CheckBlock(block, state, verifier)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!fChecked && !CheckBlock(block, state, verifier)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -5588,6 +8053,8 @@ void UnlinkPrunedFiles(std::set<int>& setFilesToPrune)
 {
     for (set<int>::iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
         CDiskBlockPos pos(*it, 0);
+        blockFileHandles.Close(*it);
+        blockFileMappings.Drop(*it);
         boost::filesystem::remove(GetBlockPosFilename(pos, "blk"));
         boost::filesystem::remove(GetBlockPosFilename(pos, "rev"));
         LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
@@ -5712,64 +8179,371 @@ CBlockIndex* InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+/** The last checkpoint and its stored ancestors, left to ThreadVerifyBlockIndexPoW by LoadBlockIndexDB */
+static std::vector<CBlockIndex*> vBlockIndexPoWDeferred;
+
+static void CheckBlockIndexPoWRange(const std::vector<CBlockIndex*>* pvpindex, size_t nBegin, size_t nEnd, std::atomic<bool>* pfFailed)
 {
-    const CChainParams& chainparams = Params();
-    if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex))
+    for (size_t i = nBegin; i < nEnd && !*pfFailed; i++) {
+        const CBlockIndex* pindex = (*pvpindex)[i];
+        if (!CheckProofOfWork(pindex->GetBlockHeader().GetPoWHash(), pindex->nBits, Params().GetConsensus())) {
+            error("LoadBlockIndex(): CheckProofOfWork failed: %s", pindex->ToString());
+            *pfFailed = true;
+        }
+    }
+}
+
+/** Check the proof of work of the stored headers in vpindex, split over nThreads threads */
+static bool CheckBlockIndexPoW(const std::vector<CBlockIndex*>& vpindex, int nThreads)
+{
+    std::atomic<bool> fFailed(false);
+    if (nThreads <= 1 || vpindex.size() < 1000) {
+        CheckBlockIndexPoWRange(&vpindex, 0, vpindex.size(), &fFailed);
+        return !fFailed;
+    }
+
+    boost::thread_group threads;
+    size_t nShard = (vpindex.size() + nThreads - 1) / nThreads;
+    for (size_t nBegin = 0; nBegin < vpindex.size(); nBegin += nShard)
+        threads.create_thread(boost::bind(&CheckBlockIndexPoWRange, &vpindex, nBegin, std::min(nBegin + nShard, vpindex.size()), &fFailed));
+    threads.join_all();
+    return !fFailed;
+}
+
+/**
+ * Check the proof of work of the headers just loaded into mapBlockIndex, from
+ * the block tree database or the snapshot.
+ */
+static bool CheckLoadedBlockIndexPoW(const CChainParams& chainparams, const std::vector<CBlockIndex*>& vLoaded)
+{
+    // Every stored header was accepted with a valid proof of work once. The
+    // last checkpoint and its ancestors are checked again in the background:
+    // the entries are keyed by the hash of their header and linked by
+    // hashPrev, so they are the headers the checkpoint hash commits to. The
+    // stored nHeight is not checked yet and is not used here. All other
+    // headers are checked here on all cores.
+    std::set<CBlockIndex*> setTrusted;
+    vBlockIndexPoWDeferred.clear();
+    if (fCheckpointsEnabled && GetBoolArg("-deferindexpow", DEFAULT_DEFER_INDEX_POW) && !chainparams.Checkpoints().mapCheckpoints.empty()) {
+        BlockMap::iterator mi = mapBlockIndex.find(chainparams.Checkpoints().mapCheckpoints.rbegin()->second);
+        for (CBlockIndex* pindex = mi != mapBlockIndex.end() ? mi->second : nullptr; pindex; pindex = pindex->pprev) {
+            setTrusted.insert(pindex);
+            vBlockIndexPoWDeferred.push_back(pindex);
+        }
+    }
+    std::vector<CBlockIndex*> vCheck;
+    BOOST_FOREACH(CBlockIndex* pindex, vLoaded) {
+        if (!setTrusted.count(pindex))
+            vCheck.push_back(pindex);
+    }
+    if (!CheckBlockIndexPoW(vCheck, boost::thread::hardware_concurrency()))
         return false;
+    LogPrintf("LoadBlockIndexDB(): checked the proof of work of %u headers, %u left to the background\n", vCheck.size(), vBlockIndexPoWDeferred.size());
+    return true;
+}
 
-    boost::this_thread::interruption_point();
+void ThreadVerifyBlockIndexPoW()
+{
+    RenameThread("vds-powverify");
+    std::vector<CBlockIndex*> vpindex;
+    {
+        LOCK(cs_main);
+        vpindex.swap(vBlockIndexPoWDeferred);
+    }
+    if (vpindex.empty())
+        return;
+
+    int64_t nStart = GetTimeMillis();
+    for (size_t i = 0; i < vpindex.size(); i++) {
+        if (i % 1000 == 0)
+            boost::this_thread::interruption_point();
+        const CBlockIndex* pindex = vpindex[i];
+        if (!CheckProofOfWork(pindex->GetBlockHeader().GetPoWHash(), pindex->nBits, Params().GetConsensus())) {
+            error("%s: CheckProofOfWork failed: %s", __func__, pindex->ToString());
+            AbortNode("Corrupted block index detected", _("Corrupted block database detected. Please restart with -reindex."));
+            return;
+        }
+    }
+    LogPrintf("%s: checked the proof of work of %u stored headers, %dms\n", __func__, vpindex.size(), GetTimeMillis() - nStart);
+}
+
+/**
+ * Order the entries of mapBlockIndex by height. A parent is always one block
+ * lower than its children, so bucketing the entries by height orders them
+ * topologically in linear time.
+ */
+static void SortBlockIndexByHeight(std::vector<CBlockIndex*>& vSortedByHeight)
+{
+    int nMaxHeight = 0;
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        nMaxHeight = std::max(nMaxHeight, item.second->nHeight);
+    std::vector<size_t> vHeightStart(nMaxHeight + 2, 0);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        vHeightStart[item.second->nHeight + 1]++;
+    for (int nHeight = 1; nHeight <= nMaxHeight + 1; nHeight++)
+        vHeightStart[nHeight] += vHeightStart[nHeight - 1];
+    vSortedByHeight.assign(mapBlockIndex.size(), nullptr);
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex)
+        vSortedByHeight[vHeightStart[item.second->nHeight]++] = item.second;
+}
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
+static const uint64_t BLOCK_INDEX_SNAPSHOT_VERSION = 1;
 
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*) & item, mapBlockIndex) {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+static boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+/**
+ * Load mapBlockIndex from the snapshot DumpBlockIndexSnapshot wrote, if it
+ * still matches the block tree database and the chainstate. The entries come
+ * back in height order with their chain work, chain tx counts and clue
+ * amounts already filled in; their proof of work is left to the caller.
+ */
+static bool LoadBlockIndexSnapshot(std::vector<CBlockIndex*>& vSortedByHeight)
+{
+    uint256 idSnapshot;
+    if (!mapBlockIndex.empty() || !pblocktree->ReadIndexSnapshotId(idSnapshot))
+        return false;
+
+    FILE* filestr = fsbridge::fopen(GetBlockIndexSnapshotPath(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return false;
+    setvbuf(file.Get(), nullptr, _IOFBF, 1 << 22);
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<CBlockIndex*> vLoaded;
+    std::vector<uint256> vHash;
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != BLOCK_INDEX_SNAPSHOT_VERSION)
+            return false;
+        uint256 id;
+        uint256 hashBestCoins;
+        file >> id;
+        file >> hashBestCoins;
+        if (id != idSnapshot || hashBestCoins != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: block index snapshot is stale, loading the block index database\n", __func__);
+            return false;
+        }
+        uint64_t num;
+        file >> num;
+        vLoaded.reserve(num);
+        vHash.reserve(num);
+        while (vLoaded.size() < num) {
+            uint256 hash;
+            int32_t nPrev;
+            CDiskBlockIndex diskindex;
+            uint256 nChainWork;
+            uint64_t nChainTx;
+            uint64_t nChainClueTx;
+            int64_t nClueLeft;
+            bool fChainSaplingValue;
+            CAmount nChainSaplingValue;
+            file >> hash;
+            file >> nPrev;
+            file >> diskindex;
+            file >> nChainWork;
+            file >> nChainTx;
+            file >> nChainClueTx;
+            file >> nClueLeft;
+            file >> fChainSaplingValue;
+            file >> nChainSaplingValue;
+            if (nPrev >= (int32_t)vLoaded.size())
+                throw std::runtime_error("parent after child");
+            // The proof of work and checkpoint checks rely on entries that are
+            // keyed by their header hash and linked by hashPrev.
+            if (diskindex.GetBlockHash() != hash || diskindex.hashPrev != (nPrev >= 0 ? vHash[nPrev] : uint256()))
+                throw std::runtime_error("entry does not match its header");
+
+            CBlockIndex* pindexNew = new CBlockIndex();
+            vLoaded.push_back(pindexNew);
+            vHash.push_back(hash);
+            pindexNew->pprev = nPrev >= 0 ? vLoaded[nPrev] : nullptr;
+            pindexNew->nHeight = diskindex.nHeight;
+            pindexNew->nFile = diskindex.nFile;
+            pindexNew->nDataPos = diskindex.nDataPos;
+            pindexNew->nUndoPos = diskindex.nUndoPos;
+            pindexNew->nDebtTandia = diskindex.nDebtTandia;
+            pindexNew->nHeightTandiaPaid = diskindex.nHeightTandiaPaid;
+            pindexNew->nLastPaidTandia = diskindex.nLastPaidTandia;
+            pindexNew->nVersion = diskindex.nVersion;
+            pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+            pindexNew->hashFinalSaplingRoot = diskindex.hashFinalSaplingRoot;
+            pindexNew->nVibPool = diskindex.nVibPool;
+            pindexNew->nTime = diskindex.nTime;
+            pindexNew->nBits = diskindex.nBits;
+            pindexNew->nNonce = diskindex.nNonce;
+            pindexNew->hashStateRoot = diskindex.hashStateRoot;
+            pindexNew->hashUTXORoot = diskindex.hashUTXORoot;
+            pindexNew->nSolution = diskindex.nSolution;
+            pindexNew->nStatus = diskindex.nStatus;
+            pindexNew->nTx = diskindex.nTx;
+            pindexNew->nClueTx = diskindex.nClueTx;
+            pindexNew->nChainWork = UintToArith256(nChainWork);
+            pindexNew->nChainTx = nChainTx;
+            pindexNew->nChainClueTx = nChainClueTx;
+            pindexNew->nClueLeft = nClueLeft;
+            if (fChainSaplingValue)
+                pindexNew->nChainSaplingValue = nChainSaplingValue;
+        }
+    } catch (const std::exception& e) {
+        LogPrintf("%s: failed to read block index snapshot: %s\n", __func__, e.what());
+        BOOST_FOREACH(CBlockIndex* pindex, vLoaded)
+            delete pindex;
+        return false;
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
 
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*) & item, vSortedByHeight) {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        // We can link the chain of blocks for which we've received transactions at some point.
-        // Pruned nodes may have deleted the block.
-        if (pindex->nTx > 0) {
+    mapBlockIndex.reserve(vLoaded.size());
+    for (size_t i = 0; i < vLoaded.size(); i++) {
+        BlockMap::iterator mi = mapBlockIndex.insert(make_pair(vHash[i], vLoaded[i])).first;
+        vLoaded[i]->phashBlock = &((*mi).first);
+    }
+    vSortedByHeight.swap(vLoaded);
+    LogPrintf("%s: loaded %u block index entries from the snapshot, %dms\n", __func__, vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpBlockIndexSnapshot()
+{
+    LOCK(cs_main);
+    if (!setDirtyBlockIndex.empty()) {
+        LogPrintf("%s: block index is not flushed, not writing a snapshot\n", __func__);
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    std::vector<CBlockIndex*> vSortedByHeight;
+    SortBlockIndexByHeight(vSortedByHeight);
+    std::map<const CBlockIndex*, int32_t> mapPos;
+    uint256 id = GetRandHash();
+
+    try {
+        FILE* filestr = fsbridge::fopen(GetDataDir() / "blocks" / "index.snapshot.new", "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        setvbuf(file.Get(), nullptr, _IOFBF, 1 << 22);
+
+        uint64_t version = BLOCK_INDEX_SNAPSHOT_VERSION;
+        file << version;
+        file << id;
+        file << pcoinsTip->GetBestBlock();
+        file << (uint64_t)vSortedByHeight.size();
+        for (size_t i = 0; i < vSortedByHeight.size(); i++) {
+            const CBlockIndex* pindex = vSortedByHeight[i];
+            int32_t nPrev = -1;
             if (pindex->pprev) {
-                if (pindex->nHeight % chainparams.BlockCountOfWeek() == 0) {
-                    if (pindex->nHeight >= chainparams.BlockCountOf1stSeason()) {
-                        CAmount nLeft = GetBlockClueSubsidy(pindex->nHeight, chainparams.GetConsensus(), false) - GetBlockSubsidy(pindex->nHeight, Params().GetConsensus());
-                        if ( nLeft > 0) {
-                            pindex->nClueLeft = nLeft;
-                        }
-                    } else {
-                        pindex->nClueLeft = 0;
+                std::map<const CBlockIndex*, int32_t>::const_iterator it = mapPos.find(pindex->pprev);
+                if (it != mapPos.end())
+                    nPrev = it->second;
+            }
+            mapPos[pindex] = i;
+            file << pindex->GetBlockHash();
+            file << nPrev;
+            file << CDiskBlockIndex(pindex);
+            file << ArithToUint256(pindex->nChainWork);
+            file << (uint64_t)pindex->nChainTx;
+            file << (uint64_t)pindex->nChainClueTx;
+            file << (int64_t)pindex->nClueLeft;
+            file << (bool)pindex->nChainSaplingValue;
+            file << (CAmount)(pindex->nChainSaplingValue ? *pindex->nChainSaplingValue : 0);
+        }
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "blocks" / "index.snapshot.new", GetBlockIndexSnapshotPath());
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to write block index snapshot: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    // Only valid once the database points at it.
+    if (!pblocktree->WriteIndexSnapshotId(id))
+        return false;
+    LogPrintf("Dumped block index snapshot: %u entries, %dms\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+/**
+ * Fill in nChainWork, nChainTx, nChainClueTx, nChainSaplingValue and
+ * nClueLeft of a loaded block index entry from its parent, which must be
+ * done already.
+ */
+static void CalculateBlockIndexChainState(CBlockIndex* pindex, const CChainParams& chainparams)
+{
+    pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+    // We can link the chain of blocks for which we've received transactions at some point.
+    // Pruned nodes may have deleted the block.
+    if (pindex->nTx > 0) {
+        if (pindex->pprev) {
+            if (pindex->nHeight % chainparams.BlockCountOfWeek() == 0) {
+                if (pindex->nHeight >= chainparams.BlockCountOf1stSeason()) {
+                    CAmount nLeft = GetBlockClueSubsidy(pindex->nHeight, chainparams.GetConsensus(), false) - GetBlockSubsidy(pindex->nHeight, Params().GetConsensus());
+                    if ( nLeft > 0) {
+                        pindex->nClueLeft = nLeft;
                     }
                 } else {
-                    pindex->nClueLeft = (pindex->pprev ? pindex->pprev->nClueLeft : 0);
+                    pindex->nClueLeft = 0;
                 }
+            } else {
+                pindex->nClueLeft = (pindex->pprev ? pindex->pprev->nClueLeft : 0);
+            }
 
-                if (pindex->pprev->nChainTx) {
-                    pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
-                    pindex->nChainClueTx = pindex->pprev->nChainClueTx + pindex->nClueTx;
-                    if (pindex->pprev->nChainSaplingValue) {
-                        pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
-                    } else {
-                        pindex->nChainSaplingValue = boost::none;
-                    }
+            if (pindex->pprev->nChainTx) {
+                pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
+                pindex->nChainClueTx = pindex->pprev->nChainClueTx + pindex->nClueTx;
+                if (pindex->pprev->nChainSaplingValue) {
+                    pindex->nChainSaplingValue = *pindex->pprev->nChainSaplingValue + pindex->nSaplingValue;
                 } else {
-                    pindex->nChainTx = 0;
-                    pindex->nChainClueTx = 0;
                     pindex->nChainSaplingValue = boost::none;
-                    mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
                 }
             } else {
-                pindex->nChainTx = pindex->nTx;
-                pindex->nChainSaplingValue = pindex->nSaplingValue;
-                pindex->nChainClueTx = pindex->nChainClueTx;
+                pindex->nChainTx = 0;
+                pindex->nChainClueTx = 0;
+                pindex->nChainSaplingValue = boost::none;
+                mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
             }
+        } else {
+            pindex->nChainTx = pindex->nTx;
+            pindex->nChainSaplingValue = pindex->nSaplingValue;
+            pindex->nChainClueTx = pindex->nChainClueTx;
         }
+    }
+}
+
+bool static LoadBlockIndexDB()
+{
+    const CChainParams& chainparams = Params();
+    std::vector<CBlockIndex*> vSortedByHeight;
+    bool fSnapshot = GetBoolArg("-indexsnapshot", DEFAULT_INDEX_SNAPSHOT) && LoadBlockIndexSnapshot(vSortedByHeight);
+    if (fSnapshot) {
+        if (!CheckLoadedBlockIndexPoW(chainparams, vSortedByHeight))
+            return false;
+    } else {
+        std::vector<CBlockIndex*> vLoaded;
+        if (!pblocktree->LoadBlockIndexGuts(InsertBlockIndex, &vLoaded))
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        if (!CheckLoadedBlockIndexPoW(chainparams, vLoaded))
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        SortBlockIndexByHeight(vSortedByHeight);
+    }
+
+    boost::this_thread::interruption_point();
+
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight) {
+        if (!fSnapshot)
+            CalculateBlockIndexChainState(pindex, chainparams);
+        else if (pindex->nTx > 0 && pindex->pprev && !pindex->pprev->nChainTx)
+            mapBlocksUnlinked.insert(std::make_pair(pindex->pprev, pindex));
         if (!(pindex->nStatus & BLOCK_FAILED_MASK) && pindex->pprev && (pindex->pprev->nStatus & BLOCK_FAILED_MASK)) {
             pindex->nStatus |= BLOCK_FAILED_CHILD;
             setDirtyBlockIndex.insert(pindex);
@@ -5832,6 +8606,10 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("%s: transaction index %s\n", __func__, fTxIndex ? "enabled" : "disabled");
 
+    // Databases created before the address UTXO index only have it from some height on
+    pblocktree->ReadFlag("addressutxoheight", fAddressUtxoHeightIndex);
+    LogPrintf("%s: address utxo index %s\n", __func__, fAddressUtxoHeightIndex ? "enabled" : "disabled");
+
     // Fill in-memory data
 
     // Load pointer to end of best chain
@@ -5850,61 +8628,117 @@ bool static LoadBlockIndexDB()
 
     EnforceNodeDeprecation(chainActive.Height(), true);
 
+    // Index batches lost in a crash are written again from the blocks
+    if (!ReplayBlockIndexJournal(chainparams))
+        return false;
+
     return true;
 }
 
-CVerifyDB::CVerifyDB()
+/** Blocks read ahead of the one being delivered, per verification thread */
+static const size_t VERIFYDB_WINDOW_PER_THREAD = 8;
+/** Blocks disconnected or connected per cs_main lock by checks 3 and 4 */
+static const size_t VERIFYDB_BATCH_BLOCKS = 16;
+/** Blocks between writes of the verification checkpoint */
+static const int VERIFYDB_CHECKPOINT_INTERVAL = 1000;
+static const uint64_t VERIFYDB_CHECKPOINT_VERSION = 1;
+
+/**
+ * Progress of an interrupted VerifyDB. Checks 0 to 2 passed for the blocks of
+ * the chain ending in hashTip from nHeight up; a run with the same tip and
+ * settings continues below nHeight.
+ */
+struct CVerifyDBCheckpoint {
+    uint256 hashTip;
+    int nCheckLevel;
+    int nCheckDepth;
+    int nHeight;
+
+    CVerifyDBCheckpoint() : nCheckLevel(0), nCheckDepth(0), nHeight(0) {}
+};
+
+static boost::filesystem::path GetVerifyDBCheckpointPath()
 {
-    uiInterface.ShowProgress(_("Verifying Blocks..."), 0);
+    return GetDataDir() / "verifydb.checkpoint";
 }
 
-CVerifyDB::~CVerifyDB()
+static bool ReadVerifyDBCheckpoint(CVerifyDBCheckpoint& checkpoint)
 {
-    uiInterface.ShowProgress("", 100);
+    FILE* filestr = fsbridge::fopen(GetVerifyDBCheckpointPath(), "rb");
+    if (!filestr)
+        return false;
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != VERIFYDB_CHECKPOINT_VERSION)
+            return false;
+        file >> checkpoint.hashTip;
+        file >> checkpoint.nCheckLevel;
+        file >> checkpoint.nCheckDepth;
+        file >> checkpoint.nHeight;
+    } catch (const std::exception& e) {
+        LogPrintf("%s: failed to read verification checkpoint: %s\n", __func__, e.what());
+        return false;
+    }
+    return true;
 }
 
-bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview, CClueView* clueview, int nCheckLevel, int nCheckDepth)
+static void WriteVerifyDBCheckpoint(const CVerifyDBCheckpoint& checkpoint)
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == nullptr || chainActive.Tip()->pprev == nullptr)
-        return true;
+    try {
+        FILE* filestr = fsbridge::fopen(GetDataDir() / "verifydb.checkpoint.new", "wb");
+        if (!filestr)
+            return;
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file << VERIFYDB_CHECKPOINT_VERSION;
+        file << checkpoint.hashTip;
+        file << checkpoint.nCheckLevel;
+        file << checkpoint.nCheckDepth;
+        file << checkpoint.nHeight;
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(GetDataDir() / "verifydb.checkpoint.new", GetVerifyDBCheckpointPath());
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to write verification checkpoint: %s. Continuing anyway.\n", e.what());
+    }
+}
 
-    // Verify blocks in the best chain
-    if (nCheckDepth <= 0)
-        nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
-    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
-    CCoinsViewCache coins(coinsview);
-    CClueViewCache clues(clueview);
-    CBlockIndex* pindexState = chainActive.Tip();
-    CBlockIndex* pindexFailure = nullptr;
-    int nGoodTransactions = 0;
-    CValidationState state;
+static void RemoveVerifyDBCheckpoint()
+{
+    boost::system::error_code ec;
+    boost::filesystem::remove(GetVerifyDBCheckpointPath(), ec);
+}
 
-    ////////////////////////////////////////////////////////////////////////// // qtum
-    dev::h256 oldHashStateRoot(globalState->rootHash());
-    dev::h256 oldHashUTXORoot(globalState->rootHashUTXO());
-    QtumDGP qtumDGP(globalState.get(), fGettingValuesDGP);
-    //////////////////////////////////////////////////////////////////////////
+/** Checks 0 to 2 of VerifyDB over a snapshot of the best chain, tip first */
+struct CVerifyDBRange {
+    const CChainParams& chainparams;
+    int nCheckLevel;
+    int nCheckDepth;
+    int nTipHeight;
+    std::vector<CBlockIndex*> vpindex;
+    CVerifyDBCheckpoint checkpoint;
+    bool fInterrupted;
 
-    // No need to verify JoinSplits twice
-    auto verifier = libzcash::ProofVerifier::Disabled();
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev) {
-        boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying Blocks..."), std::max(1, std::min(99, (int) (((double) (chainActive.Height() - pindex->nHeight)) / (double) nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height() - nCheckDepth)
-            break;
+    CVerifyDBRange(const CChainParams& chainparamsIn, int nCheckLevelIn)
+        : chainparams(chainparamsIn), nCheckLevel(nCheckLevelIn), nCheckDepth(0), nTipHeight(0), fInterrupted(false) {}
+
+    /** Read block i and check it and its undo data; runs on the verification threads */
+    bool Check(size_t i)
+    {
+        const CBlockIndex* pindex = vpindex[i];
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
             return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 1: verify block validity
+        // No need to verify JoinSplits twice
+        auto verifier = libzcash::ProofVerifier::Disabled();
+        CValidationState state;
         if (nCheckLevel >= 1 && !CheckBlock(block, state, verifier))
             return error("VerifyDB(): *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
         // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
+        if (nCheckLevel >= 2) {
             CBlockUndo undo;
             CDiskBlockPos pos = pindex->GetUndoPos();
             if (!pos.IsNull()) {
@@ -5912,59 +8746,266 @@ bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview,
                     return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
             }
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
-            DisconnectResult res = DisconnectBlock(block, state, pindex, coins, clues);
-            if (res == DISCONNECT_FAILED) {
-                return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
+        return true;
+    }
+
+    /** Record that block i and every block above it passed; returns false to stop */
+    bool Deliver(size_t i)
+    {
+        const CBlockIndex* pindex = vpindex[i];
+        uiInterface.ShowProgress(_("Verifying Blocks..."), std::max(1, std::min(99, (int) (((double) (nTipHeight - pindex->nHeight)) / (double) nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
+        checkpoint.nHeight = pindex->nHeight;
+        if (ShutdownRequested()) {
+            fInterrupted = true;
+            WriteVerifyDBCheckpoint(checkpoint);
+            return false;
+        }
+        if ((i + 1) % VERIFYDB_CHECKPOINT_INTERVAL == 0)
+            WriteVerifyDBCheckpoint(checkpoint);
+        return true;
+    }
+};
+
+/**
+ * Checks 3 and 4 of VerifyDB: disconnect the tip blocks on a memory-only view
+ * of the coin database, then connect them again. Blocks are read outside
+ * cs_main and processed VERIFYDB_BATCH_BLOCKS at a time under it, so this can
+ * run next to the active chain (fBackground). If the coin database is
+ * flushed in the meantime the view is stale and the check is given up.
+ * The tandia votes are rolled back and forth with the blocks and restored at
+ * the end; as that state is shared with the active chain, a background check
+ * leaves the votes unchecked.
+ */
+static bool VerifyDBChainState(const CChainParams& chainparams, CCoinsView* coinsview, CClueView* clueview, int nCheckLevel, int nCheckDepth, bool fBackground)
+{
+    CBlockIndex* pindexTip = nullptr;
+    uint256 hashCoinsBest;
+    {
+        LOCK(cs_main);
+        pindexTip = chainActive.Tip();
+        hashCoinsBest = coinsview->GetBestBlock();
+    }
+    if (pindexTip == nullptr || pindexTip->pprev == nullptr)
+        return true;
+    if (hashCoinsBest != pindexTip->GetBlockHash()) {
+        LogPrintf("VerifyDB(): coin database is not at the tip, skipping checks 3 and 4\n");
+        return true;
+    }
+
+    CCoinsViewCache coins(coinsview);
+    CClueViewCache clues(clueview);
+    CTandiaCheckVotes votes(!fBackground);
+    CBlockIndex* pindexState = pindexTip;
+    CBlockIndex* pindexFailure = nullptr;
+    int nGoodTransactions = 0;
+    int nStopHeight = pindexTip->nHeight - nCheckDepth;
+    CValidationState state;
+
+    // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+    bool fCacheFull = false;
+    while (!fCacheFull && pindexState->pprev && pindexState->nHeight >= nStopHeight) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested())
+            return true;
 
-            pindexState = pindex->pprev;
+        std::vector<CBlock> vBlocks;
+        for (CBlockIndex* pindex = pindexState; pindex->pprev && pindex->nHeight >= nStopHeight && vBlocks.size() < VERIFYDB_BATCH_BLOCKS; pindex = pindex->pprev) {
+            vBlocks.push_back(CBlock());
+            if (!ReadBlockFromDisk(vBlocks.back(), pindex, chainparams.GetConsensus()))
+                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        }
+
+        LOCK(cs_main);
+        if (coinsview->GetBestBlock() != hashCoinsBest) {
+            LogPrintf("VerifyDB(): coin database was flushed, giving up checks 3 and 4\n");
+            return true;
+        }
+        CGlobalStateRootsRestorer restorer;
+        CTandiaCheckVotesScope votesScope(&votes);
+        for (const CBlock& block : vBlocks) {
+            if (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage() > nCoinCacheUsage) {
+                fCacheFull = true;
+                break;
+            }
+            DisconnectResult res = DisconnectBlock(block, state, pindexState, coins, clues, true);
+            if (res == DISCONNECT_FAILED)
+                return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindexState->nHeight, pindexState->GetBlockHash().ToString());
             if (res == DISCONNECT_UNCLEAN) {
                 nGoodTransactions = 0;
-                pindexFailure = pindex;
+                pindexFailure = pindexState;
             } else {
                 nGoodTransactions += block.vtx.size();
             }
+            pindexState = pindexState->pprev;
         }
-        if (ShutdownRequested())
+    }
+
+    if (pindexFailure)
+        return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", pindexTip->nHeight - pindexFailure->nHeight + 1, nGoodTransactions);
+
+    // check level 4: try reconnecting blocks
+    if (nCheckLevel >= 4) {
+        CBlockIndex* pindex = pindexState;
+        while (pindex != pindexTip) {
+            boost::this_thread::interruption_point();
+            if (ShutdownRequested())
+                return true;
+            if (!fBackground)
+                uiInterface.ShowProgress(_("Verifying Blocks..."), std::max(1, std::min(99, 100 - (int) (((double) (pindexTip->nHeight - pindex->nHeight)) / (double) nCheckDepth * 50))));
+
+            std::vector<CBlockIndex*> vpindex;
+            std::vector<CBlock> vBlocks;
+            for (int nHeight = pindex->nHeight + 1; nHeight <= pindexTip->nHeight && vBlocks.size() < VERIFYDB_BATCH_BLOCKS; nHeight++) {
+                vpindex.push_back(pindexTip->GetAncestor(nHeight));
+                vBlocks.push_back(CBlock());
+                if (!ReadBlockFromDisk(vBlocks.back(), vpindex.back(), chainparams.GetConsensus()))
+                    return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", nHeight, vpindex.back()->GetBlockHash().ToString());
+            }
+
+            LOCK(cs_main);
+            if (coinsview->GetBestBlock() != hashCoinsBest) {
+                LogPrintf("VerifyDB(): coin database was flushed, giving up checks 3 and 4\n");
+                return true;
+            }
+            CGlobalStateRootsRestorer restorer;
+            CTandiaCheckVotesScope votesScope(&votes);
+            for (size_t i = 0; i < vBlocks.size(); i++) {
+                pindex = vpindex[i];
+                // Connect on top of the contract state of the parent; a checked
+                // connect leaves the views and the block index alone.
+                dev::h256 prevHashStateRoot(dev::sha3(dev::rlp("")));
+                dev::h256 prevHashUTXORoot(dev::sha3(dev::rlp("")));
+                if (pindex->pprev->hashStateRoot != uint256() && pindex->pprev->hashUTXORoot != uint256()) {
+                    prevHashStateRoot = uintToh256(pindex->pprev->hashStateRoot);
+                    prevHashUTXORoot = uintToh256(pindex->pprev->hashUTXORoot);
+                }
+                globalState->setRoot(prevHashStateRoot); // qtum
+                globalState->setRootUTXO(prevHashUTXORoot); // qtum
+                if (!ConnectBlock(vBlocks[i], state, pindex, coins, clues, true))
+                    return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                coins.SetBestBlock(pindex->GetBlockHash());
+                clues.SetBestBlock(pindex->GetBlockHash());
+            }
+        }
+    }
+
+    votes.Restore();
+    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", pindexTip->nHeight - pindexState->nHeight, nGoodTransactions);
+    return true;
+}
+
+/** Checks 3 and 4 VerifyDB left to ThreadVerifyDBChainState (-verifybackground) */
+struct CVerifyDBDeferred {
+    CCoinsView* coinsview;
+    CClueView* clueview;
+    int nCheckLevel;
+    int nCheckDepth;
+};
+static CVerifyDBDeferred verifyDBDeferred = {nullptr, nullptr, 0, 0};
+
+CVerifyDB::CVerifyDB()
+{
+    uiInterface.ShowProgress(_("Verifying Blocks..."), 0);
+}
+
+CVerifyDB::~CVerifyDB()
+{
+    uiInterface.ShowProgress("", 100);
+}
+
+bool CVerifyDB::VerifyDB(const CChainParams& chainparams, CCoinsView* coinsview, CClueView* clueview, int nCheckLevel, int nCheckDepth)
+{
+    nCheckLevel = std::max(0, std::min(4, nCheckLevel));
+    CVerifyDBRange range(chainparams, nCheckLevel);
+    {
+        LOCK(cs_main);
+        if (chainActive.Tip() == nullptr || chainActive.Tip()->pprev == nullptr)
             return true;
-    }
-
-    if (pindexFailure)
-        return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
 
-    // check level 4: try reconnecting blocks
-    if (nCheckLevel >= 4) {
-        CBlockIndex* pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
-            boost::this_thread::interruption_point();
-            uiInterface.ShowProgress(_("Verifying Blocks..."), std::max(1, std::min(99, 100 - (int) (((double) (chainActive.Height() - pindex->nHeight)) / (double) nCheckDepth * 50))));
-            pindex = chainActive.Next(pindex);
-            CBlock block;
-            if (!ReadBlockFromDisk(block, pindex, chainparams.GetConsensus()))
-                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+        // Verify blocks in the best chain
+        if (nCheckDepth <= 0)
+            nCheckDepth = 1000000000; // suffices until the year 19000
+        if (nCheckDepth > chainActive.Height())
+            nCheckDepth = chainActive.Height();
+        range.nCheckDepth = nCheckDepth;
+        range.nTipHeight = chainActive.Height();
+        range.checkpoint.hashTip = chainActive.Tip()->GetBlockHash();
+        range.checkpoint.nCheckLevel = nCheckLevel;
+        range.checkpoint.nCheckDepth = nCheckDepth;
+        range.checkpoint.nHeight = range.nTipHeight + 1;
 
-            dev::h256 oldHashStateRoot(globalState->rootHash()); // qtum
-            dev::h256 oldHashUTXORoot(globalState->rootHashUTXO()); // qtum
+        // Pick up where an interrupted run with the same settings stopped
+        CVerifyDBCheckpoint checkpoint;
+        if (ReadVerifyDBCheckpoint(checkpoint) && checkpoint.hashTip == range.checkpoint.hashTip &&
+            checkpoint.nCheckLevel == nCheckLevel && checkpoint.nCheckDepth == nCheckDepth) {
+            LogPrintf("Resuming verification below height %d\n", checkpoint.nHeight);
+            range.checkpoint.nHeight = checkpoint.nHeight;
+        }
 
-            if (!ConnectBlock(block, state, pindex, coins, clues)) {
-                globalState->setRoot(oldHashStateRoot); // qtum
-                globalState->setRootUTXO(oldHashUTXORoot); // qtum
-                pstorageresult->clearCacheResult();
-                return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            }
+        for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev && pindex->nHeight >= range.nTipHeight - nCheckDepth; pindex = pindex->pprev) {
+            if (pindex->nHeight < range.checkpoint.nHeight)
+                range.vpindex.push_back(pindex);
         }
-    } else {
-        globalState->setRoot(oldHashStateRoot); // qtum
-        globalState->setRootUTXO(oldHashUTXORoot); // qtum
+    }
+    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+
+    // Checks 0 to 2 only need the block files, read and check them on a pool
+    int nThreads = GetArg("-verifythreads", DEFAULT_VERIFY_THREADS);
+    boost::function<bool(size_t)> check = boost::bind(&CVerifyDBRange::Check, &range, _1);
+    COrderedJobRunner runner(range.vpindex.size(), std::max(nThreads, 1) * VERIFYDB_WINDOW_PER_THREAD, check);
+    if (!runner.Run(nThreads, boost::bind(&CVerifyDBRange::Deliver, &range, _1)))
+        return false;
+    boost::this_thread::interruption_point();
+    if (range.fInterrupted)
+        return true;
+
+    if (nCheckLevel < 3) {
+        RemoveVerifyDBCheckpoint();
+        return true;
     }
 
-    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
+    // A restart now only has checks 3 and 4 left to do
+    range.checkpoint.nHeight = range.nTipHeight - nCheckDepth;
+    WriteVerifyDBCheckpoint(range.checkpoint);
+
+    if (GetBoolArg("-verifybackground", DEFAULT_VERIFY_BACKGROUND)) {
+        LOCK(cs_main);
+        verifyDBDeferred.coinsview = coinsview;
+        verifyDBDeferred.clueview = clueview;
+        verifyDBDeferred.nCheckLevel = nCheckLevel;
+        verifyDBDeferred.nCheckDepth = nCheckDepth;
+        return true;
+    }
 
+    if (!VerifyDBChainState(chainparams, coinsview, clueview, nCheckLevel, nCheckDepth, false))
+        return false;
+    if (!ShutdownRequested())
+        RemoveVerifyDBCheckpoint();
     return true;
 }
 
+void ThreadVerifyDBChainState()
+{
+    RenameThread("vds-verifydb");
+    CVerifyDBDeferred deferred;
+    {
+        LOCK(cs_main);
+        deferred = verifyDBDeferred;
+        verifyDBDeferred.nCheckLevel = 0;
+    }
+    if (deferred.nCheckLevel < 3)
+        return;
+
+    int64_t nStart = GetTimeMillis();
+    if (!VerifyDBChainState(Params(), deferred.coinsview, deferred.clueview, deferred.nCheckLevel, deferred.nCheckDepth, true)) {
+        AbortNode("Corrupted block database detected", _("Corrupted block database detected. Please restart with -reindex."));
+        return;
+    }
+    if (!ShutdownRequested())
+        RemoveVerifyDBCheckpoint();
+    LogPrintf("%s: done, %dms\n", __func__, GetTimeMillis() - nStart);
+}
+
 bool RewindBlockIndex(const CChainParams& params, bool& clearWitnessCaches)
 {
     LOCK(cs_main);
@@ -6068,6 +9109,9 @@ void UnloadBlockIndex()
 
 bool LoadBlockIndex()
 {
+    // Set up before anything enters the mempool
+    mempool.setClusterIndex(GetBoolArg("-mempoolclusters", DEFAULT_MEMPOOL_CLUSTERS), GetArg("-limitclustercount", DEFAULT_CLUSTER_LIMIT));
+
     // Load block index from databases
     if (!fReindex && !LoadBlockIndexDB())
         return false;
@@ -6090,6 +9134,10 @@ bool InitBlockIndex(const CChainParams& chainparams)
     fAddressIndex = GetBoolArg("-addressindex", DEFAULT_ADDRESSINDEX);
     pblocktree->WriteFlag("addressindex", fAddressIndex);
 
+    // The address UTXO index is built along with the chain
+    fAddressUtxoHeightIndex = true;
+    pblocktree->WriteFlag("addressutxoheight", fAddressUtxoHeightIndex);
+
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
     if (!fReindex) {
@@ -6116,29 +9164,139 @@ bool InitBlockIndex(const CChainParams& chainparams)
     return true;
 }
 
-bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp)
+/** Blocks scanned from a block file before they are parsed and accepted together */
+static const size_t REINDEX_CHUNK_BLOCKS = 64;
+/** Bytes of block file scanned per chunk; the file buffer can rewind this far */
+static const uint64_t REINDEX_CHUNK_SIZE = 32 * 1024 * 1024;
+
+/** A block read from a block file, parsed and pre-checked on the import threads */
+struct CImportBlock {
+    bool fHavePos;
+    CDiskBlockPos pos;
+    uint64_t nBlockPos;
+    uint64_t nRescanPos; //! where the scan resumes if the block turns out to be malformed
+    unsigned int nSize;
+    unsigned int nConsumed;
+    std::vector<char> vchData;
+    std::shared_ptr<const CBlock> pblock;
+    uint256 hash;
+    bool fChecked;
+    std::string strError;
+
+    CImportBlock() : fHavePos(false), nBlockPos(0), nRescanPos(0), nSize(0), nConsumed(0), fChecked(false) {}
+};
+
+/** A block whose parent was not known yet, kept in memory while the cache has room */
+struct CUnknownParentBlock {
+    CDiskBlockPos pos;
+    std::shared_ptr<const CBlock> pblock;
+    bool fChecked;
+    unsigned int nSize;
+};
+
+// Blocks with unknown parent (only used for reindex), kept across block files
+static std::multimap<uint256, CUnknownParentBlock> mapBlocksUnknownParent;
+static uint64_t nBlocksUnknownParentCached = 0;
+
+/**
+ * Imports one block file in chunks. The calling thread scans a chunk of raw
+ * blocks, the import threads deserialize and CheckBlock them, and the results
+ * are accepted in file order under cs_main. The chain is activated once per
+ * chunk instead of after every block.
+ */
+class CBlockFileImporter
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
-    int64_t nStart = GetTimeMillis();
+private:
+    const CChainParams& chainparams;
+    CBufferedFile& blkdat;
+    CDiskBlockPos* dbp;
+    const uint64_t nMaxCached;
+    std::vector<CImportBlock> vChunk;
 
-    int nLoaded = 0;
-    try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2 * MAX_BLOCK_SIZE, MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
+    void CacheUnknownParent(const CImportBlock& entry)
+    {
+        CUnknownParentBlock unknown;
+        unknown.pos = entry.pos;
+        unknown.fChecked = false;
+        unknown.nSize = entry.nSize;
+        if (nBlocksUnknownParentCached + entry.nSize <= nMaxCached) {
+            unknown.pblock = entry.pblock;
+            unknown.fChecked = entry.fChecked;
+            nBlocksUnknownParentCached += entry.nSize;
+        }
+        mapBlocksUnknownParent.insert(std::make_pair(entry.pblock->hashPrevBlock, unknown));
+    }
+
+    /** Recursively process earlier encountered successors of this block */
+    void ProcessChildren(const uint256& hash)
+    {
+        deque<uint256> queue;
+        queue.push_back(hash);
+        while (!queue.empty()) {
+            uint256 head = queue.front();
+            queue.pop_front();
+            std::pair<std::multimap<uint256, CUnknownParentBlock>::iterator, std::multimap<uint256, CUnknownParentBlock>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+            while (range.first != range.second) {
+                std::multimap<uint256, CUnknownParentBlock>::iterator it = range.first;
+                std::shared_ptr<const CBlock> pblock = it->second.pblock;
+                bool fChecked = it->second.fChecked;
+                if (!pblock) {
+                    std::shared_ptr<CBlock> pblockRead = std::make_shared<CBlock>();
+                    if (ReadBlockFromDisk(*pblockRead, it->second.pos, chainparams.GetConsensus()))
+                        pblock = pblockRead;
+                } else {
+                    nBlocksUnknownParentCached -= it->second.nSize;
+                }
+                if (pblock) {
+                    LogPrintf("%s: Processing out of order child %s of %s\n", "LoadExternalBlockFile", pblock->GetHash().ToString(),
+                              head.ToString());
+                    CValidationState dummy;
+                    LOCK(cs_main);
+                    if (AcceptBlock(*pblock, dummy, chainparams, nullptr, true, &it->second.pos, nullptr, fChecked)) {
+                        nLoaded++;
+                        queue.push_back(pblock->GetHash());
+                    }
+                }
+                range.first++;
+                mapBlocksUnknownParent.erase(it);
+            }
+        }
+    }
+
+public:
+    int nLoaded;
+    uint64_t nRewind;
+    /** Set when Deliver stopped a chunk and the file has to be scanned again from nRewind */
+    bool fRewind;
+    bool fAbort;
+
+    CBlockFileImporter(const CChainParams& chainparamsIn, CBufferedFile& blkdatIn, CDiskBlockPos* dbpIn, uint64_t nMaxCachedIn)
+        : chainparams(chainparamsIn), blkdat(blkdatIn), dbp(dbpIn), nMaxCached(nMaxCachedIn), nLoaded(0), nRewind(blkdatIn.GetPos()), fRewind(false), fAbort(false) {}
+
+    /** Scan the next chunk of blocks; returns false once no further block header can be found */
+    bool ReadChunk()
+    {
+        vChunk.clear();
+        vChunk.reserve(REINDEX_CHUNK_BLOCKS);
+        // Go back before the eof test, the last chunk may have read the file to its end
+        if (fRewind) {
+            blkdat.SetPos(nRewind);
+            fRewind = false;
+        }
+        while (!blkdat.eof() && vChunk.size() < REINDEX_CHUNK_BLOCKS) {
             boost::this_thread::interruption_point();
 
             blkdat.SetPos(nRewind);
             nRewind++; // start one byte further next time, in case of failure
             blkdat.SetLimit(); // remove former limit
             unsigned int nSize = 0;
+            uint64_t nHeaderPos = 0;
             try {
                 // locate a header
                 unsigned char buf[MESSAGE_START_SIZE];
                 blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos() + 1;
+                nHeaderPos = blkdat.GetPos();
+                nRewind = nHeaderPos + 1;
                 blkdat >> FLATDATA(buf);
                 if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
                     continue;
@@ -6148,77 +9306,161 @@ bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskB
                     continue;
             } catch (const std::exception&) {
                 // no valid block header found; don't complain
+                return false;
+            }
+            // Leave the block to the next chunk if the buffer could not rewind over it
+            if (!vChunk.empty() && blkdat.GetPos() + nSize - vChunk.front().nRescanPos > REINDEX_CHUNK_SIZE) {
+                nRewind = nHeaderPos;
                 break;
             }
             try {
                 // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
+                CImportBlock entry;
+                entry.nBlockPos = blkdat.GetPos();
+                entry.nRescanPos = nHeaderPos + 1;
+                entry.nSize = nSize;
+                if (dbp) {
+                    dbp->nPos = entry.nBlockPos;
+                    entry.fHavePos = true;
+                    entry.pos = *dbp;
+                }
+                blkdat.SetLimit(entry.nBlockPos + nSize);
+                entry.vchData.resize(nSize);
+                blkdat.read(&entry.vchData[0], nSize);
                 nRewind = blkdat.GetPos();
+                vChunk.push_back(std::move(entry));
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", "LoadExternalBlockFile", e.what());
+            }
+        }
+        return true;
+    }
 
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                             block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
+    size_t ChunkSize() const { return vChunk.size(); }
+
+    /** Deserialize and pre-check block i of the chunk; runs on the import threads */
+    bool Parse(size_t i)
+    {
+        CImportBlock& entry = vChunk[i];
+        std::shared_ptr<CBlock> pblock = std::make_shared<CBlock>();
+        try {
+            CDataStream ss(entry.vchData, SER_DISK, CLIENT_VERSION);
+            ss >> *pblock;
+            entry.nConsumed = entry.nSize - ss.size();
+        } catch (const std::exception& e) {
+            entry.strError = e.what();
+            return true;
+        }
+        std::vector<char>().swap(entry.vchData);
+        entry.hash = pblock->GetHash();
+
+        // See AcceptBlock for why this is always disabled
+        auto verifier = libzcash::ProofVerifier::Disabled();
+        CValidationState state;
+        entry.fChecked = CheckBlock(*pblock, state, verifier);
+        entry.pblock = pblock;
+        return true;
+    }
+
+    /** Accept block i of the chunk, in file order; returns false to stop the chunk */
+    bool Deliver(size_t i)
+    {
+        CImportBlock& entry = vChunk[i];
+        if (!entry.pblock) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", "LoadExternalBlockFile", entry.strError);
+            nRewind = entry.nRescanPos;
+            fRewind = true;
+            return false;
+        }
+
+        try {
+            const CBlock& block = *entry.pblock;
+            const uint256& hash = entry.hash;
+            bool fUnknownParent = false;
+            bool fProcess = false;
+            {
+                LOCK(cs_main);
+                fUnknownParent = hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end();
+                if (!fUnknownParent) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    fProcess = mi == mapBlockIndex.end() || (mi->second->nStatus & BLOCK_HAVE_DATA) == 0;
+                    if (!fProcess && hash != chainparams.GetConsensus().hashGenesisBlock && mi->second->nHeight % 1000 == 0)
+                        LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mi->second->nHeight);
                 }
+            }
 
+            if (fUnknownParent) {
+                // detect out of order blocks, and store them for later
+                LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", "LoadExternalBlockFile", hash.ToString(),
+                         block.hashPrevBlock.ToString());
+                if (entry.fHavePos)
+                    CacheUnknownParent(entry);
+            } else {
                 // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+                if (fProcess) {
                     LOCK(cs_main);
                     CValidationState state;
-                    if (AcceptBlock(block, state, chainparams, nullptr, true, dbp, nullptr))
+                    if (AcceptBlock(block, state, chainparams, nullptr, true, entry.fHavePos ? &entry.pos : nullptr, nullptr, entry.fChecked))
                         nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != chainparams.GetConsensus().hashGenesisBlock && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrint("reindex", "Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
-                }
-
-                {
-                    CValidationState state;
-                    if (!ActivateBestChain(state, chainparams)) {
-                        break;
+                    if (state.IsError()) {
+                        fAbort = true;
+                        return false;
                     }
                 }
+                ProcessChildren(hash);
+            }
+        } catch (const std::exception& e) {
+            LogPrintf("%s: Deserialize or I/O error - %s\n", "LoadExternalBlockFile", e.what());
+        }
+        entry.pblock.reset();
 
-                NotifyHeaderTip();
-
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second, chainparams.GetConsensus())) {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                      head.ToString());
-                            CValidationState dummy;
-                            LOCK(cs_main);
-                            if (AcceptBlock(block, dummy, chainparams, nullptr, true, &it->second, nullptr)) {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                        NotifyHeaderTip();
-                    }
-                }
-            } catch (const std::exception& e) {
-                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+        // A block shorter than its record: scan on right behind it
+        if (entry.nConsumed < entry.nSize) {
+            nRewind = entry.nBlockPos + entry.nConsumed;
+            fRewind = true;
+            return false;
+        }
+        return true;
+    }
+
+    /** Connect the blocks accepted so far */
+    bool Activate()
+    {
+        NotifyHeaderTip();
+        CValidationState state;
+        if (!ActivateBestChain(state, chainparams)) {
+            fAbort = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp)
+{
+    int64_t nStart = GetTimeMillis();
+    int nThreads = GetArg("-reindexthreads", DEFAULT_REINDEX_THREADS);
+    uint64_t nMaxCached = std::max(GetArg("-reindexcache", DEFAULT_REINDEX_CACHE), (int64_t)0) << 20;
+
+    int nLoaded = 0;
+    try {
+        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor.
+        // The buffer can rewind over a whole chunk so a malformed block can be scanned again.
+        CBufferedFile blkdat(fileIn, REINDEX_CHUNK_SIZE + 2 * (MAX_BLOCK_SIZE + 8), REINDEX_CHUNK_SIZE + MAX_BLOCK_SIZE + 8, SER_DISK, CLIENT_VERSION);
+        CBlockFileImporter importer(chainparams, blkdat, dbp, nMaxCached);
+        bool fMore = true;
+        while ((fMore || importer.fRewind) && !importer.fAbort) {
+            fMore = importer.ReadChunk();
+            if (importer.ChunkSize() > 0) {
+                boost::function<bool(size_t)> parse = boost::bind(&CBlockFileImporter::Parse, &importer, _1);
+                COrderedJobRunner runner(importer.ChunkSize(), importer.ChunkSize(), parse);
+                runner.Run(nThreads, boost::bind(&CBlockFileImporter::Deliver, &importer, _1));
+                nLoaded = importer.nLoaded;
+                if (importer.fAbort || !importer.Activate())
+                    break;
             }
+            if (blkdat.eof() && !importer.fRewind)
+                break;
         }
     } catch (const std::runtime_error& e) {
         AbortNode(std::string("System error: ") + e.what());
@@ -6653,6 +9895,233 @@ std::string CBlockFileInfo::ToString() const
 
 
 static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** mempool.dat that also records the tip, fee, sigop cost, gas and spent coins of every transaction */
+static const uint64_t MEMPOOL_DUMP_VERSION_SNAPSHOT = 2;
+
+/** A transaction of a snapshot mempool.dat, stored in the topological order of infoAll() */
+struct CMempoolSnapshotEntry {
+    CTransactionRef tx;
+    int64_t nTime;
+    int64_t nFeeDelta;
+    CAmount nFee;
+    int64_t nSigOpCost;
+    CAmount nMinGasPrice;
+    uint64_t nGasLimit;
+    std::vector<Coin> vCoins; //! The coins spent by tx.vin, parents in the mempool at MEMPOOL_HEIGHT
+    bool fVerified;           //! Scripts and shielded proofs were checked against vCoins
+
+    CMempoolSnapshotEntry() : nTime(0), nFeeDelta(0), nFee(0), nSigOpCost(0), nMinGasPrice(0), nGasLimit(0), fVerified(false) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action)
+    {
+        READWRITE(tx);
+        READWRITE(nTime);
+        READWRITE(nFeeDelta);
+        READWRITE(nFee);
+        READWRITE(nSigOpCost);
+        READWRITE(nMinGasPrice);
+        READWRITE(nGasLimit);
+        READWRITE(vCoins);
+    }
+};
+
+/**
+ * Add a snapshot transaction whose scripts and proofs are already checked. Only the
+ * cheap checks of AcceptToMemoryPool are repeated, and the stored coins, fee and sigop
+ * cost must match the current view. Returns false to let AcceptToMemoryPool decide.
+ */
+static bool AddMempoolSnapshotEntry(CTxMemPool& pool, const CMempoolSnapshotEntry& entrySnapshot)
+{
+    AssertLockHeld(cs_main);
+    LOCK(pool.cs);
+
+    int nextBlockHeight = chainActive.Height() + 1;
+    const CTransaction& tx = *entrySnapshot.tx;
+    const uint256 hash = tx.GetHash();
+    CValidationState state;
+
+    if (!ContextualCheckTransactionWithoutProofVerification(tx, state, nextBlockHeight, 10) || tx.IsCoinBase())
+        return false;
+    std::string reason;
+    if (Params().RequireStandard() && !IsStandardTx(tx, reason))
+        return false;
+    if (!CheckFinalTx(tx, STANDARD_LOCKTIME_VERIFY_FLAGS))
+        return false;
+    if (pool.exists(hash))
+        return false;
+    for (const CTxIn& txin : tx.vin) {
+        if (pool.mapNextTx.count(txin.prevout))
+            return false;
+    }
+    for (const SpendDescription& spendDescription : tx.vShieldedSpend) {
+        if (pool.nullifierExists(spendDescription.nullifier, SAPLING))
+            return false;
+    }
+
+    CCoinsView dummy;
+    CCoinsViewCache view(&dummy);
+    {
+        CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
+        view.SetBackend(viewMemPool);
+        if (tx.vout.size() > 0 && view.HaveCoin(COutPoint(hash, 0)))
+            return false;
+        if (!view.HaveInputs(tx) || !view.HaveShieldedRequirements(tx))
+            return false;
+        for (unsigned int i = 0; i < tx.vin.size(); i++) {
+            const Coin& coin = view.AccessCoin(tx.vin[i].prevout);
+            const Coin& coinSnapshot = entrySnapshot.vCoins[i];
+            if (!(coin.out == coinSnapshot.out) || coin.nHeight != coinSnapshot.nHeight || coin.IsCoinBase() != coinSnapshot.IsCoinBase())
+                return false;
+        }
+        view.GetBestBlock();
+        view.SetBackend(dummy);
+    }
+
+    if (Params().RequireStandard() && !AreInputsStandard(tx, view))
+        return false;
+    int64_t nSigOps = GetLegacySigOpCount(tx) + GetP2SHSigOpCount(tx, view);
+    if (nSigOps != entrySnapshot.nSigOpCost || nSigOps > MAX_STANDARD_TX_SIGOPS)
+        return false;
+    CAmount nFees = view.GetValueIn(tx) - tx.GetValueOut();
+    if (nFees != entrySnapshot.nFee)
+        return false;
+
+    // Values and coinbase maturity, the scripts were checked against the stored coins
+    PrecomputedTransactionData txdata(tx);
+    if (!ContextualCheckInputs(tx, state, view, cluepool, false, STANDARD_SCRIPT_VERIFY_FLAGS, true, txdata, Params().GetConsensus(), NULL))
+        return false;
+
+    bool fSpendsCoinbase = false;
+    for (const Coin& coin : entrySnapshot.vCoins) {
+        if (coin.IsCoinBase()) {
+            fSpendsCoinbase = true;
+            break;
+        }
+    }
+
+    CTxMemPoolEntry entry(entrySnapshot.tx, nFees, entrySnapshot.nTime, chainActive.Height(),
+                          fSpendsCoinbase, nSigOps, LockPoints(), entrySnapshot.nMinGasPrice, entrySnapshot.nGasLimit);
+    unsigned int nSize = entry.GetTxSize();
+    // Low fee transactions go through the rate limiter of AcceptToMemoryPool
+    if (nFees < GetMinRelayFee(tx, nSize, true) || nFees < ::minRelayTxFee.GetFee(nSize))
+        return false;
+
+    // The package limits may have changed since the dump
+    CTxMemPool::setEntries setAncestors;
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT) * 1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT) * 1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString))
+        return false;
+    if (!pool.CheckClusterLimit(entry, errString))
+        return false;
+
+    pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+    pool.addAddressIndex(entry, view);
+    pool.addSpentIndex(entry, view);
+
+    GetMainSignals().TransactionAddedToMempool(entrySnapshot.tx);
+    return true;
+}
+
+/**
+ * Loads the transactions of a snapshot mempool.dat. Their scripts and shielded proofs
+ * are checked against the stored coins on worker threads, and the transactions are
+ * added in file order so parents always come before their children.
+ */
+class CMempoolSnapshotLoader
+{
+private:
+    int64_t nExpiryTimeout;
+    int64_t nNow;
+    bool fTipMatches;
+
+    /** Contract, clue, bid and vote transactions depend on more than their inputs */
+    static bool IsFastPathEligible(const CTransaction& tx)
+    {
+        return !tx.HasCreateOrCall() && !tx.IsCoinClue() && tx.nFlag != CTransaction::CLUE_TX &&
+               tx.nFlag != CTransaction::BID_TX && tx.nFlag != CTransaction::TANDIA_TX;
+    }
+
+public:
+    std::vector<CMempoolSnapshotEntry> vEntries;
+    int64_t count;
+    int64_t expired;
+    int64_t failed;
+    int64_t already_there;
+    int64_t fast;
+    bool fInterrupted;
+
+    CMempoolSnapshotLoader(int64_t nExpiryTimeoutIn, int64_t nNowIn, bool fTipMatchesIn)
+        : nExpiryTimeout(nExpiryTimeoutIn), nNow(nNowIn), fTipMatches(fTipMatchesIn), count(0), expired(0), failed(0), already_there(0), fast(0), fInterrupted(false) {}
+
+    /** Runs on the worker threads, a failed check only leaves the entry to AcceptToMemoryPool */
+    bool Verify(size_t i)
+    {
+        CMempoolSnapshotEntry& entry = vEntries[i];
+        const CTransaction& tx = *entry.tx;
+        if (!fTipMatches || entry.nTime + nExpiryTimeout <= nNow || !IsFastPathEligible(tx) || entry.vCoins.size() != tx.vin.size())
+            return true;
+
+        CValidationState state;
+        auto verifier = libzcash::ProofVerifier::Disabled();
+        if (!CheckTransaction(tx, state, verifier) || !CheckShieldedProofs(tx, state))
+            return true;
+
+        PrecomputedTransactionData txdata(tx);
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            const Coin& coin = entry.vCoins[j];
+            if (coin.IsSpent())
+                return true;
+            CScriptCheck check(coin.out.scriptPubKey, coin.out.nValue, tx, j, STANDARD_SCRIPT_VERIFY_FLAGS, true, &txdata);
+            if (!check())
+                return true;
+        }
+        entry.fVerified = true;
+        return true;
+    }
+
+    /** Runs in file order */
+    bool Deliver(size_t i)
+    {
+        CMempoolSnapshotEntry& entry = vEntries[i];
+        if (entry.nFeeDelta) {
+            mempool.PrioritiseTransaction(entry.tx->GetHash(), entry.nFeeDelta);
+        }
+        if (entry.nTime + nExpiryTimeout > nNow) {
+            LOCK(cs_main);
+            if (entry.fVerified && AddMempoolSnapshotEntry(mempool, entry)) {
+                ++count;
+                ++fast;
+            } else {
+                CValidationState state;
+                AcceptToMemoryPoolWithTime(mempool, state, entry.tx, true, nullptr /* pfMissingInputs */, entry.nTime,
+                                           nullptr /* plTxnReplaced */);
+                if (state.IsValid()) {
+                    ++count;
+                } else if (mempool.exists(entry.tx->GetHash())) {
+                    ++already_there;
+                } else {
+                    ++failed;
+                }
+            }
+        } else {
+            ++expired;
+        }
+        entry.tx.reset();
+        entry.vCoins.clear();
+        if (ShutdownRequested()) {
+            fInterrupted = true;
+            return false;
+        }
+        return true;
+    }
+};
 
 bool LoadMempool(void)
 {
@@ -6674,6 +10143,46 @@ bool LoadMempool(void)
     try {
         uint64_t version;
         file >> version;
+        if (version == MEMPOOL_DUMP_VERSION_SNAPSHOT) {
+            uint256 hashTip;
+            file >> hashTip;
+            bool fTipMatches;
+            {
+                LOCK(cs_main);
+                fTipMatches = chainActive.Tip() && chainActive.Tip()->GetBlockHash() == hashTip;
+            }
+            CMempoolSnapshotLoader loader(nExpiryTimeout, nNow, fTipMatches);
+            uint64_t num;
+            file >> num;
+            loader.vEntries.reserve(std::min<uint64_t>(num, 1000000));
+            while (num--) {
+                loader.vEntries.push_back(CMempoolSnapshotEntry());
+                file >> loader.vEntries.back();
+            }
+            std::map<uint256, CAmount> mapDeltas;
+            file >> mapDeltas;
+
+            if (!loader.vEntries.empty()) {
+                int nThreads = GetArg("-loadmempoolthreads", DEFAULT_LOADMEMPOOL_THREADS);
+                boost::function<bool(size_t)> verify = boost::bind(&CMempoolSnapshotLoader::Verify, &loader, _1);
+                COrderedJobRunner runner(loader.vEntries.size(), loader.vEntries.size(), verify);
+                runner.Run(nThreads, boost::bind(&CMempoolSnapshotLoader::Deliver, &loader, _1));
+                if (loader.fInterrupted)
+                    return false;
+            }
+
+            for (const auto& i : mapDeltas) {
+                mempool.PrioritiseTransaction(i.first, i.second);
+            }
+            {
+                // Snapshot entries skip the size limit of AcceptToMemoryPool
+                LOCK(cs_main);
+                LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            }
+            LogPrintf("Imported mempool transactions from disk: %i succeeded (%i without script checks), %i failed, %i expired, %i already there%s\n",
+                      loader.count, loader.fast, loader.failed, loader.expired, loader.already_there, fTipMatches ? "" : ", tip changed since dump");
+            return true;
+        }
         if (version != MEMPOOL_DUMP_VERSION) {
             return false;
         }
@@ -6735,14 +10244,41 @@ bool DumpMempool(void)
     int64_t start = GetTimeMicros();
 
     std::map<uint256, CAmount> mapDeltas;
-    std::vector<TxMempoolInfo> vinfo;
+    std::vector<CMempoolSnapshotEntry> vEntries;
+    uint256 hashTip;
+    bool fSnapshot = GetBoolArg("-mempoolsnapshot", DEFAULT_MEMPOOL_SNAPSHOT);
 
     {
-        LOCK(mempool.cs);
+        LOCK2(cs_main, mempool.cs);
         for (const auto& i : mempool.mapDeltas) {
             mapDeltas[i.first] = i.second;
         }
-        vinfo = mempool.infoAll();
+        if (chainActive.Tip())
+            hashTip = chainActive.Tip()->GetBlockHash();
+
+        CCoinsViewMemPool viewMemPool(pcoinsTip, mempool);
+        std::vector<TxMempoolInfo> vinfo = mempool.infoAll();
+        vEntries.resize(vinfo.size());
+        for (size_t i = 0; i < vinfo.size(); i++) {
+            CMempoolSnapshotEntry& entry = vEntries[i];
+            entry.tx = vinfo[i].tx;
+            entry.nTime = vinfo[i].nTime;
+            entry.nFeeDelta = vinfo[i].nFeeDelta;
+            if (!fSnapshot)
+                continue;
+            CTxMemPool::txiter it = mempool.mapTx.find(entry.tx->GetHash());
+            if (it != mempool.mapTx.end()) {
+                entry.nFee = it->GetFee();
+                entry.nSigOpCost = it->GetSigOpCost();
+                entry.nMinGasPrice = it->GetMinGasPrice();
+                entry.nGasLimit = it->GetGasLimit();
+            }
+            // A missing coin is stored spent and sends the entry through AcceptToMemoryPool
+            entry.vCoins.resize(entry.tx->vin.size());
+            for (size_t j = 0; j < entry.tx->vin.size(); j++) {
+                viewMemPool.GetCoin(entry.tx->vin[j].prevout, entry.vCoins[j]);
+            }
+        }
     }
 
     int64_t mid = GetTimeMicros();
@@ -6755,14 +10291,20 @@ bool DumpMempool(void)
 
         CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
 
-        uint64_t version = MEMPOOL_DUMP_VERSION;
+        uint64_t version = fSnapshot ? MEMPOOL_DUMP_VERSION_SNAPSHOT : MEMPOOL_DUMP_VERSION;
         file << version;
+        if (fSnapshot)
+            file << hashTip;
 
-        file << (uint64_t)vinfo.size();
-        for (const auto& i : vinfo) {
-            file << *(i.tx);
-            file << (int64_t)i.nTime;
-            file << (int64_t)i.nFeeDelta;
+        file << (uint64_t)vEntries.size();
+        for (const auto& i : vEntries) {
+            if (fSnapshot) {
+                file << i;
+            } else {
+                file << i.tx;
+                file << i.nTime;
+                file << i.nFeeDelta;
+            }
             mapDeltas.erase(i.tx->GetHash());
         }
 
@@ -6799,8 +10341,8 @@ public:
 } instance_of_cmaincleanup;
 
 
-bool GetUTXOAtHeight(const CTxDestination& dest, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit)
+bool GetUTXOAtHeight(const CTxDestination& dest, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit, size_t nMaxResults)
 {
     CScript script = GetScriptForDestination(dest);
-    return GetUTXOAtHeight(script, nHeight, vTxOut, valueLimit);
+    return GetUTXOAtHeight(script, nHeight, vTxOut, valueLimit, nMaxResults);
 }
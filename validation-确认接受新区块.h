@@ -34,6 +34,7 @@
 #include <algorithm>
 #include <exception>
 #include <map>
+#include <memory>
 #include <set>
 #include <stdint.h>
 #include <string>
@@ -44,6 +45,7 @@
 
 #include <boost/unordered_map.hpp>
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 
 /////////////////////////////////////////// qtum
 #include <qtum/qtumstate.h>
@@ -71,6 +73,9 @@ using ExtractQtumTX = std::pair<std::vector<QtumTransaction>, std::vector<EthTra
 
 class CBlockIndex;
 class CBlockTreeDB;
+struct CAddressIndexQuery;
+template <typename Key, typename Value>
+struct CAddressIndexPage;
 class CBloomFilter;
 class CChainParams;
 class CCoinsViewDB;
@@ -109,6 +114,10 @@ static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = 101;
 static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 /** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
+/** Default for -mempoolclusters, group connected mempool transactions into fee-rate linearized clusters */
+static const bool DEFAULT_MEMPOOL_CLUSTERS = false;
+/** Default for -limitclustercount, max number of transactions in one mempool cluster */
+static const unsigned int DEFAULT_CLUSTER_LIMIT = 100;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
 /** Maximum kilobytes for transactions to store for processing during reorg */
@@ -124,6 +133,30 @@ static const unsigned int UNDOFILE_CHUNK_SIZE = 0x100000; // 1 MiB
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** Default for -prefetchthreads, threads reading upcoming blocks and their coins while connecting (0 = off) */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Default for -deferindexpow, check the proof of work of the last checkpoint and its stored ancestors in ThreadVerifyBlockIndexPoW */
+static const bool DEFAULT_DEFER_INDEX_POW = false;
+/** Default for -indexsnapshot, load the block index from the snapshot DumpBlockIndexSnapshot wrote when it is current */
+static const bool DEFAULT_INDEX_SNAPSHOT = false;
+/** Default for -reindexthreads, threads parsing and checking blocks while importing block files (0 = off) */
+static const int DEFAULT_REINDEX_THREADS = 4;
+/** Default for -reindexcache, megabytes of out of order blocks kept in memory while importing block files */
+static const int64_t DEFAULT_REINDEX_CACHE = 200;
+/** Default for -verifythreads, threads reading and checking blocks for checks 0 to 2 of -checklevel (0 = off) */
+static const int DEFAULT_VERIFY_THREADS = 4;
+/** Default for -verifybackground, run checks 3 and 4 of -checklevel in the background after startup */
+static const bool DEFAULT_VERIFY_BACKGROUND = false;
+/** Default for -txlookupcache, megabytes of transactions read through -txindex kept decoded (0 = off) */
+static const int64_t DEFAULT_TX_LOOKUP_CACHE = 32;
+/** Threads reading blocks for a light wallet range request (0 = read on the calling thread) */
+static const int DEFAULT_MERKLE_RANGE_THREADS = 4;
+/** Default for -asyncindexwrite, commit the per-block index batches behind the chainstate on a background thread */
+static const bool DEFAULT_ASYNC_INDEX_WRITE = false;
+/** Default for -vmlogmaxsize, megabytes after which the VM execution log moves to a new file (0 = no limit) */
+static const int64_t DEFAULT_VMLOG_MAX_SIZE = 128;
+/** Default for -vmlogrotateheight, blocks after which the VM execution log moves to a new file (0 = no limit) */
+static const int DEFAULT_VMLOG_ROTATE_HEIGHT = 10000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -167,6 +200,10 @@ static const bool DEFAULT_SPENTINDEX = true;
 static const unsigned int DEFAULT_BANSCORE_THRESHOLD = 100;
 /** Default for -persistmempool */
 static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -loadmempoolthreads, threads checking the scripts and proofs of persisted mempool transactions (0 = off) */
+static const int DEFAULT_LOADMEMPOOL_THREADS = 4;
+/** Default for -mempoolsnapshot, write mempool.dat with the tip and spent coins so the next start can skip the script checks */
+static const bool DEFAULT_MEMPOOL_SNAPSHOT = false;
 
 static const bool DEFAULT_TESTSAFEMODE = false;
 /** Default for -mempoolreplacement */
@@ -225,6 +262,8 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+/** Whether the height-versioned address UTXO index covers the whole chain */
+extern bool fAddressUtxoHeightIndex;
 extern bool fLogEvents;
 extern bool fIsBareMultisigStd;
 extern bool fRequireStandard;
@@ -320,7 +359,10 @@ FILE* OpenBlockFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos& pos, bool fReadOnly = false);
 /** Translation to a filesystem path */
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos& pos, const char* prefix);
-/** Import blocks from an external file */
+/**
+ * Import blocks from an external file. Blocks are parsed and checked on
+ * -reindexthreads threads and the chain is activated once per chunk of blocks.
+ */
 bool LoadExternalBlockFile(const CChainParams& chainparams, FILE* fileIn, CDiskBlockPos* dbp = NULL);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex(const CChainParams& chainparams);
@@ -330,6 +372,18 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the block connect checking thread (shielded proofs, index entries); the checks run inline while none is running */
+void ThreadConnectCheck();
+/** Wait until every block index batch queued for the background writer is on disk */
+void SyncIndexWriter();
+/** Run the background writer of the VM execution logs (-record-log-opcodes) */
+void ThreadVMLogWriter();
+/** Check the proof of work of the stored headers LoadBlockIndex deferred (-deferindexpow), start after loading */
+void ThreadVerifyBlockIndexPoW();
+/** Run checks 3 and 4 CVerifyDB left to the background (-verifybackground), start after loading */
+void ThreadVerifyDBChainState();
+/** Bring the block indexes up to the chain tip if the last batches were lost, LoadBlockIndex calls it once the tip is known */
+bool ReplayBlockIndexJournal(const CChainParams& chainparams);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core.
@@ -340,11 +394,28 @@ bool IsInitialBlockDownload();
  * This function only returns the highest priority warning of the set selected by strFor.
  */
 std::string GetWarnings(const std::string& strFor);
-/** Retrieve a transaction (from memory pool, or from disk, if possible) */
+/** Retrieve a transaction (from memory pool, or from disk, if possible). Only fAllowSlow needs cs_main. */
 bool GetTransaction(const uint256& hash, CTransactionRef& tx, const Consensus::Params& params, uint256& hashBlock, bool fAllowSlow = false);
+/**
+ * GetTransaction without fAllowSlow for several transactions, reading the ones
+ * not in memory in block file order. vtx[i] stays null for a transaction that was
+ * not found. Returns the number found.
+ */
+size_t GetTransactions(const std::vector<uint256>& vHash, std::vector<CTransactionRef>& vtx, std::vector<uint256>& vHashBlock, const Consensus::Params& params);
 bool GetMerkleTransaction(const uint256& hash, CMerkleTransaction& txOut, const Consensus::Params& consensusParams);
 bool GetMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char>>& filterdTxids, std::vector<CMerkleTxBlock>& output);
 bool GetSampleMerkleTransactionWithAnonymous(const int blockHeight, std::map<int, std::map<uint256, char>>& filterdTxids, std::vector<CMerkleTxBlockSample>& output);
+/** Receives the blocks of a range request in height order, return false to stop */
+typedef boost::function<bool(int nHeight, const CMerkleTxBlock& block)> MerkleTxBlockSink;
+typedef boost::function<bool(int nHeight, const CMerkleTxBlockSample& block)> MerkleTxBlockSampleSink;
+/**
+ * GetMerkleTransactionWithAnonymous for the heights [nFrom, nTo] of the
+ * active chain. nThreads threads read the blocks ahead outside cs_main and
+ * the results are passed to sink as soon as they are ready, in order.
+ */
+bool GetMerkleTransactionRangeWithAnonymous(int nFrom, int nTo, const std::map<int, std::map<uint256, char> >& filterdTxids, const MerkleTxBlockSink& sink, int nThreads = DEFAULT_MERKLE_RANGE_THREADS);
+/** GetSampleMerkleTransactionWithAnonymous for the heights [nFrom, nTo], see GetMerkleTransactionRangeWithAnonymous */
+bool GetSampleMerkleTransactionRangeWithAnonymous(int nFrom, int nTo, const std::map<int, std::map<uint256, char> >& filterdTxids, const MerkleTxBlockSampleSink& sink, int nThreads = DEFAULT_MERKLE_RANGE_THREADS);
 
 /** Find the best known block, and make it the tip of the block chain */
 bool ActivateBestChain(CValidationState& state, const CChainParams& chainparams, std::shared_ptr<const CBlock> pblock = std::shared_ptr<const CBlock>());
@@ -636,11 +707,50 @@ public:
     }
 };
 
+/**
+ * Closure representing one unit of block validation work that does not touch
+ * the coins views (Sapling proof verification, address/spent index entry
+ * construction). Checks are run by the connect check queue alongside the
+ * script checks; results that must be merged are written to caller-owned slots.
+ */
+class CConnectCheck
+{
+private:
+    boost::function<bool()> func;
+
+public:
+    CConnectCheck() {}
+    explicit CConnectCheck(const boost::function<bool()>& funcIn) : func(funcIn) {}
+
+    bool operator()()
+    {
+        return func.empty() || func();
+    }
+
+    void swap(CConnectCheck& check)
+    {
+        func.swap(check.func);
+    }
+};
+
 bool GetIndexKey(const CScript& scritPubKey, uint160& hashBytes, txnouttype& type);
 bool GetSpentIndex(CSpentIndexKey& key, CSpentIndexValue& value);
 bool GetAddressIndex(uint160 addressHash, int type,
                      std::vector<std::pair<CAddressIndexKey, CAmount> >& addressIndex,
                      int start = 0, int end = 0);
+/** CBlockTreeDB::ReadAddressUnspentIndex, including batches not yet written by the background index writer */
+bool GetAddressUnspent(uint160 addressHash, int type,
+                       std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >& unspentOutputs);
+/** One page of the address index of an address, see CBlockTreeDB::ReadAddressIndexPage */
+bool GetAddressIndexPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                         const CAddressIndexKey* pkeyAfter, CAddressIndexPage<CAddressIndexKey, CAmount>& page);
+/** One page of the unspent outputs of an address, see CBlockTreeDB::ReadAddressUnspentIndexPage */
+bool GetAddressUnspentPage(uint160 addressHash, int type, const CAddressIndexQuery& query,
+                           const CAddressUnspentKey* pkeyAfter, CAddressIndexPage<CAddressUnspentKey, CAddressUnspentValue>& page);
+/** CBlockTreeDB::ReadHeightIndex, including batches not yet written by the background index writer */
+int ReadHeightIndex(int low, int high, int minconf,
+                    std::vector<std::vector<uint256> >& blocksOfHashes,
+                    const std::set<dev::h160>& addresses);
 
 struct CUtxo {
     uint256 txid;
@@ -651,13 +761,35 @@ struct CUtxo {
     CUtxo() {}
 };
 
-bool GetUTXOAtHeight(const CTxDestination& dest, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit = 0);
-bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit = 0);
+/** Outputs of an address unspent at the end of block nHeight worth at least valueLimit, at most nMaxResults of them (0 = all) */
+bool GetUTXOAtHeight(const CTxDestination& dest, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit = 0, size_t nMaxResults = 0);
+bool GetUTXOAtHeight(const CScript& script, const int nHeight, std::vector<CUtxo>& vTxOut, const CAmount& valueLimit = 0, size_t nMaxResults = 0);
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(const CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos, const Consensus::Params& consensusParams);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex, const Consensus::Params& consensusParams);
 
+/** The bytes of a block or undo file entry as stored, valid while the span or a copy of it lives */
+class CBlockFileSpan
+{
+private:
+    std::shared_ptr<const void> holder; //!< Keeps the file mapping or buffer alive
+    const unsigned char* pbegin;
+    size_t nSize;
+
+public:
+    CBlockFileSpan() : pbegin(nullptr), nSize(0) {}
+    CBlockFileSpan(std::shared_ptr<const void> holderIn, const unsigned char* pbeginIn, size_t nSizeIn) : holder(holderIn), pbegin(pbeginIn), nSize(nSizeIn) {}
+
+    const unsigned char* begin() const { return pbegin; }
+    const unsigned char* end() const { return pbegin + nSize; }
+    size_t size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+};
+
+/** The serialized block at pos without decoding it, e.g. to send it to a peer as is */
+bool ReadRawBlockFromDisk(CBlockFileSpan& span, const CDiskBlockPos& pos);
+
 /** Functions for validating blocks and updating the block tree */
 
 /** Reprocess a number of blocks to try and get on the correct chain again **/
@@ -683,6 +815,9 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState& state,
 /** Check a transaction contextually against a set of consensus rules */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState& state, int nHeight, int dosLevel,
                                 bool (*isInitBlockDownload)() = IsInitialBlockDownload);
+bool ContextualCheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState& state, int nHeight, int dosLevel);
+/** Verify the Sapling spend/output proofs and binding signature of a transaction */
+bool CheckShieldedProofs(const CTransaction& tx, CValidationState& state);
 
 bool CheckClueParentsRelationship(const CClueFamilyTree& tree, const std::vector<CTxDestination>& parents, CValidationState& state);
 bool ContextualCheckClueTransaction(const CTransaction& tx, CValidationState& state, const CCoinsViewCache& inputs, const CClueViewCache& clueinputs, const Consensus::Params& consensusParams, const int nHeight);
@@ -690,7 +825,11 @@ bool ContextualCheckClueTransaction(const CTransaction& tx, CValidationState& st
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState& state, const CChainParams& chainparams, const CBlock& block, CBlockIndex* pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
-/** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
+/**
+ * RAII wrapper for VerifyDB: Verify consistency of the block and coin databases.
+ * Checks 0 to 2 run on -verifythreads threads and a run interrupted by shutdown
+ * resumes where it stopped. Checks 3 and 4 may be left to ThreadVerifyDBChainState.
+ */
 class CVerifyDB
 {
 public:
@@ -710,6 +849,7 @@ public:
  */
 bool RewindBlockIndex(const CChainParams& params, bool& clearWitnessCaches);
 
+/** Apply the effects of this block to view. With fJustCheck only the views are changed: tandia votes are checked and taken back, ads, receipts and indexes stay as they are */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, CClueViewCache& clueview, bool fJustCheck = false);
 
 /** Find the last common block between the parameter chain and a locator. */
@@ -759,12 +899,19 @@ int32_t ComputeBlockVersion(const CBlockIndex* pindexPrev, const Consensus::Para
 bool GetBlockHash(uint256& hashRet, int nBlockHeight = -1);
 
 bool IsBlockInMainChain(const uint256& blockhash, int& nBlockHeight);
-/** Dump the mempool to disk. */
+/** Dump the mempool to disk, with the tip and the coins each transaction spends if -mempoolsnapshot is set. */
 bool DumpMempool();
 
-/** Load the mempool from disk. */
+/**
+ * Load the mempool from disk. If the tip has not changed since the dump, the
+ * scripts and proofs are checked against the stored coins on -loadmempoolthreads
+ * and only the cheap checks of AcceptToMemoryPool are repeated.
+ */
 bool LoadMempool();
 
+/** Write the block index to the snapshot LoadBlockIndex starts from, call at shutdown after the final flush. */
+bool DumpBlockIndexSnapshot();
+
 /** Reject codes greater or equal to this can be returned by AcceptToMemPool
  * for transactions, to signal internal conditions. They cannot and should not
  * be sent over the P2P network.
@@ -779,6 +926,21 @@ static const unsigned int REJECT_CONFLICT = 0x102;
 //////////////////////////////////////////////////////// qtum
 std::vector<ResultExecute> CallContract(const dev::Address& addrContract, std::vector<unsigned char> opcode, const dev::Address& sender = dev::Address(), uint64_t gasLimit = 0);
 
+/** One read only call, see CallContract */
+struct CContractCall {
+    dev::Address addrContract;
+    std::vector<unsigned char> opcode;
+    dev::Address sender;
+    uint64_t gasLimit = 0;
+};
+
+/**
+ * Run several read only calls in one go against the state at hashStateRoot and
+ * hashUTXORoot (the tip's where null), with the environment of the block after
+ * the tip. The tip block is only read again when the tip changes.
+ */
+std::vector<std::vector<ResultExecute> > CallContracts(const std::vector<CContractCall>& vCalls, const uint256& hashStateRoot = uint256(), const uint256& hashUTXORoot = uint256());
+
 bool CheckSenderScript(const CCoinsViewCache& view, const CTransaction& tx);
 
 bool CheckMinGasPrice(std::vector<EthTransactionParams>& etps, const uint64_t& minGasPrice);
@@ -846,7 +1008,7 @@ class ByteCodeExec
 
 public:
 
-    ByteCodeExec(const CBlock& _block, std::vector<QtumTransaction> _txs, const uint64_t _blockGasLimit) : txs(_txs), block(_block), blockGasLimit(_blockGasLimit) {}
+    ByteCodeExec(const CBlock& _block, std::vector<QtumTransaction> _txs, const uint64_t _blockGasLimit) : txs(_txs), block(_block), blockGasLimit(_blockGasLimit), fEnvInfo(false), fCommit(true) {}
 
     bool performByteCode(dev::eth::Permanence type = dev::eth::Permanence::Committed);
 
@@ -857,10 +1019,23 @@ public:
         return result;
     }
 
-private:
-
     dev::eth::EnvInfo BuildEVMEnvironment();
 
+    /** Use env, e.g. one kept for the tip, instead of building it for every transaction */
+    void SetEnvInfo(const dev::eth::EnvInfo& env)
+    {
+        envInfoSet = env;
+        fEnvInfo = true;
+    }
+
+    /** Leave committing the state databases to the caller, e.g. once per block */
+    void DeferCommit()
+    {
+        fCommit = false;
+    }
+
+private:
+
     dev::Address EthAddrFromScript(const CScript& scriptIn);
 
     std::vector<QtumTransaction> txs;
@@ -871,6 +1046,12 @@ private:
 
     const uint64_t blockGasLimit;
 
+    dev::eth::EnvInfo envInfoSet;
+
+    bool fEnvInfo;
+
+    bool fCommit;
+
 };
 
 ////////////////////////////////////////////////////////